@@ -1,15 +1,21 @@
 function configure()
     configurations { "Debug", "Release" }
-    platforms { "Win32", "x64" }
+    platforms { "Win32", "x64", "Linux64" }
 
-    filter "platforms:*32"
+    filter "platforms:Win32"
         system "Windows"
         architecture "x86"
 
-    filter "platforms:*64"
+    filter "platforms:x64"
         system "Windows"
         architecture "x86_64"
 
+    filter "platforms:Linux64"
+        system "Linux"
+        architecture "x86_64"
+        buildoptions { "-std=c++14", "-pthread" }
+        linkoptions { "-pthread" }
+
     filter {}
     
     flags { "ExtraWarnings", "FatalWarnings" }
@@ -55,3 +61,17 @@ staticLibrary "CpuTrace"
     {
         "src/**.h", "src/**.cpp"
     }
+
+application "TraceDiff"
+    files
+    {
+        "tools/TraceDiff.cpp"
+    }
+    links { "CpuTrace" }
+
+application "Benchmark"
+    files
+    {
+        "tools/Benchmark.cpp"
+    }
+    links { "CpuTrace" }
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "CpuTrace.h"
+#include <cstring>
+
+namespace CpuTrace
+{
+    // Layout of the raw memory access records written by CaptureWriter: a header word holding the command, the low byte of
+    // the access type and the number of payload words, followed by the address and the value.
+    namespace RawAccess
+    {
+        enum
+        {
+            Read8 = 6,
+            Read16,
+            Read32,
+            Write8,
+            Write16,
+            Write32,
+            PayloadWords = 2,
+            Size = (1 + PayloadWords) * sizeof(uint32_t),
+        };
+    }
+
+    // Inlined capture front end. Memory accesses are written straight into the record buffer of the capture with a single
+    // capacity check, everything else goes through ICapture. The writer must be flushed before the capture is used directly
+    // or stopped.
+    class CaptureWriter
+    {
+    public:
+        explicit CaptureWriter(ICapture& capture)
+            : mCapture(capture)
+            , mPos(nullptr)
+            , mEnd(nullptr)
+            , mDirect(true)
+        {
+        }
+
+        ~CaptureWriter()
+        {
+            flush();
+        }
+
+        ICapture& getCapture()
+        {
+            return mCapture;
+        }
+
+        // Hands the records written so far back to the capture
+        void flush()
+        {
+            if (mPos)
+            {
+                mCapture.endWrite(mPos);
+                mPos = nullptr;
+                mEnd = nullptr;
+            }
+        }
+
+        void invalidateState()
+        {
+            flush();
+            mCapture.invalidateState();
+        }
+
+        void execute()
+        {
+            if (!mPos)
+            {
+                mCapture.execute();
+            }
+            else if (!mCapture.executeWrite(mPos, mEnd))
+            {
+                mPos = nullptr;
+                mEnd = nullptr;
+            }
+        }
+
+        void interrupt(uint32_t type)
+        {
+            flush();
+            mCapture.interrupt(type);
+        }
+
+        void signal(uint32_t type)
+        {
+            flush();
+            mCapture.signal(type);
+        }
+
+        void sync(uint64_t time)
+        {
+            flush();
+            mCapture.sync(time);
+        }
+
+        void readRange(uint32_t addr, const void* data, uint32_t size, uint32_t count, uint32_t type)
+        {
+            flush();
+            mCapture.readRange(addr, data, size, count, type);
+        }
+
+        void writeRange(uint32_t addr, const void* data, uint32_t size, uint32_t count, uint32_t type)
+        {
+            flush();
+            mCapture.writeRange(addr, data, size, count, type);
+        }
+
+        void readGather(const uint32_t* addrs, const void* data, uint32_t size, uint32_t count, uint32_t type)
+        {
+            flush();
+            mCapture.readGather(addrs, data, size, count, type);
+        }
+
+        void writeScatter(const uint32_t* addrs, const void* data, uint32_t size, uint32_t count, uint32_t type)
+        {
+            flush();
+            mCapture.writeScatter(addrs, data, size, count, type);
+        }
+
+        bool dump(IStream& stream)
+        {
+            flush();
+            return mCapture.dump(stream);
+        }
+
+        void read8(uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (!write(RawAccess::Read8, addr, value, type))
+                mCapture.read8(addr, value, type);
+        }
+
+        void read16(uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (!write(RawAccess::Read16, addr, value, type))
+                mCapture.read16(addr, value, type);
+        }
+
+        void read32(uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (!write(RawAccess::Read32, addr, value, type))
+                mCapture.read32(addr, value, type);
+        }
+
+        void write8(uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (!write(RawAccess::Write8, addr, value, type))
+                mCapture.write8(addr, value, type);
+        }
+
+        void write16(uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (!write(RawAccess::Write16, addr, value, type))
+                mCapture.write16(addr, value, type);
+        }
+
+        void write32(uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (!write(RawAccess::Write32, addr, value, type))
+                mCapture.write32(addr, value, type);
+        }
+
+    private:
+        CaptureWriter(const CaptureWriter&);
+        CaptureWriter& operator=(const CaptureWriter&);
+
+        bool write(uint32_t command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (static_cast<size_t>(mEnd - mPos) < RawAccess::Size)
+            {
+                if (!refill())
+                    return false;
+            }
+
+            auto pos = mPos;
+            writeWord(pos, command | ((type & 0xff) << 8) | (RawAccess::PayloadWords << 16));
+            writeWord(pos + sizeof(uint32_t), addr);
+            writeWord(pos + 2 * sizeof(uint32_t), value);
+            mPos = pos + RawAccess::Size;
+            return true;
+        }
+
+        static void writeWord(uint8_t* pos, uint32_t value)
+        {
+            memcpy(pos, &value, sizeof(value));
+        }
+
+        // Captures that encode records themselves never give out their buffer
+        bool refill()
+        {
+            if (!mDirect)
+                return false;
+            flush();
+            uint8_t* begin = nullptr;
+            uint8_t* end = nullptr;
+            if (!mCapture.beginWrite(begin, end))
+            {
+                mDirect = false;
+                return false;
+            }
+            mPos = begin;
+            mEnd = end;
+            return true;
+        }
+
+        ICapture&   mCapture;
+        uint8_t*    mPos;
+        uint8_t*    mEnd;
+        bool        mDirect;
+    };
+}
@@ -0,0 +1,233 @@
+#include "Compression.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    const uint32_t HashBits = 16;
+    const uint32_t WindowSize = 1 << 16;
+    const uint32_t MinMatch = 4;
+    // The last bytes are always literals so matches never read past the end
+    const size_t LastLiterals = 5;
+    const size_t MatchSearchLimit = 12;
+
+    uint32_t read32(const uint8_t* pos)
+    {
+        uint32_t value;
+        memcpy(&value, pos, sizeof(value));
+        return value;
+    }
+
+    uint32_t hash(uint32_t value)
+    {
+        return (value * 2654435761u) >> (32 - HashBits);
+    }
+
+    size_t countMatch(const uint8_t* pos, const uint8_t* match, const uint8_t* limit)
+    {
+        auto start = pos;
+        while ((pos + sizeof(uint32_t) <= limit) && (read32(pos) == read32(match)))
+        {
+            pos += sizeof(uint32_t);
+            match += sizeof(uint32_t);
+        }
+        while ((pos < limit) && (*pos == *match))
+        {
+            ++pos;
+            ++match;
+        }
+        return static_cast<size_t>(pos - start);
+    }
+
+    uint8_t* writeLength(uint8_t* pos, size_t length)
+    {
+        while (length >= 255)
+        {
+            *pos++ = 255;
+            length -= 255;
+        }
+        *pos++ = static_cast<uint8_t>(length);
+        return pos;
+    }
+
+    bool readLength(const uint8_t*& pos, const uint8_t* end, size_t& length)
+    {
+        for (;;)
+        {
+            if (pos == end)
+                return false;
+            uint32_t byte = *pos++;
+            length += byte;
+            if (byte != 255)
+                return true;
+        }
+    }
+
+    // Writes literals and an optional match, returns nullptr if the output does not have enough room
+    uint8_t* writeSequence(uint8_t* pos, uint8_t* end, const uint8_t* literals, size_t literalCount, size_t offset, size_t matchLength)
+    {
+        auto worstSize = 1 + literalCount / 255 + 1 + literalCount + 2 + matchLength / 255 + 1;
+        if (static_cast<size_t>(end - pos) < worstSize)
+            return nullptr;
+
+        auto token = pos++;
+        auto matchCode = matchLength ? matchLength - MinMatch : 0;
+        *token = static_cast<uint8_t>((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(matchCode, 15));
+        if (literalCount >= 15)
+            pos = writeLength(pos, literalCount - 15);
+        memcpy(pos, literals, literalCount);
+        pos += literalCount;
+        if (!matchLength)
+            return pos;
+
+        *pos++ = static_cast<uint8_t>(offset);
+        *pos++ = static_cast<uint8_t>(offset >> 8);
+        if (matchCode >= 15)
+            pos = writeLength(pos, matchCode - 15);
+        return pos;
+    }
+}
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        Compressor::Compressor(uint32_t level)
+            : mDepth(1u << ((level < 1 ? 1 : level > MaxLevel ? MaxLevel : level) - 1))
+            , mHead(1 << HashBits, 0)
+            , mChain(mDepth > 1 ? WindowSize : 0, 0)
+        {
+        }
+
+        size_t Compressor::compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity)
+        {
+            // Positions are stored plus one so zero means empty
+            std::fill(mHead.begin(), mHead.end(), 0);
+
+            auto out = dst;
+            auto outEnd = dst + capacity;
+            size_t anchor = 0;
+            size_t pos = 0;
+            auto searchEnd = size > MatchSearchLimit ? size - MatchSearchLimit : 0;
+            auto matchLimit = src + (size > LastLiterals ? size - LastLiterals : 0);
+            while (pos < searchEnd)
+            {
+                auto value = read32(src + pos);
+                auto& head = mHead[hash(value)];
+                auto candidate = head;
+                head = static_cast<uint32_t>(pos + 1);
+                if (mDepth > 1)
+                    mChain[pos & (WindowSize - 1)] = candidate;
+
+                size_t bestLength = 0;
+                size_t bestOffset = 0;
+                for (uint32_t depth = mDepth; candidate && depth; --depth)
+                {
+                    size_t match = candidate - 1;
+                    auto offset = pos - match;
+                    if (offset >= WindowSize)
+                        break;
+                    if (read32(src + match) == value)
+                    {
+                        auto length = MinMatch + countMatch(src + pos + MinMatch, src + match + MinMatch, matchLimit);
+                        if (length > bestLength)
+                        {
+                            bestLength = length;
+                            bestOffset = offset;
+                        }
+                    }
+                    if (mDepth == 1)
+                        break;
+                    auto next = mChain[match & (WindowSize - 1)];
+                    if (next >= candidate)
+                        break;
+                    candidate = next;
+                }
+
+                if (!bestLength)
+                {
+                    // Skip faster through data that does not compress
+                    pos += 1 + ((pos - anchor) >> 6);
+                    continue;
+                }
+
+                out = writeSequence(out, outEnd, src + anchor, pos - anchor, bestOffset, bestLength);
+                if (!out)
+                    return 0;
+
+                // Deeper searches also index the positions covered by the match
+                auto matchEnd = pos + bestLength;
+                if (mDepth > 1)
+                {
+                    for (++pos; (pos < matchEnd) && (pos < searchEnd); ++pos)
+                    {
+                        auto& entry = mHead[hash(read32(src + pos))];
+                        mChain[pos & (WindowSize - 1)] = entry;
+                        entry = static_cast<uint32_t>(pos + 1);
+                    }
+                }
+                pos = matchEnd;
+                anchor = pos;
+            }
+
+            out = writeSequence(out, outEnd, src + anchor, size - anchor, 0, 0);
+            if (!out || (out == outEnd))
+                return 0;
+            return static_cast<size_t>(out - dst);
+        }
+
+        bool decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t rawSize)
+        {
+            auto end = src + size;
+            auto out = dst;
+            auto outEnd = dst + rawSize;
+            while (src < end)
+            {
+                uint32_t token = *src++;
+                size_t literalCount = token >> 4;
+                if ((literalCount == 15) && !readLength(src, end, literalCount))
+                    return false;
+                if ((static_cast<size_t>(end - src) < literalCount) || (static_cast<size_t>(outEnd - out) < literalCount))
+                    return false;
+
+                // Copy in wide steps when both sides have room for the overrun
+                if ((literalCount <= 16) && (end - src >= 16) && (outEnd - out >= 16))
+                    memcpy(out, src, 16);
+                else
+                    memcpy(out, src, literalCount);
+                src += literalCount;
+                out += literalCount;
+                if (src == end)
+                    break;
+
+                if (end - src < 2)
+                    return false;
+                size_t offset = src[0] | (src[1] << 8);
+                src += 2;
+                size_t matchLength = token & 15;
+                if ((matchLength == 15) && !readLength(src, end, matchLength))
+                    return false;
+                matchLength += MinMatch;
+                if (!offset || (offset > static_cast<size_t>(out - dst)) || (static_cast<size_t>(outEnd - out) < matchLength))
+                    return false;
+
+                // Short offsets repeat a pattern, copy from a multiple of the offset at least 8 bytes back
+                auto copy = out;
+                auto copyEnd = out + matchLength;
+                auto distance = offset;
+                if (offset < 8)
+                {
+                    distance = offset * ((8 + offset - 1) / offset);
+                    for (auto patternEnd = std::min(copyEnd, out + distance); copy < patternEnd; ++copy)
+                        *copy = *(copy - offset);
+                }
+                for (; copy + 8 <= copyEnd; copy += 8)
+                    memcpy(copy, copy - distance, 8);
+                for (; copy < copyEnd; ++copy)
+                    *copy = *(copy - distance);
+                out = copyEnd;
+            }
+            return out == outEnd;
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "CpuTrace.h"
+#include <vector>
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        // Byte oriented LZ codec: sequences of literals followed by a match within the previous 64KB
+        class Compressor
+        {
+        public:
+            static const uint32_t MaxLevel = 9;
+
+            // Higher levels search more previous matches
+            explicit Compressor(uint32_t level);
+
+            // Returns the compressed size, or 0 when the data cannot be made smaller than the capacity
+            size_t compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity);
+
+        private:
+            uint32_t                mDepth;
+            std::vector<uint32_t>   mHead;
+            std::vector<uint32_t>   mChain;
+        };
+
+        // Returns false if the compressed data is corrupt or does not expand to exactly the given size
+        bool decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t rawSize);
+    }
+}
@@ -1,9 +1,28 @@
 #include "CpuTrace.h"
+#include "CaptureWriter.h"
+#include "Compression.h"
+#include "EventFilter.h"
+#include "MappedFile.h"
+#include "SegmentedBuffer.h"
 #include "Serializer.h"
+#include "SkipTable.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define CPUTRACE_SSE2 1
+#endif
+
 #include "../contrib/murmur3/murmur3.h"
 #include "../contrib/murmur3/murmur3.c"
 
@@ -18,23 +37,35 @@ namespace
         return static_cast<size_t>(value);
     }
 
+    // Stream over a segmented buffer, writing past the end grows it without moving what was already written
     class MemoryStream : public IStream
     {
     public:
-        const uint8_t* getData() const
+        explicit MemoryStream(const std::shared_ptr<SegmentPool>& pool)
+            : mBuffer(pool)
+            , mPos(0)
+        {
+        }
+
+        const SegmentedBuffer& getBuffer() const
+        {
+            return mBuffer;
+        }
+
+        SegmentedBuffer& getBuffer()
         {
-            return mBuffer.data();
+            return mBuffer;
         }
 
-        uint8_t* getData()
+        void clear()
         {
-            return mBuffer.data();
+            mBuffer.clear();
+            mPos = 0;
         }
 
         virtual void seek(uint64_t offset) override
         {
             mPos = offset;
-            ensure(mPos + 1);
         }
 
         virtual uint64_t size() const override
@@ -49,20 +80,16 @@ namespace
 
         virtual uint64_t write(const void* data, uint64_t size) override
         {
-            ensure(mPos + size);
-            memcpy(mBuffer.data() + mPos, data, to_size_t(size));
+            mBuffer.write(mPos, data, to_size_t(size));
             mPos += size;
             return size;
         }
 
         virtual uint64_t read(void* data, uint64_t size) override
         {
-            uint64_t capacity = static_cast<uint64_t>(mBuffer.size());
-            uint64_t maxSize = capacity - mPos;
-            if (size > maxSize)
-                size = maxSize;
-            memcpy(data, mBuffer.data() + mPos, to_size_t(size));
-            return size;
+            auto count = mBuffer.read(mPos, data, to_size_t(size));
+            mPos += count;
+            return count;
         }
 
         virtual void flush() override
@@ -70,15 +97,7 @@ namespace
         }
 
     private:
-        virtual void ensure(uint64_t size)
-        {
-            if (size > static_cast<uint64_t>(mBuffer.size()))
-            {
-                mBuffer.resize(to_size_t(size), 0);
-            }
-        }
-
-        std::vector<uint8_t>    mBuffer;
+        SegmentedBuffer         mBuffer;
         uint64_t                mPos;
     };
 
@@ -100,6 +119,211 @@ namespace
         Write8,
         Write16,
         Write32,
+        Fetch,
+        DefineBlock,
+        RepeatBlock,
+        Delta,
+        Sync,
+        Range,
+        Gather,
+    };
+
+    namespace StateFlag
+    {
+        enum
+        {
+            Keyframe = 1 << 0,
+        };
+    }
+
+    namespace ExecuteFlag
+    {
+        enum
+        {
+            NoHash = 1 << 0,
+        };
+    }
+
+    namespace Codec
+    {
+        enum
+        {
+            None,
+            Lz,
+        };
+    }
+
+    namespace HeaderField
+    {
+        enum
+        {
+            Magic,
+            Version,
+            DeviceVersion,
+            StateSize,
+            ChunkSize,
+            Encoding,
+            CodeType,
+            Compression,
+            StateHash,
+            VerifyMode,
+            VerifyInterval,
+            StreamCount,
+            COUNT
+        };
+    }
+
+    // Entries following the header fields, one per stream
+    namespace StreamField
+    {
+        enum
+        {
+            DeviceVersion,
+            StateSize,
+            FirstInstructionLow,
+            FirstInstructionHigh,
+            COUNT
+        };
+    }
+
+    // Filter of the capture following the stream entries, then the start and stop triggers and the address ranges
+    namespace FilterField
+    {
+        enum
+        {
+            AccessTypes,
+            Flags,
+            RangeCount,
+            COUNT
+        };
+    }
+
+    namespace FilterFlag
+    {
+        enum
+        {
+            DropInterrupts = 1 << 0,
+            DropSignals = 1 << 1,
+        };
+    }
+
+    namespace TriggerField
+    {
+        enum
+        {
+            Type,
+            First,
+            Last,
+            InstructionLow,
+            InstructionHigh,
+            COUNT
+        };
+    }
+
+    namespace RangeField
+    {
+        enum
+        {
+            First,
+            Last,
+            COUNT
+        };
+    }
+
+    namespace FooterField
+    {
+        enum
+        {
+            ChunkCount,
+            ChunkEntrySize,
+            KeyframeCount,
+            KeyframeEntrySize,
+            InstructionCountLow,
+            InstructionCountHigh,
+            COUNT
+        };
+    }
+
+    namespace ChunkField
+    {
+        enum
+        {
+            OffsetLow,
+            OffsetHigh,
+            Size,
+            RawSize,
+            Stream,
+            InstructionLow,
+            InstructionHigh,
+            HashLow,
+            HashHigh,
+            COUNT
+        };
+    }
+
+    namespace KeyframeField
+    {
+        enum
+        {
+            InstructionLow,
+            InstructionHigh,
+            Chunk,
+            Offset,
+            Stream,
+            COUNT
+        };
+    }
+
+    namespace TrailerField
+    {
+        enum
+        {
+            FooterOffsetLow,
+            FooterOffsetHigh,
+            Magic,
+            COUNT
+        };
+    }
+
+    // Counts at the start of a columnar chunk, followed by the columns
+    namespace ColumnField
+    {
+        enum
+        {
+            RecordCount,
+            AccessCount,
+            HashCount,
+            OtherCount,
+            RawCount,
+            COUNT
+        };
+    }
+
+    union CommandHeader
+    {
+        uint32_t        u32;
+        struct
+        {
+            uint8_t     command;
+            uint8_t     extra;
+            uint16_t    blocks;
+        }               fields;
+
+        static CommandHeader make(Command command, size_t blocks = 0, uint32_t extra = 0)
+        {
+            CommandHeader header = { 0 };
+            header.fields.command = static_cast<uint8_t>(command);
+            header.fields.blocks = static_cast<uint16_t>(blocks);
+            header.fields.extra = static_cast<uint8_t>(extra);
+            return header;
+        }
+
+        static CommandHeader from(uint32_t value)
+        {
+            CommandHeader header;
+            header.u32 = value;
+            return header;
+        }
     };
 
     template <size_t alignment>
@@ -118,249 +342,5256 @@ namespace
         return (value + mask) / alignment;
     }
 
-    class Trace : public ITrace
+    size_t blockCount(size_t size)
     {
-    public:
-        std::vector<uint32_t>& getBuffer()
+        return divideUp<sizeof(uint32_t)>(size);
+    }
+
+    uint64_t makeU64(uint32_t low, uint32_t high)
+    {
+        return static_cast<uint64_t>(low) | (static_cast<uint64_t>(high) << 32);
+    }
+
+    uint64_t getTime()
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+    }
+
+    // Content hash of chunks, never 0 which stands for an unknown hash
+    uint64_t hashBytes(const void* data, size_t size)
+    {
+        uint64_t hash[2];
+        MurmurHash3_x64_128(data, static_cast<int>(size), 0, hash);
+        return hash[0] ? hash[0] : 1;
+    }
+
+    bool isAccess(uint32_t command)
+    {
+        return command - static_cast<uint32_t>(Command::Read8) <= static_cast<uint32_t>(Command::Write32) - static_cast<uint32_t>(Command::Read8);
+    }
+
+    // Raw records of a chunk split in columns: the command and the extra header field of each record, the address and value
+    // of accesses, the hash of executes that have one, and the block count and payload of the other records. Executes keep
+    // ExecuteFlag::NoHash in their extra field when they have no hash.
+    struct Columns
+    {
+        // Columns of raw records written by a capture, where accesses always have an address and a value, returns their size
+        static size_t write(const uint32_t* words, size_t count, uint8_t* data)
         {
-            return mBuffer;
+            uint32_t counts[ColumnField::COUNT] = {};
+            forEachRecord(words, count, [&counts](uint32_t command, const uint32_t*, uint32_t blocks) {
+                ++counts[ColumnField::RecordCount];
+                if (isAccess(command))
+                    ++counts[ColumnField::AccessCount];
+                else if (command == static_cast<uint32_t>(Command::Execute))
+                    counts[ColumnField::HashCount] += blocks >= 4 ? 1 : 0;
+                else
+                    counts[ColumnField::OtherCount] += 1 + blocks;
+            });
+            counts[ColumnField::RawCount] = static_cast<uint32_t>(count);
+
+            Columns columns;
+            columns.map(data, counts);
+            memcpy(data, counts, sizeof(counts));
+            auto commands = const_cast<uint8_t*>(columns.mCommands);
+            auto types = const_cast<uint8_t*>(columns.mTypes);
+            auto addresses = const_cast<uint32_t*>(columns.mAddresses);
+            auto values = const_cast<uint32_t*>(columns.mValues);
+            auto hashes = const_cast<uint32_t*>(columns.mHashes);
+            auto other = const_cast<uint32_t*>(columns.mOther);
+            forEachRecord(words, count, [&](uint32_t command, const uint32_t* header, uint32_t blocks) {
+                uint32_t extra = CommandHeader::from(*header).fields.extra;
+                *commands++ = static_cast<uint8_t>(command);
+                if (isAccess(command))
+                {
+                    *addresses++ = blocks > 0 ? header[1] : 0;
+                    *values++ = blocks > 1 ? header[2] : 0;
+                }
+                else if (command == static_cast<uint32_t>(Command::Execute))
+                {
+                    extra = blocks >= 4 ? 0 : ExecuteFlag::NoHash;
+                    if (blocks >= 4)
+                    {
+                        memcpy(hashes, header + 1, 4 * sizeof(uint32_t));
+                        hashes += 4;
+                    }
+                }
+                else
+                {
+                    *other++ = blocks;
+                    memcpy(other, header + 1, blocks * sizeof(uint32_t));
+                    other += blocks;
+                }
+                *types++ = static_cast<uint8_t>(extra);
+            });
+            memset(commands, 0, static_cast<size_t>(columns.mTypes - commands));
+            memset(types, 0, static_cast<size_t>(reinterpret_cast<const uint8_t*>(columns.mAddresses) - types));
+            return columns.getSize();
         }
 
-        const std::vector<uint32_t>& getBuffer() const
+        // Largest size of the columns of raw records, each record takes at most two more bytes
+        static size_t getCapacity(size_t rawSize)
         {
-            return mBuffer;
+            return rawSize + rawSize / 2 + (ColumnField::COUNT + 2) * sizeof(uint32_t);
         }
 
-        void load(IStream& stream)
+        // Returns false when the columns do not fit in the data
+        bool read(const uint8_t* data, size_t size)
         {
-            auto size = stream.size();
-            mBuffer.resize((to_size_t(size) + 3) / 4, 0);
-            stream.read(mBuffer.data(), size);
+            if (size < ColumnField::COUNT * sizeof(uint32_t))
+                return false;
+            uint32_t counts[ColumnField::COUNT];
+            memcpy(counts, data, sizeof(counts));
+            map(data, counts);
+            return getSize() <= size;
         }
 
-        void save(IStream& stream) const
+        // Writes the raw records back in their original order, returns false when the columns are inconsistent
+        bool expand(uint32_t* words) const
+        {
+            auto end = words + mRawCount;
+            auto addresses = mAddresses;
+            auto values = mValues;
+            auto hashes = mHashes;
+            auto other = mOther;
+            for (uint32_t index = 0; index < mRecordCount; ++index)
+            {
+                auto command = static_cast<Command>(mCommands[index]);
+                uint32_t blocks = 0;
+                const uint32_t* payload = nullptr;
+                uint32_t extra = mTypes[index];
+                if (isAccess(mCommands[index]))
+                {
+                    if ((addresses == mAddresses + mAccessCount) || (end - words < 3))
+                        return false;
+                    *words++ = CommandHeader::make(command, 2, extra).u32;
+                    *words++ = *addresses++;
+                    *words++ = *values++;
+                    continue;
+                }
+                if (command == Command::Execute)
+                {
+                    blocks = (extra & ExecuteFlag::NoHash) ? 0 : 4;
+                    payload = hashes;
+                    extra = 0;
+                    if (static_cast<uint32_t>(mHashes + static_cast<size_t>(mHashCount) * 4 - hashes) < blocks)
+                        return false;
+                    hashes += blocks;
+                }
+                else
+                {
+                    if (other == mOther + mOtherCount)
+                        return false;
+                    blocks = *other++;
+                    payload = other;
+                    if (static_cast<uint32_t>(mOther + mOtherCount - other) < blocks)
+                        return false;
+                    other += blocks;
+                }
+                if (static_cast<uint32_t>(end - words) < 1 + blocks)
+                    return false;
+                *words++ = CommandHeader::make(command, blocks, extra).u32;
+                memcpy(words, payload, blocks * sizeof(uint32_t));
+                words += blocks;
+            }
+            return words == end;
+        }
+
+        size_t getSize() const
         {
-            stream.write(mBuffer.data(), mBuffer.size() * 4);
+            return reinterpret_cast<const uint8_t*>(mOther + mOtherCount) - mData;
         }
 
+        const uint8_t*      mData;
+        const uint8_t*      mCommands;
+        const uint8_t*      mTypes;
+        const uint32_t*     mAddresses;
+        const uint32_t*     mValues;
+        const uint32_t*     mHashes;
+        const uint32_t*     mOther;
+        uint32_t            mRecordCount;
+        uint32_t            mAccessCount;
+        uint32_t            mHashCount;
+        uint32_t            mOtherCount;
+        uint32_t            mRawCount;
+
     private:
-        struct Chunk
+        // Byte columns are padded to whole words
+        void map(const uint8_t* data, const uint32_t* counts)
         {
-            uint64_t            mOffset;
-            size_t              mSize;
-        };
+            mData = data;
+            mRecordCount = counts[ColumnField::RecordCount];
+            mAccessCount = counts[ColumnField::AccessCount];
+            mHashCount = counts[ColumnField::HashCount];
+            mOtherCount = counts[ColumnField::OtherCount];
+            mRawCount = counts[ColumnField::RawCount];
+            mCommands = data + ColumnField::COUNT * sizeof(uint32_t);
+            mTypes = mCommands + alignUp<sizeof(uint32_t)>(mRecordCount);
+            mAddresses = reinterpret_cast<const uint32_t*>(mTypes + alignUp<sizeof(uint32_t)>(mRecordCount));
+            mValues = mAddresses + mAccessCount;
+            mHashes = mValues + mAccessCount;
+            mOther = mHashes + static_cast<size_t>(mHashCount) * 4;
+        }
 
-        std::vector<Chunk>      mChunks;
-        MemoryStream            mData;
-        std::vector<uint32_t>   mBuffer;
+        // Calls the visitor with the command, the header and the block count of each record
+        template <typename TVisitor>
+        static void forEachRecord(const uint32_t* words, size_t count, TVisitor visitor)
+        {
+            auto end = words + count;
+            while (words < end)
+            {
+                auto header = CommandHeader::from(*words);
+                uint32_t blocks = std::min<uint32_t>(header.fields.blocks, static_cast<uint32_t>(end - words - 1));
+                visitor(header.fields.command, words, blocks);
+                words += 1 + blocks;
+            }
+        }
     };
 
-    class Capture : public ICapture
+    template <typename T>
+    class SpscQueue
     {
     public:
-        Capture(ICaptureDevice& device, Trace& trace)
-            : mDevice(device)
-            , mTrace(trace)
-            , mInvalidated(true)
+        SpscQueue(size_t capacity)
+            : mItems(capacity + 1)
+            , mHead(0)
+            , mTail(0)
         {
-            mTrace.getBuffer().clear();
-            mTrace.getBuffer().reserve(1024 * 1024);
+        }
 
-            mDevice.startCapture(*this);
+        bool empty() const
+        {
+            return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_acquire);
+        }
 
-            emit(Command::Header, Magic, CpuTrace::Version, device.getVersion(), device.getStateSize());
+        size_t size() const
+        {
+            auto head = mHead.load(std::memory_order_acquire);
+            auto tail = mTail.load(std::memory_order_acquire);
+            return tail >= head ? tail - head : tail + mItems.size() - head;
+        }
 
-            mState.resize(mDevice.getStateSize(), 0);
+        bool push(const T& item)
+        {
+            auto tail = mTail.load(std::memory_order_relaxed);
+            auto next = advance(tail);
+            if (next == mHead.load(std::memory_order_acquire))
+                return false;
+            mItems[tail] = item;
+            mTail.store(next, std::memory_order_release);
+            return true;
         }
 
-        ~Capture()
+        bool pop(T& item)
         {
-            emit(Command::Footer);
+            auto head = mHead.load(std::memory_order_relaxed);
+            if (head == mTail.load(std::memory_order_acquire))
+                return false;
+            item = mItems[head];
+            mHead.store(advance(head), std::memory_order_release);
+            return true;
+        }
 
-            mDevice.stopCapture(*this);
+    private:
+        size_t advance(size_t index) const
+        {
+            return ++index == mItems.size() ? 0 : index;
         }
 
-        virtual void invalidateState() override
+        std::vector<T>      mItems;
+        std::atomic<size_t> mHead;
+        std::atomic<size_t> mTail;
+    };
+
+    // Lets a thread sleep until a lock-free condition holds. Notifying only takes the lock when someone waits.
+    class WaitPoint
+    {
+    public:
+        WaitPoint()
+            : mWaiting(false)
         {
-            mInvalidated = true;
         }
 
-        virtual void execute() override
+        template <typename TPredicate>
+        void wait(TPredicate predicate)
         {
-            mDevice.getState(mState.data(), mState.size());
-            if (mInvalidated)
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWaiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!predicate())
+                mCondition.wait(lock);
+            mWaiting.store(false);
+        }
+
+        void notify()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (mWaiting.load())
             {
-                emit(Command::SetState, static_cast<const void*>(mState.data()), mState.size());
-                mInvalidated = false;
+                {
+                    std::lock_guard<std::mutex> lock(mMutex);
+                }
+                mCondition.notify_all();
             }
-
-            uint32_t hash[4];
-            MurmurHash3_x64_128(mState.data(), static_cast<int>(mState.size()), 0, hash);
-            emit(Command::Execute, hash[0], hash[1], hash[2], hash[3]);
         }
 
-        virtual void interrupt(uint32_t type) override
+    private:
+        std::mutex              mMutex;
+        std::condition_variable mCondition;
+        std::atomic<bool>       mWaiting;
+    };
+
+    class Trace : public ITrace
+    {
+    public:
+        // Chunks are stored compressed when their size is smaller than their raw size, the size of their records or columns
+        // before compression. The instruction is the number of instructions of the stream started before the chunk, the hash
+        // of the records is 0 when unknown.
+        struct Chunk
         {
-            emit(Command::Interrupt, type);
-        }
+            uint64_t            mOffset;
+            size_t              mSize;
+            size_t              mRawSize;
+            uint32_t            mStream;
+            uint64_t            mInstruction;
+            uint64_t            mHash;
+        };
 
-        virtual void signal(uint32_t type) override
+        struct Keyframe
         {
-            emit(Command::Signal, type);
-        }
+            uint64_t            mInstruction;
+            uint32_t            mChunk;
+            uint32_t            mOffset;
+            uint32_t            mStream;
+        };
 
-        virtual void read8(uint32_t addr, uint32_t value, uint32_t type) override
+        // Device recorded by each stream of a capture group and index of its first instruction, not 0 for the tail kept by a ring capture
+        struct Stream
+        {
+            uint32_t            mDeviceVersion;
+            uint32_t            mStateSize;
+            uint64_t            mFirstInstruction;
+        };
+
+        // Events the capture recorded, everything without a filter
+        struct Filter
+        {
+            Filter()
+                : mAccessTypes(~0u)
+                , mFlags(0)
+            {
+            }
+
+            explicit Filter(const CaptureFilter& filter)
+                : mAccessTypes(filter.accessTypes)
+                , mFlags((filter.interrupts ? 0 : FilterFlag::DropInterrupts) | (filter.signals ? 0 : FilterFlag::DropSignals))
+                , mStart(filter.start)
+                , mStop(filter.stop)
+            {
+                // Too many ranges do not fit in the header, the ones recorded are then those the capture used
+                if (filter.rangeCount > EventFilter::MaxRangeCount)
+                    mRanges = EventFilter::mergeRanges(filter);
+                else if (filter.ranges)
+                    mRanges.assign(filter.ranges, filter.ranges + filter.rangeCount);
+            }
+
+            uint32_t                    mAccessTypes;
+            uint32_t                    mFlags;
+            CaptureTrigger              mStart;
+            CaptureTrigger              mStop;
+            std::vector<AddressRange>   mRanges;
+        };
+
+        struct Info
         {
-            emit(CommandHeader::make(Command::Read8, 2, type));
-            emitU32(addr);
-            emitU32(value);
+            uint32_t            mVersion;
+            uint32_t            mDeviceVersion;
+            uint32_t            mStateSize;
+            uint32_t            mChunkSize;
+            Encoding            mEncoding;
+            uint32_t            mCodeType;
+            uint32_t            mCompression;
+            StateHash           mStateHash;
+            VerifyMode          mVerifyMode;
+            uint32_t            mVerifyInterval;
+            uint64_t            mInstructionCount;
+        };
+
+        explicit Trace(const std::shared_ptr<SegmentPool>& pool)
+            : mData(pool)
+        {
+            clear();
         }
 
-        virtual void read16(uint32_t addr, uint32_t value, uint32_t type) override
+        Info& getInfo()
         {
-            emit(CommandHeader::make(Command::Read16, 2, type));
-            emitU32(addr);
-            emitU32(value);
+            return mInfo;
         }
 
-        virtual void read32(uint32_t addr, uint32_t value, uint32_t type) override
+        const Info& getInfo() const
         {
-            emit(CommandHeader::make(Command::Read32, 2, type));
-            emitU32(addr);
-            emitU32(value);
+            return mInfo;
         }
 
-        virtual void write8(uint32_t addr, uint32_t value, uint32_t type) override
+        // Returns the records of a chunk and their size when the trace data is held in memory, compressed chunks and the
+        // columns of columnar chunks are expanded in the buffer
+        const uint8_t* getChunkData(size_t index, std::vector<uint8_t>& buffer, size_t& size) const
         {
-            emit(CommandHeader::make(Command::Write8, 2, type));
-            emitU32(addr);
-            emitU32(value);
+            auto data = getStoredData(index, buffer);
+            size = mChunks[index].mRawSize;
+            if (!data || (mInfo.mEncoding != Encoding::Columnar))
+                return data;
+
+            // Columns are at most half the size of their records
+            Columns columns;
+            if (!columns.read(data, size) || (columns.mRawCount > size / 2))
+                return nullptr;
+            auto rawSize = columns.mRawCount * sizeof(uint32_t);
+            if (data == buffer.data())
+            {
+                // Columns already expanded in the buffer are moved past the records
+                buffer.resize(rawSize + size);
+                memmove(buffer.data() + rawSize, buffer.data(), size);
+                columns.read(buffer.data() + rawSize, size);
+            }
+            else
+            {
+                buffer.resize(rawSize);
+            }
+            if (!columns.expand(reinterpret_cast<uint32_t*>(buffer.data())))
+                return nullptr;
+            size = rawSize;
+            return buffer.data();
         }
 
-        virtual void write16(uint32_t addr, uint32_t value, uint32_t type) override
+        // Returns the content of a chunk as it was before compression, compressed chunks are expanded in the buffer
+        const uint8_t* getStoredData(size_t index, std::vector<uint8_t>& buffer) const
         {
-            emit(CommandHeader::make(Command::Write16, 2, type));
-            emitU32(addr);
-            emitU32(value);
+            const auto& chunk = mChunks[index];
+            if (chunk.mOffset + chunk.mSize > getByteCount())
+                return nullptr;
+            if (chunk.mSize == chunk.mRawSize)
+                return getBytes(chunk.mOffset, chunk.mSize, buffer);
+            if ((mInfo.mCompression != Codec::Lz) || (chunk.mSize > chunk.mRawSize))
+                return nullptr;
+
+            // Compressed chunks crossing segments are gathered past the room for their records
+            buffer.resize(chunk.mRawSize);
+            auto data = getBytes(chunk.mOffset, chunk.mSize, buffer, chunk.mRawSize);
+            if (!decompress(data, chunk.mSize, buffer.data(), chunk.mRawSize))
+                return nullptr;
+            return buffer.data();
         }
 
-        virtual void write32(uint32_t addr, uint32_t value, uint32_t type) override
+        MemoryStream& getData()
         {
-            emit(CommandHeader::make(Command::Write32, 2, type));
-            emitU32(addr);
-            emitU32(value);
+            return mData;
         }
 
-        Trace& getTrace()
+        const MemoryStream& getData() const
         {
-            return mTrace;
+            return mData;
         }
 
-    private:
-        union CommandHeader
+        // Returns bytes of the trace, either loaded in memory or mapped from a file. Bytes crossing segments of the memory
+        // are gathered in the buffer from the given position.
+        const uint8_t* getBytes(uint64_t offset, size_t size, std::vector<uint8_t>& buffer, size_t bufferOffset = 0) const
         {
-            uint32_t        u32;
-            struct
-            {
-                uint8_t     command;
-                uint8_t     extra;
-                uint16_t    blocks;
-            }               fields;
+            if (mMapping)
+                return mMapping->getData() + offset;
 
-            static CommandHeader make(Command command, size_t blocks = 0, uint32_t extra = 0)
-            {
-                CommandHeader header = { 0 };
-                header.fields.command = static_cast<uint8_t>(command);
-                header.fields.blocks = static_cast<uint16_t>(blocks);
-                header.fields.extra = static_cast<uint8_t>(extra);
-                return header;
-            }
-        };
+            size_t available = 0;
+            auto data = mData.getBuffer().getSegment(offset, available);
+            if (available >= size)
+                return data;
+            buffer.resize(std::max(buffer.size(), bufferOffset + size));
+            mData.getBuffer().read(offset, buffer.data() + bufferOffset, size);
+            return buffer.data() + bufferOffset;
+        }
 
-        size_t blockCount(size_t size)
+        uint64_t getByteCount() const
         {
-            return divideUp<sizeof(uint32_t)>(size);
+            return mMapping ? mMapping->getSize() : mData.size();
         }
 
-        void emit(CommandHeader header)
+        // Hints that a chunk is about to be decoded so a mapped file can start reading it
+        void prefetchChunk(size_t index) const
         {
-            mTrace.getBuffer().push_back(static_cast<uint32_t>(header.u32));
+            if (mMapping && (index < mChunks.size()))
+                mMapping->prefetch(mChunks[index].mOffset, mChunks[index].mSize);
         }
 
-        void emit(Command command)
+        std::vector<Chunk>& getChunks()
         {
-            emit(CommandHeader::make(command));
+            return mChunks;
         }
 
-        void emit(Command command, const void* data, size_t size)
+        const std::vector<Chunk>& getChunks() const
         {
-            auto count = blockCount(size);
-            emit(CommandHeader::make(command, count));
+            return mChunks;
+        }
 
-            auto& buffer = mTrace.getBuffer();
-            auto offset = buffer.size();
-            buffer.resize(offset + count, 0);
-            memcpy(buffer.data() + offset, data, size);
+        std::vector<Keyframe>& getKeyframes()
+        {
+            return mKeyframes;
         }
 
-        template <typename... TArgs>
-        void emit(Command command, TArgs... args)
+        const std::vector<Keyframe>& getKeyframes() const
         {
-            emit(CommandHeader::make(command, sizeof...(args)));
-            emitU32(args...);
+            return mKeyframes;
         }
 
-        template <typename TArg0, typename... TArgs>
-        void emitU32(TArg0 arg0, TArgs... args)
+        std::vector<Stream>& getStreams()
         {
-            mTrace.getBuffer().push_back(static_cast<uint32_t>(arg0));
-            emitU32(args...);
+            return mStreams;
         }
 
-        template <typename TArg>
-        void emitU32(TArg value)
+        const std::vector<Stream>& getStreams() const
         {
-            mTrace.getBuffer().push_back(static_cast<uint32_t>(value));
+            return mStreams;
         }
 
-        ICaptureDevice&         mDevice;
-        Trace&                  mTrace;
-        bool                    mInvalidated;
-        std::vector<uint8_t>    mState;
-    };
+        Filter& getFilter()
+        {
+            return mFilter;
+        }
 
-    class Context : public IContext
-    {
-    public:
-        virtual ITrace& createTrace()
+        const Filter& getFilter() const
         {
-            return *new Trace();
+            return mFilter;
         }
 
-        virtual void destroyTrace(ITrace& trace)
+        // Returns the last keyframe of the stream at or before the instruction, keyframes are sorted by stream then instruction
+        const Keyframe* findKeyframe(uint32_t stream, uint64_t instruction) const
         {
-            delete static_cast<Trace*>(&trace);
+            auto next = std::upper_bound(mKeyframes.begin(), mKeyframes.end(), std::make_pair(stream, instruction), [](const std::pair<uint32_t, uint64_t>& value, const Keyframe& keyframe)
+            {
+                return (value.first < keyframe.mStream) || ((value.first == keyframe.mStream) && (value.second < keyframe.mInstruction));
+            });
+            if ((next == mKeyframes.begin()) || ((next - 1)->mStream != stream))
+                return nullptr;
+            return &*(next - 1);
         }
 
-        virtual void loadTrace(ITrace& trace, IStream& stream)
+        void clear()
         {
-            static_cast<Trace&>(trace).load(stream);
+            Info info = {};
+            mInfo = info;
+            mChunks.clear();
+            mKeyframes.clear();
+            mStreams.clear();
+            mFilter = Filter();
+            mData.clear();
+            mMapping.reset();
         }
 
-        virtual void saveTrace(const ITrace& trace, IStream& stream)
+        void load(IStream& stream)
         {
-            static_cast<const Trace&>(trace).save(stream);
+            clear();
+            auto size = stream.size();
+            auto& buffer = mData.getBuffer();
+            while (buffer.size() < size)
+            {
+                auto count = to_size_t(std::min(size - buffer.size(), static_cast<uint64_t>(SegmentPool::SegmentSize)));
+                auto data = buffer.reserve(count);
+                count = to_size_t(stream.read(data, count));
+                if (!count)
+                    break;
+                buffer.commit(count);
+            }
+            parse();
         }
 
-        virtual ICapture& startCapture(ICaptureDevice& device, ITrace& trace) override
+        // Reads records straight from the file instead of copying it, only the pages touched are loaded
+        bool map(const char* path)
         {
-            return *(new Capture(device, static_cast<Trace&>(trace)));
+            clear();
+            mMapping.reset(new MappedFile());
+            if (!mMapping->open(path))
+            {
+                mMapping.reset();
+                return false;
+            }
+            parse();
+            return true;
         }
 
-        virtual void stopCapture(ICapture& capture) override
+        void save(IStream& stream) const
         {
-            delete static_cast<Capture*>(&capture);
+            if (mMapping)
+            {
+                stream.write(mMapping->getData(), mMapping->getSize());
+                return;
+            }
+
+            const auto& buffer = mData.getBuffer();
+            uint64_t offset = 0;
+            while (offset < buffer.size())
+            {
+                size_t size = 0;
+                auto data = buffer.getSegment(offset, size);
+                stream.write(data, size);
+                offset += size;
+            }
         }
+
+    private:
+        void parse()
+        {
+            // The header and the footer are read as blocks of words, gathered when they cross segments of the memory
+            std::vector<uint8_t> buffer;
+            auto wordCount = to_size_t(getByteCount() / sizeof(uint32_t));
+            if (wordCount < 1)
+                return;
+
+            auto header = CommandHeader::from(*reinterpret_cast<const uint32_t*>(getBytes(0, sizeof(uint32_t), buffer)));
+            size_t headerSize = 1 + header.fields.blocks;
+            if ((header.fields.command != static_cast<uint8_t>(Command::Header)) || (headerSize > wordCount) ||
+                (header.fields.blocks <= HeaderField::StateSize))
+                return;
+            auto words = reinterpret_cast<const uint32_t*>(getBytes(0, headerSize * sizeof(uint32_t), buffer));
+            if (words[1 + HeaderField::Magic] != Magic)
+                return;
+
+            auto fields = words + 1;
+            mInfo.mVersion = fields[HeaderField::Version];
+            mInfo.mDeviceVersion = fields[HeaderField::DeviceVersion];
+            mInfo.mStateSize = fields[HeaderField::StateSize];
+            mInfo.mChunkSize = header.fields.blocks > HeaderField::ChunkSize ? fields[HeaderField::ChunkSize] : 0;
+            mInfo.mEncoding = header.fields.blocks > HeaderField::Encoding ? static_cast<Encoding>(fields[HeaderField::Encoding]) : Encoding::Raw;
+            mInfo.mCodeType = header.fields.blocks > HeaderField::CodeType ? fields[HeaderField::CodeType] : 0;
+            mInfo.mCompression = header.fields.blocks > HeaderField::Compression ? fields[HeaderField::Compression] : static_cast<uint32_t>(Codec::None);
+            mInfo.mStateHash = header.fields.blocks > HeaderField::StateHash ? static_cast<StateHash>(fields[HeaderField::StateHash]) : StateHash::Murmur3;
+            mInfo.mVerifyMode = header.fields.blocks > HeaderField::VerifyMode ? static_cast<VerifyMode>(fields[HeaderField::VerifyMode]) : VerifyMode::Every;
+            mInfo.mVerifyInterval = header.fields.blocks > HeaderField::VerifyInterval ? fields[HeaderField::VerifyInterval] : 0;
+
+            // Traces before capture groups hold a single stream described by the header, streams start at 0 before ring captures
+            size_t streamCount = header.fields.blocks > HeaderField::StreamCount ? fields[HeaderField::StreamCount] : 0;
+            size_t streamEntrySize = mInfo.mVersion >= 8 ? StreamField::COUNT : StreamField::FirstInstructionLow;
+            if (streamCount && (header.fields.blocks >= HeaderField::COUNT + streamCount * streamEntrySize))
+            {
+                mStreams.resize(streamCount);
+                for (size_t index = 0; index < streamCount; ++index)
+                {
+                    auto entry = fields + HeaderField::COUNT + index * streamEntrySize;
+                    mStreams[index].mDeviceVersion = entry[StreamField::DeviceVersion];
+                    mStreams[index].mStateSize = entry[StreamField::StateSize];
+                    mStreams[index].mFirstInstruction = streamEntrySize > StreamField::FirstInstructionHigh ? makeU64(entry[StreamField::FirstInstructionLow], entry[StreamField::FirstInstructionHigh]) : 0;
+                }
+            }
+            else
+            {
+                Stream stream = { mInfo.mDeviceVersion, mInfo.mStateSize, 0 };
+                mStreams.push_back(stream);
+            }
+
+            // Filters follow the stream entries from version 9
+            size_t filterOffset = HeaderField::COUNT + streamCount * streamEntrySize;
+            if ((mInfo.mVersion >= 9) && streamCount && (header.fields.blocks >= filterOffset + FilterField::COUNT))
+                parseFilter(fields + filterOffset, header.fields.blocks - filterOffset);
+
+            if (mInfo.mVersion < 2)
+            {
+                // Version 1 traces are a single sequence of records terminated by a footer
+                auto size = (wordCount - headerSize) * sizeof(uint32_t);
+                Chunk chunk = { headerSize * sizeof(uint32_t), size, size, 0, 0, 0 };
+                mChunks.push_back(chunk);
+                return;
+            }
+
+            if (wordCount < headerSize + TrailerField::COUNT)
+                return;
+            std::vector<uint8_t> footerBuffer;
+            auto trailer = reinterpret_cast<const uint32_t*>(getBytes((wordCount - TrailerField::COUNT) * sizeof(uint32_t), TrailerField::COUNT * sizeof(uint32_t), footerBuffer));
+            if (trailer[TrailerField::Magic] != Magic)
+                return;
+            auto footerOffset = to_size_t(makeU64(trailer[TrailerField::FooterOffsetLow], trailer[TrailerField::FooterOffsetHigh]) / sizeof(uint32_t));
+            if (footerOffset >= wordCount)
+                return;
+
+            // The footer runs up to the end of the trace
+            words = reinterpret_cast<const uint32_t*>(getBytes(footerOffset * sizeof(uint32_t), (wordCount - footerOffset) * sizeof(uint32_t), footerBuffer));
+            trailer = words + wordCount - footerOffset - TrailerField::COUNT;
+            auto footer = CommandHeader::from(words[0]);
+            fields = words + 1;
+            if ((footer.fields.command != static_cast<uint8_t>(Command::Footer)) || (footer.fields.blocks < FooterField::COUNT) ||
+                (footerOffset + footer.fields.blocks >= wordCount))
+                return;
+
+            size_t chunkCount = fields[FooterField::ChunkCount];
+            size_t chunkEntrySize = fields[FooterField::ChunkEntrySize];
+            auto entries = fields + footer.fields.blocks;
+            if ((chunkEntrySize <= ChunkField::Size) || (entries + chunkCount * chunkEntrySize > trailer))
+                return;
+
+            mChunks.resize(chunkCount);
+            for (size_t index = 0; index < chunkCount; ++index)
+            {
+                auto entry = entries + index * chunkEntrySize;
+                auto& chunk = mChunks[index];
+                chunk.mOffset = makeU64(entry[ChunkField::OffsetLow], entry[ChunkField::OffsetHigh]);
+                chunk.mSize = entry[ChunkField::Size];
+                chunk.mRawSize = chunkEntrySize > ChunkField::RawSize ? entry[ChunkField::RawSize] : chunk.mSize;
+                chunk.mStream = chunkEntrySize > ChunkField::Stream ? entry[ChunkField::Stream] : 0;
+                chunk.mInstruction = chunkEntrySize > ChunkField::InstructionHigh ? makeU64(entry[ChunkField::InstructionLow], entry[ChunkField::InstructionHigh]) : 0;
+                chunk.mHash = chunkEntrySize > ChunkField::HashHigh ? makeU64(entry[ChunkField::HashLow], entry[ChunkField::HashHigh]) : 0;
+            }
+            entries += chunkCount * chunkEntrySize;
+
+            if (footer.fields.blocks <= FooterField::InstructionCountHigh)
+                return;
+            mInfo.mInstructionCount = makeU64(fields[FooterField::InstructionCountLow], fields[FooterField::InstructionCountHigh]);
+
+            size_t keyframeCount = fields[FooterField::KeyframeCount];
+            size_t keyframeEntrySize = fields[FooterField::KeyframeEntrySize];
+            if ((keyframeEntrySize < KeyframeField::COUNT) || (entries + keyframeCount * keyframeEntrySize > trailer))
+                return;
+
+            mKeyframes.resize(keyframeCount);
+            for (size_t index = 0; index < keyframeCount; ++index)
+            {
+                auto entry = entries + index * keyframeEntrySize;
+                auto& keyframe = mKeyframes[index];
+                keyframe.mInstruction = makeU64(entry[KeyframeField::InstructionLow], entry[KeyframeField::InstructionHigh]);
+                keyframe.mChunk = entry[KeyframeField::Chunk];
+                keyframe.mOffset = entry[KeyframeField::Offset];
+                keyframe.mStream = keyframeEntrySize > KeyframeField::Stream ? entry[KeyframeField::Stream] : 0;
+
+                // Offsets were in words before version 3
+                if (mInfo.mVersion < 3)
+                    keyframe.mOffset *= sizeof(uint32_t);
+            }
+        }
+
+        void parseFilter(const uint32_t* fields, size_t size)
+        {
+            size_t rangeCount = fields[FilterField::RangeCount];
+            if (size < FilterField::COUNT + 2 * TriggerField::COUNT + rangeCount * RangeField::COUNT)
+                return;
+
+            mFilter.mAccessTypes = fields[FilterField::AccessTypes];
+            mFilter.mFlags = fields[FilterField::Flags];
+            auto triggers = fields + FilterField::COUNT;
+            mFilter.mStart = parseTrigger(triggers);
+            mFilter.mStop = parseTrigger(triggers + TriggerField::COUNT);
+            auto ranges = triggers + 2 * TriggerField::COUNT;
+            mFilter.mRanges.resize(rangeCount);
+            for (size_t index = 0; index < rangeCount; ++index)
+            {
+                mFilter.mRanges[index].first = ranges[index * RangeField::COUNT + RangeField::First];
+                mFilter.mRanges[index].last = ranges[index * RangeField::COUNT + RangeField::Last];
+            }
+        }
+
+        static CaptureTrigger parseTrigger(const uint32_t* fields)
+        {
+            CaptureTrigger trigger;
+            trigger.type = static_cast<TriggerType>(fields[TriggerField::Type]);
+            trigger.range.first = fields[TriggerField::First];
+            trigger.range.last = fields[TriggerField::Last];
+            trigger.instruction = makeU64(fields[TriggerField::InstructionLow], fields[TriggerField::InstructionHigh]);
+            return trigger;
+        }
+
+        Info                        mInfo;
+        std::vector<Chunk>          mChunks;
+        std::vector<Keyframe>       mKeyframes;
+        std::vector<Stream>         mStreams;
+        Filter                      mFilter;
+        MemoryStream                mData;
+        std::unique_ptr<MappedFile> mMapping;
+    };
+
+    // Output of a capture: the header, the chunks of all streams in the order they are written and the footer.
+    // Streams write their chunks concurrently, only appending a chunk to the output is serialized.
+    // Ring captures keep the last chunks of each stream instead, they are written with the footer or when a stream is dumped.
+    class TraceSink
+    {
+    public:
+        TraceSink(Trace& trace, IStream& stream)
+            : mTrace(trace)
+            , mStream(stream)
+            , mStreamOffset(0)
+            , mChunkSize(0)
+        {
+        }
+
+        void writeHeader(const std::vector<Trace::Stream>& streams, size_t chunkSize, const CaptureSettings& settings)
+        {
+            // The ranges of the filter are only valid while the capture starts
+            mSettings = settings;
+            mSettings.filter = CaptureFilter();
+            mFilter = Trace::Filter(settings.filter);
+            mChunkSize = chunkSize;
+            mTrace.getStreams() = streams;
+            mStreamChunks.resize(streams.size());
+            mRings.resize(streams.size());
+            setInfo(mTrace);
+
+            // Ring captures only know where their streams start when they are written
+            if (!mSettings.ringSize)
+                writeWords(mStream, mStreamOffset, makeHeader(streams));
+        }
+
+        // Appends a chunk of a stream, called from any capture or writer thread. The offset of the chunk is set by the sink.
+        size_t writeChunk(const Trace::Chunk& chunk, const void* data)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mSettings.ringSize)
+                return keepChunk(chunk, data);
+            mStreamChunks[chunk.mStream].push_back(static_cast<uint32_t>(mTrace.getChunks().size()));
+            return appendChunk(mStream, mStreamOffset, mTrace, chunk, data);
+        }
+
+        // Keyframes refer to the chunks of their stream by position until the chunk table is complete
+        void writeFooter(const std::vector<Trace::Keyframe>& streamKeyframes, uint64_t instructionCount)
+        {
+            if (mSettings.ringSize)
+            {
+                writeRings(mStream, mStreamOffset, mTrace, mRings, 0, streamKeyframes);
+            }
+            else
+            {
+                auto& keyframes = mTrace.getKeyframes();
+                for (auto keyframe : streamKeyframes)
+                {
+                    keyframe.mChunk = mStreamChunks[keyframe.mStream][keyframe.mChunk];
+                    keyframes.push_back(keyframe);
+                }
+            }
+            writeFooter(mStream, mStreamOffset, mTrace, instructionCount);
+        }
+
+        // Writes the chunks kept for a stream of a ring capture as a single stream trace, while the capture goes on. Only the list
+        // of chunks is copied under the lock, their buffers are shared with the ring so other streams keep writing during the dump.
+        void dump(IStream& stream, uint32_t streamIndex, const std::vector<Trace::Keyframe>& streamKeyframes, uint64_t instructionCount)
+        {
+            std::vector<Ring> rings;
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                rings.push_back(mRings[streamIndex]);
+            }
+            Trace trace(mTrace.getData().getBuffer().getPool());
+            uint64_t offset = 0;
+            writeRings(stream, offset, trace, rings, streamIndex, streamKeyframes);
+            writeFooter(stream, offset, trace, instructionCount);
+        }
+
+        // Position in the stream of the oldest chunk kept by a ring capture
+        uint32_t getRingStart(uint32_t stream)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            const auto& ring = mRings[stream];
+            return ring.mChunks.empty() ? ring.mNext : ring.mChunks.front().mPosition;
+        }
+
+    private:
+        struct RingChunk
+        {
+            std::shared_ptr<std::vector<uint8_t>>   mData;
+            Trace::Chunk                            mChunk;
+            uint32_t                                mPosition;
+        };
+
+        struct Ring
+        {
+            Ring()
+                : mSize(0)
+                , mNext(0)
+            {
+            }
+
+            std::deque<RingChunk>   mChunks;
+            uint64_t                mSize;
+            uint32_t                mNext;
+        };
+
+        void setInfo(Trace& trace) const
+        {
+            const auto& streams = trace.getStreams();
+            auto& info = trace.getInfo();
+            info.mVersion = CpuTrace::Version;
+            info.mDeviceVersion = streams.empty() ? 0 : streams[0].mDeviceVersion;
+            info.mStateSize = streams.empty() ? 0 : streams[0].mStateSize;
+            info.mChunkSize = static_cast<uint32_t>(mChunkSize);
+            info.mEncoding = mSettings.encoding;
+            info.mCodeType = mSettings.codeType;
+            info.mCompression = mSettings.compressionLevel ? Codec::Lz : Codec::None;
+            info.mStateHash = mSettings.stateHash;
+            info.mVerifyMode = mSettings.verifyPolicy.mode;
+            info.mVerifyInterval = mSettings.verifyPolicy.interval;
+            trace.getFilter() = mFilter;
+        }
+
+        std::vector<uint32_t> makeHeader(const std::vector<Trace::Stream>& streams) const
+        {
+            auto filterOffset = HeaderField::COUNT + streams.size() * StreamField::COUNT;
+            auto rangeOffset = filterOffset + FilterField::COUNT + 2 * TriggerField::COUNT;
+            std::vector<uint32_t> words(1 + rangeOffset + mFilter.mRanges.size() * RangeField::COUNT, 0);
+            assert(words.size() <= 0x10000);
+            words[0] = CommandHeader::make(Command::Header, words.size() - 1).u32;
+            auto fields = words.data() + 1;
+            fields[HeaderField::Magic] = Magic;
+            fields[HeaderField::Version] = CpuTrace::Version;
+            fields[HeaderField::DeviceVersion] = streams.empty() ? 0 : streams[0].mDeviceVersion;
+            fields[HeaderField::StateSize] = streams.empty() ? 0 : streams[0].mStateSize;
+            fields[HeaderField::ChunkSize] = static_cast<uint32_t>(mChunkSize);
+            fields[HeaderField::Encoding] = static_cast<uint32_t>(mSettings.encoding);
+            fields[HeaderField::CodeType] = mSettings.codeType;
+            fields[HeaderField::Compression] = mSettings.compressionLevel ? Codec::Lz : Codec::None;
+            fields[HeaderField::StateHash] = static_cast<uint32_t>(mSettings.stateHash);
+            fields[HeaderField::VerifyMode] = static_cast<uint32_t>(mSettings.verifyPolicy.mode);
+            fields[HeaderField::VerifyInterval] = mSettings.verifyPolicy.interval;
+            fields[HeaderField::StreamCount] = static_cast<uint32_t>(streams.size());
+            for (size_t index = 0; index < streams.size(); ++index)
+            {
+                auto entry = fields + HeaderField::COUNT + index * StreamField::COUNT;
+                entry[StreamField::DeviceVersion] = streams[index].mDeviceVersion;
+                entry[StreamField::StateSize] = streams[index].mStateSize;
+                entry[StreamField::FirstInstructionLow] = static_cast<uint32_t>(streams[index].mFirstInstruction);
+                entry[StreamField::FirstInstructionHigh] = static_cast<uint32_t>(streams[index].mFirstInstruction >> 32);
+            }
+
+            auto filter = fields + filterOffset;
+            filter[FilterField::AccessTypes] = mFilter.mAccessTypes;
+            filter[FilterField::Flags] = mFilter.mFlags;
+            filter[FilterField::RangeCount] = static_cast<uint32_t>(mFilter.mRanges.size());
+            writeTrigger(filter + FilterField::COUNT, mFilter.mStart);
+            writeTrigger(filter + FilterField::COUNT + TriggerField::COUNT, mFilter.mStop);
+            for (size_t index = 0; index < mFilter.mRanges.size(); ++index)
+            {
+                auto entry = fields + rangeOffset + index * RangeField::COUNT;
+                entry[RangeField::First] = mFilter.mRanges[index].first;
+                entry[RangeField::Last] = mFilter.mRanges[index].last;
+            }
+            return words;
+        }
+
+        static void writeTrigger(uint32_t* fields, const CaptureTrigger& trigger)
+        {
+            fields[TriggerField::Type] = static_cast<uint32_t>(trigger.type);
+            fields[TriggerField::First] = trigger.range.first;
+            fields[TriggerField::Last] = trigger.range.last;
+            fields[TriggerField::InstructionLow] = static_cast<uint32_t>(trigger.instruction);
+            fields[TriggerField::InstructionHigh] = static_cast<uint32_t>(trigger.instruction >> 32);
+        }
+
+        // Oldest chunks make room for the new one and their buffers are reused unless a dump still holds them, the last chunk
+        // is always kept
+        size_t keepChunk(const Trace::Chunk& chunk, const void* data)
+        {
+            auto& ring = mRings[chunk.mStream];
+            auto size = chunk.mSize;
+            std::shared_ptr<std::vector<uint8_t>> buffer;
+            while (!ring.mChunks.empty() && (ring.mSize + size > mSettings.ringSize))
+            {
+                auto& oldest = ring.mChunks.front().mData;
+                ring.mSize -= oldest->size();
+                if (oldest.use_count() == 1)
+                    buffer = std::move(oldest);
+                ring.mChunks.pop_front();
+            }
+
+            if (!buffer)
+                buffer = std::make_shared<std::vector<uint8_t>>();
+            auto bytes = static_cast<const uint8_t*>(data);
+            buffer->assign(bytes, bytes + size);
+            RingChunk ringChunk = { std::move(buffer), chunk, ring.mNext++ };
+            ring.mChunks.push_back(std::move(ringChunk));
+            ring.mSize += size;
+            return alignUp<sizeof(uint32_t)>(size);
+        }
+
+        // Writes the header and the chunks kept for consecutive streams from first, rings[i] being the one of stream first + i.
+        // Each stream starts at its first chunk beginning with a keyframe, stream indices are rebased on the first one.
+        void writeRings(IStream& stream, uint64_t& offset, Trace& trace, const std::vector<Ring>& rings, uint32_t first, const std::vector<Trace::Keyframe>& streamKeyframes)
+        {
+            auto last = first + static_cast<uint32_t>(rings.size());
+            // The trace written can be the one of the capture
+            auto captureStreams = mTrace.getStreams();
+            std::vector<size_t> starts;
+            auto& streams = trace.getStreams();
+            streams.clear();
+            for (auto index = first; index < last; ++index)
+            {
+                const auto& ring = rings[index - first];
+                auto info = captureStreams[index];
+                size_t start = ring.mChunks.size();
+                for (const auto& keyframe : streamKeyframes)
+                {
+                    if ((keyframe.mStream == index) && !keyframe.mOffset && !ring.mChunks.empty() && (keyframe.mChunk >= ring.mChunks.front().mPosition) && (keyframe.mChunk < ring.mNext))
+                    {
+                        start = keyframe.mChunk - ring.mChunks.front().mPosition;
+                        info.mFirstInstruction = keyframe.mInstruction;
+                        break;
+                    }
+                }
+                streams.push_back(info);
+                starts.push_back(start);
+            }
+            setInfo(trace);
+            writeWords(stream, offset, makeHeader(streams));
+
+            auto& keyframes = trace.getKeyframes();
+            for (auto index = first; index < last; ++index)
+            {
+                const auto& ring = rings[index - first];
+                auto start = starts[index - first];
+                auto chunkBase = trace.getChunks().size();
+                for (auto chunk = ring.mChunks.begin() + start; chunk != ring.mChunks.end(); ++chunk)
+                {
+                    auto info = chunk->mChunk;
+                    info.mStream = index - first;
+                    appendChunk(stream, offset, trace, info, chunk->mData->data());
+                }
+
+                if (start == ring.mChunks.size())
+                    continue;
+                auto firstPosition = ring.mChunks[start].mPosition;
+                for (auto keyframe : streamKeyframes)
+                {
+                    if ((keyframe.mStream != index) || (keyframe.mChunk < firstPosition) || (keyframe.mChunk >= ring.mNext))
+                        continue;
+                    keyframe.mChunk = static_cast<uint32_t>(chunkBase + keyframe.mChunk - firstPosition);
+                    keyframe.mStream = index - first;
+                    keyframes.push_back(keyframe);
+                }
+            }
+        }
+
+        static size_t appendChunk(IStream& stream, uint64_t& offset, Trace& trace, Trace::Chunk chunk, const void* data)
+        {
+            // Compressed chunks are padded so the following records stay aligned on words
+            auto alignedSize = alignUp<sizeof(uint32_t)>(chunk.mSize);
+            chunk.mOffset = offset;
+            trace.getChunks().push_back(chunk);
+            stream.write(data, chunk.mSize);
+            if (alignedSize != chunk.mSize)
+            {
+                uint32_t padding = 0;
+                stream.write(&padding, alignedSize - chunk.mSize);
+            }
+            offset += alignedSize;
+            return alignedSize;
+        }
+
+        static void writeFooter(IStream& stream, uint64_t& offset, Trace& trace, uint64_t instructionCount)
+        {
+            const auto& chunks = trace.getChunks();
+            const auto& keyframes = trace.getKeyframes();
+            auto footerOffset = offset;
+            trace.getInfo().mInstructionCount = instructionCount;
+
+            std::vector<uint32_t> words;
+            words.reserve(1 + FooterField::COUNT + chunks.size() * ChunkField::COUNT + keyframes.size() * KeyframeField::COUNT + TrailerField::COUNT);
+            words.resize(1 + FooterField::COUNT, 0);
+            words[0] = CommandHeader::make(Command::Footer, FooterField::COUNT).u32;
+            auto fields = words.data() + 1;
+            fields[FooterField::ChunkCount] = static_cast<uint32_t>(chunks.size());
+            fields[FooterField::ChunkEntrySize] = ChunkField::COUNT;
+            fields[FooterField::KeyframeCount] = static_cast<uint32_t>(keyframes.size());
+            fields[FooterField::KeyframeEntrySize] = KeyframeField::COUNT;
+            fields[FooterField::InstructionCountLow] = static_cast<uint32_t>(instructionCount);
+            fields[FooterField::InstructionCountHigh] = static_cast<uint32_t>(instructionCount >> 32);
+            for (const auto& chunk : chunks)
+            {
+                words.push_back(static_cast<uint32_t>(chunk.mOffset));
+                words.push_back(static_cast<uint32_t>(chunk.mOffset >> 32));
+                words.push_back(static_cast<uint32_t>(chunk.mSize));
+                words.push_back(static_cast<uint32_t>(chunk.mRawSize));
+                words.push_back(chunk.mStream);
+                words.push_back(static_cast<uint32_t>(chunk.mInstruction));
+                words.push_back(static_cast<uint32_t>(chunk.mInstruction >> 32));
+                words.push_back(static_cast<uint32_t>(chunk.mHash));
+                words.push_back(static_cast<uint32_t>(chunk.mHash >> 32));
+            }
+            for (const auto& keyframe : keyframes)
+            {
+                words.push_back(static_cast<uint32_t>(keyframe.mInstruction));
+                words.push_back(static_cast<uint32_t>(keyframe.mInstruction >> 32));
+                words.push_back(keyframe.mChunk);
+                words.push_back(keyframe.mOffset);
+                words.push_back(keyframe.mStream);
+            }
+            words.push_back(static_cast<uint32_t>(footerOffset));
+            words.push_back(static_cast<uint32_t>(footerOffset >> 32));
+            words.push_back(Magic);
+            writeWords(stream, offset, words);
+            stream.flush();
+        }
+
+        static void writeWords(IStream& stream, uint64_t& offset, const std::vector<uint32_t>& words)
+        {
+            auto size = words.size() * sizeof(uint32_t);
+            stream.write(words.data(), size);
+            offset += size;
+        }
+
+        Trace&                              mTrace;
+        IStream&                            mStream;
+        uint64_t                            mStreamOffset;
+        CaptureSettings                     mSettings;
+        Trace::Filter                       mFilter;
+        size_t                              mChunkSize;
+        std::mutex                          mMutex;
+        std::vector<std::vector<uint32_t>>  mStreamChunks;
+        std::vector<Ring>                   mRings;
+    };
+
+    // Owns the chunk buffers of a capture stream and hands them to the sink, optionally from a dedicated thread.
+    class ChunkWriter
+    {
+    public:
+        ChunkWriter(TraceSink& sink, uint32_t streamIndex, size_t chunkWords, const CaptureSettings& settings)
+            : mSink(sink)
+            , mStreamIndex(streamIndex)
+            , mChunkWords(chunkWords)
+            , mThreaded(settings.writerThread)
+            , mCompressionLevel(settings.compressionLevel)
+            , mHashChunks(settings.chunkHashes)
+            , mColumnar(settings.encoding == Encoding::Columnar)
+            , mFilled(getBufferCount(settings))
+            , mFree(getBufferCount(settings))
+            , mStop(false)
+            , mChunkCount(0)
+            , mByteCount(0)
+            , mRawByteCount(0)
+            , mCompressTime(0)
+            , mBlockedCount(0)
+            , mBlockedTime(0)
+            , mWriteTime(0)
+            , mMaxQueueDepth(0)
+        {
+            auto bufferCount = getBufferCount(settings);
+            mBuffers.resize(bufferCount);
+            for (auto& buffer : mBuffers)
+                buffer.resize(mChunkWords, 0);
+            for (size_t index = 1; index < bufferCount; ++index)
+                mFree.push(mBuffers[index].data());
+
+            // Chunks are split in columns and compressed by whichever thread writes them
+            auto storedSize = mChunkWords * sizeof(uint32_t);
+            if (mColumnar)
+            {
+                storedSize = Columns::getCapacity(storedSize);
+                mColumns.resize(storedSize);
+            }
+            if (mCompressionLevel)
+            {
+                mCompressor.reset(new Compressor(mCompressionLevel));
+                mCompressed.resize(storedSize);
+            }
+        }
+
+        ~ChunkWriter()
+        {
+            stop();
+        }
+
+        size_t getChunkWords() const
+        {
+            return mChunkWords;
+        }
+
+        uint32_t* getFirstBuffer()
+        {
+            return mBuffers[0].data();
+        }
+
+        void start()
+        {
+            if (mThreaded)
+                mThread = std::thread([this]() { run(); });
+        }
+
+        void stop()
+        {
+            if (mThread.joinable())
+            {
+                mStop.store(true);
+                mFilledWait.notify();
+                mThread.join();
+            }
+        }
+
+        // Waits until the chunks submitted so far have been handed to the sink
+        void drain()
+        {
+            if (mThreaded)
+                mFreeWait.wait([&]() { return mFree.size() + 1 == mBuffers.size(); });
+        }
+
+        // Hands a filled buffer over and returns the buffer to fill next, the instruction is the one the chunk starts at
+        uint32_t* submit(uint32_t* buffer, size_t count, uint64_t instruction)
+        {
+            if (!mThreaded)
+            {
+                writeChunk(buffer, count, instruction);
+                return buffer;
+            }
+
+            Pending pending = { buffer, count, instruction };
+            mFilled.push(pending);
+            mFilledWait.notify();
+
+            auto depth = static_cast<uint32_t>(mFilled.size());
+            if (depth > mMaxQueueDepth.load(std::memory_order_relaxed))
+                mMaxQueueDepth.store(depth, std::memory_order_relaxed);
+
+            uint32_t* next = nullptr;
+            if (!mFree.pop(next))
+            {
+                auto startTime = getTime();
+                mFreeWait.wait([&]() { return mFree.pop(next); });
+                mBlockedCount.fetch_add(1, std::memory_order_relaxed);
+                mBlockedTime.fetch_add(getTime() - startTime, std::memory_order_relaxed);
+            }
+            return next;
+        }
+
+        void getStats(WriterStats& stats) const
+        {
+            stats.chunkCount = mChunkCount.load(std::memory_order_relaxed);
+            stats.byteCount = mByteCount.load(std::memory_order_relaxed);
+            stats.rawByteCount = mRawByteCount.load(std::memory_order_relaxed);
+            stats.compressTime = mCompressTime.load(std::memory_order_relaxed);
+            stats.blockedCount = mBlockedCount.load(std::memory_order_relaxed);
+            stats.blockedTime = mBlockedTime.load(std::memory_order_relaxed);
+            stats.writeTime = mWriteTime.load(std::memory_order_relaxed);
+            stats.queueDepth = static_cast<uint32_t>(mFilled.size());
+            stats.maxQueueDepth = mMaxQueueDepth.load(std::memory_order_relaxed);
+            stats.bufferCount = static_cast<uint32_t>(mBuffers.size());
+        }
+
+    private:
+        struct Pending
+        {
+            uint32_t*   mData;
+            size_t      mCount;
+            uint64_t    mInstruction;
+        };
+
+        static size_t getBufferCount(const CaptureSettings& settings)
+        {
+            return settings.writerThread ? std::max<size_t>(settings.writerBufferCount, 2) : 1;
+        }
+
+        void run()
+        {
+            for (;;)
+            {
+                Pending pending;
+                if (mFilled.pop(pending))
+                {
+                    writeChunk(pending.mData, pending.mCount, pending.mInstruction);
+                    mFree.push(pending.mData);
+                    mFreeWait.notify();
+                }
+                else if (mStop.load())
+                {
+                    break;
+                }
+                else
+                {
+                    mFilledWait.wait([&]() { return !mFilled.empty() || mStop.load(); });
+                }
+            }
+        }
+
+        void writeChunk(const uint32_t* data, size_t count, uint64_t instruction)
+        {
+            // Hashes are taken on the records so they do not depend on how chunks are stored
+            auto rawSize = count * sizeof(uint32_t);
+            const void* stored = data;
+            auto hash = mHashChunks ? hashBytes(data, rawSize) : 0;
+            if (mColumnar)
+            {
+                rawSize = Columns::write(data, count, mColumns.data());
+                stored = mColumns.data();
+            }
+
+            auto size = rawSize;
+            if (mCompressor)
+            {
+                // Chunks that do not shrink are stored as is
+                auto startTime = getTime();
+                auto compressedSize = mCompressor->compress(static_cast<const uint8_t*>(stored), rawSize, mCompressed.data(), rawSize);
+                if (compressedSize)
+                {
+                    size = compressedSize;
+                    stored = mCompressed.data();
+                }
+                mCompressTime.fetch_add(getTime() - startTime, std::memory_order_relaxed);
+            }
+
+            auto startTime = getTime();
+            Trace::Chunk chunk = { 0, size, rawSize, mStreamIndex, instruction, hash };
+            auto alignedSize = mSink.writeChunk(chunk, stored);
+            mWriteTime.fetch_add(getTime() - startTime, std::memory_order_relaxed);
+            mByteCount.fetch_add(alignedSize, std::memory_order_relaxed);
+            mRawByteCount.fetch_add(rawSize, std::memory_order_relaxed);
+            mChunkCount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        TraceSink&                          mSink;
+        uint32_t                            mStreamIndex;
+        size_t                              mChunkWords;
+        bool                                mThreaded;
+        uint32_t                            mCompressionLevel;
+        bool                                mHashChunks;
+        bool                                mColumnar;
+        std::vector<uint8_t>                mColumns;
+        std::unique_ptr<Compressor>         mCompressor;
+        std::vector<uint8_t>                mCompressed;
+        std::vector<std::vector<uint32_t>>  mBuffers;
+        SpscQueue<Pending>                  mFilled;
+        SpscQueue<uint32_t*>                mFree;
+        WaitPoint                           mFilledWait;
+        WaitPoint                           mFreeWait;
+        std::thread                         mThread;
+        std::atomic<bool>                   mStop;
+        std::atomic<uint64_t>               mChunkCount;
+        std::atomic<uint64_t>               mByteCount;
+        std::atomic<uint64_t>               mRawByteCount;
+        std::atomic<uint64_t>               mCompressTime;
+        std::atomic<uint64_t>               mBlockedCount;
+        std::atomic<uint64_t>               mBlockedTime;
+        std::atomic<uint64_t>               mWriteTime;
+        std::atomic<uint32_t>               mMaxQueueDepth;
+    };
+
+    const uint32_t AccessCount = 6;
+    const uint32_t MaxBatchCount = 256;
+
+    static_assert((RawAccess::Read8 == static_cast<uint32_t>(Command::Read8)) && (RawAccess::Write32 == static_cast<uint32_t>(Command::Write32)), "CaptureWriter records do not match");
+
+    namespace CompactTag
+    {
+        enum
+        {
+            CommandBits = 5,
+            CommandMask = (1 << CommandBits) - 1,
+            ArgEscape = 0xff >> CommandBits,
+        };
+    }
+
+    uint32_t getAccessSlot(Command command)
+    {
+        return static_cast<uint32_t>(command) - static_cast<uint32_t>(Command::Read8);
+    }
+
+    uint32_t getAccessSize(Command command)
+    {
+        return 1u << (getAccessSlot(command) % 3);
+    }
+
+    RecordCommand getRecordCommand(Command command)
+    {
+        return static_cast<RecordCommand>(static_cast<uint32_t>(RecordCommand::Read8) + getAccessSlot(command));
+    }
+
+    // Access of the given size in bytes, from the access of the same kind and any size
+    Command getSizedAccess(Command command, uint32_t size)
+    {
+        assert((size == 1) || (size == 2) || (size == 4));
+        return static_cast<Command>(static_cast<uint32_t>(command) + (size >> 1));
+    }
+
+    // Range and gather records hold the access slot and the number of accesses in one field
+    uint32_t packBatch(Command command, uint32_t count)
+    {
+        return (count << 3) | getAccessSlot(command);
+    }
+
+    bool unpackBatch(uint32_t value, Command& command, uint32_t& count)
+    {
+        auto slot = value & 7;
+        count = value >> 3;
+        if ((slot >= AccessCount) || !count || (count > MaxBatchCount))
+            return false;
+        command = static_cast<Command>(static_cast<uint32_t>(Command::Read8) + slot);
+        return true;
+    }
+
+    // Values of batches are packed and not aligned
+    uint32_t readValue(const uint8_t* data, uint32_t index, uint32_t size)
+    {
+        auto pos = data + index * size;
+        if (size == 1)
+            return *pos;
+        if (size == 2)
+        {
+            uint16_t value = 0;
+            memcpy(&value, pos, sizeof(value));
+            return value;
+        }
+        uint32_t value = 0;
+        memcpy(&value, pos, sizeof(value));
+        return value;
+    }
+
+    uint32_t zigzag(uint32_t value)
+    {
+        return (value << 1) ^ (0 - (value >> 31));
+    }
+
+    uint32_t unzigzag(uint32_t value)
+    {
+        return (value >> 1) ^ (0 - (value & 1));
+    }
+
+    uint8_t* writeWord(uint8_t* pos, uint32_t value)
+    {
+        memcpy(pos, &value, sizeof(value));
+        return pos + sizeof(value);
+    }
+
+    uint8_t* writeVarint(uint8_t* pos, uint32_t value)
+    {
+        while (value >= 0x80)
+        {
+            *pos++ = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *pos++ = static_cast<uint8_t>(value);
+        return pos;
+    }
+
+    bool readVarint(const uint8_t*& pos, const uint8_t* end, uint32_t& value)
+    {
+        uint32_t result = 0;
+        for (uint32_t shift = 0; (shift < 35) && (pos < end); shift += 7)
+        {
+            uint32_t byte = *pos++;
+            result |= (byte & 0x7f) << shift;
+            if (byte < 0x80)
+            {
+                value = result;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Fixed size records: a command header word followed by 32-bit payload words
+    struct RawEncoder
+    {
+        static const size_t MaxEventSize = 5 * sizeof(uint32_t);
+        // Access records can be written by CaptureWriter
+        static const bool DirectWrite = true;
+
+        static size_t getStateSize(size_t size)
+        {
+            return sizeof(uint32_t) + alignUp<sizeof(uint32_t)>(size);
+        }
+
+        static size_t getDeltaSize(size_t count)
+        {
+            return (1 + 2 * count) * sizeof(uint32_t);
+        }
+
+        static size_t getBatchSize(uint32_t count, uint32_t size, bool gather)
+        {
+            return (2 + (gather ? count : 1)) * sizeof(uint32_t) + alignUp<sizeof(uint32_t)>(count * size);
+        }
+
+        RawEncoder(const CaptureSettings&, size_t)
+        {
+        }
+
+        void reset()
+        {
+        }
+
+        uint8_t* flush(uint8_t* pos)
+        {
+            return pos;
+        }
+
+        uint8_t* setState(uint8_t* pos, const void* state, size_t size, uint32_t flags)
+        {
+            auto count = blockCount(size);
+            pos = writeWord(pos, CommandHeader::make(Command::SetState, count, flags).u32);
+            if (count)
+                writeWord(pos + (count - 1) * sizeof(uint32_t), 0);
+            memcpy(pos, state, size);
+            return pos + count * sizeof(uint32_t);
+        }
+
+        uint8_t* execute(uint8_t* pos, const uint32_t* hash)
+        {
+            if (!hash)
+                return writeWord(pos, CommandHeader::make(Command::Execute).u32);
+            pos = writeWord(pos, CommandHeader::make(Command::Execute, 4).u32);
+            memcpy(pos, hash, 4 * sizeof(uint32_t));
+            return pos + 4 * sizeof(uint32_t);
+        }
+
+        // Pairs of state word index and difference with its previous value
+        uint8_t* delta(uint8_t* pos, const uint32_t* words, size_t count)
+        {
+            pos = writeWord(pos, CommandHeader::make(Command::Delta, 2 * count).u32);
+            memcpy(pos, words, 2 * count * sizeof(uint32_t));
+            return pos + 2 * count * sizeof(uint32_t);
+        }
+
+        uint8_t* event(uint8_t* pos, Command command, uint32_t type)
+        {
+            pos = writeWord(pos, CommandHeader::make(command, 1).u32);
+            return writeWord(pos, type);
+        }
+
+        uint8_t* sync(uint8_t* pos, uint64_t time)
+        {
+            pos = writeWord(pos, CommandHeader::make(Command::Sync, 2).u32);
+            pos = writeWord(pos, static_cast<uint32_t>(time));
+            return writeWord(pos, static_cast<uint32_t>(time >> 32));
+        }
+
+        uint8_t* access(uint8_t* pos, Command command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            pos = writeWord(pos, CommandHeader::make(command, 2, type).u32);
+            pos = writeWord(pos, addr);
+            return writeWord(pos, value);
+        }
+
+        // Access command and count, start address, then the values packed and padded to a whole word
+        uint8_t* range(uint8_t* pos, Command command, uint32_t addr, const uint8_t* data, uint32_t count, uint32_t type)
+        {
+            auto size = count * getAccessSize(command);
+            pos = writeWord(pos, CommandHeader::make(Command::Range, 2 + blockCount(size), type).u32);
+            pos = writeWord(pos, packBatch(command, count));
+            pos = writeWord(pos, addr);
+            return writeValues(pos, data, size);
+        }
+
+        uint8_t* gather(uint8_t* pos, Command command, const uint32_t* addrs, const uint8_t* data, uint32_t count, uint32_t type)
+        {
+            auto size = count * getAccessSize(command);
+            pos = writeWord(pos, CommandHeader::make(Command::Gather, 1 + count + blockCount(size), type).u32);
+            pos = writeWord(pos, packBatch(command, count));
+            memcpy(pos, addrs, count * sizeof(uint32_t));
+            return writeValues(pos + count * sizeof(uint32_t), data, size);
+        }
+
+    private:
+        static uint8_t* writeValues(uint8_t* pos, const uint8_t* data, size_t size)
+        {
+            auto count = blockCount(size);
+            if (count)
+                writeWord(pos + (count - 1) * sizeof(uint32_t), 0);
+            memcpy(pos, data, size);
+            return pos + count * sizeof(uint32_t);
+        }
+    };
+
+    namespace FetchFlag
+    {
+        enum
+        {
+            Branch = 1 << 0,
+            Literal = 1 << 1,
+        };
+    }
+
+    const uint32_t FetchCacheSize = 1024;
+    const uint32_t MinBlockLength = 2;
+    const uint32_t MaxBlockLength = 32;
+    const uint32_t MaxBlockCount = 4096;
+    const uint32_t BlockTableSize = 1024;
+
+    uint32_t getFetchSlot(uint32_t addr)
+    {
+        return (addr >> 1) & (FetchCacheSize - 1);
+    }
+
+    // Prediction state shared by the compact encoder and decoder, reset at each chunk and state record
+    struct CompactState
+    {
+        // Run of instructions made of an execute record immediately followed by a sequential fetch
+        struct Block
+        {
+            Command     mCommand;
+            uint32_t    mStart;
+            uint32_t    mLength;
+            uint32_t    mOpcodes;
+        };
+
+        CompactState()
+            : mStateSize(0)
+            , mCodeType(0)
+            , mVerifyMode(VerifyMode::Every)
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            memset(mAddress, 0, sizeof(mAddress));
+            mFetchCommand = Command::Header;
+            mFetchAddress = 0;
+            memset(mFetchCache, 0, sizeof(mFetchCache));
+            mBlocks.clear();
+            mBlockOpcodes.clear();
+            mBlock = 0;
+            mBlockStep = 0;
+            mBlockLength = 0;
+            mBlockHashes = 0;
+            mBlockFetch = false;
+            mSyncTime = 0;
+        }
+
+        // Blocks without hashes left take no bytes, so their last instructions can remain after the end of a chunk
+        bool isExpanding() const
+        {
+            return mBlockFetch || (mBlockStep < mBlockLength);
+        }
+
+        // Unless every instruction is hashed, blocks hold a mask of the instructions that have a hash
+        bool hasHashMask() const
+        {
+            return mVerifyMode != VerifyMode::Every;
+        }
+
+        bool isFetch(Command command, uint32_t type) const
+        {
+            return (type == mCodeType) && ((command == Command::Read16) || (command == Command::Read32));
+        }
+
+        // Instruction fetches that cannot be encoded as a Fetch record still update the prediction
+        void setFetch(Command command, uint32_t addr, uint32_t value)
+        {
+            mFetchCommand = command;
+            mFetchAddress = addr + getAccessSize(command);
+            mFetchCache[getFetchSlot(addr)] = value;
+        }
+
+        uint32_t addBlock(Command command, uint32_t start, uint32_t length, const uint32_t* opcodes)
+        {
+            Block block = { command, start, length, static_cast<uint32_t>(mBlockOpcodes.size()) };
+            mBlocks.push_back(block);
+            mBlockOpcodes.insert(mBlockOpcodes.end(), opcodes, opcodes + length);
+            return static_cast<uint32_t>(mBlocks.size() - 1);
+        }
+
+        // Fetches of a block update the prediction as if they had been recorded one by one
+        void setBlockFetch(const Block& block, uint32_t step)
+        {
+            auto size = getAccessSize(block.mCommand);
+            setFetch(block.mCommand, block.mStart + step * size, mBlockOpcodes[block.mOpcodes + step]);
+        }
+
+        size_t                  mStateSize;
+        uint32_t                mCodeType;
+        VerifyMode              mVerifyMode;
+        uint32_t                mAddress[AccessCount];
+        Command                 mFetchCommand;
+        uint32_t                mFetchAddress;
+        uint32_t                mFetchCache[FetchCacheSize];
+        std::vector<Block>      mBlocks;
+        std::vector<uint32_t>   mBlockOpcodes;
+        // Block being expanded by the decoder
+        uint32_t                mBlock;
+        uint32_t                mBlockStep;
+        uint32_t                mBlockLength;
+        uint32_t                mBlockHashes;
+        bool                    mBlockFetch;
+        uint64_t                mSyncTime;
+    };
+
+    // Byte records: a tag holding the command and a small argument, followed by variable length fields.
+    // Addresses are stored as the difference with the address following the previous access of the same kind.
+    // Instruction fetches of the same size as the previous one are predicted to follow it and their value is
+    // looked up in a cache indexed by address, so a fetch in a loop usually takes a single byte.
+    // Runs of instructions doing nothing but fetching sequential code are held back until they end, then
+    // stored once in a dictionary keyed on start address and opcodes and only referenced when repeated.
+    // State deltas store the gap between the indices of changed words and the zigzag difference of their values.
+    struct CompactEncoder
+    {
+        static const size_t ExecuteSize = 1 + 4 * sizeof(uint32_t);
+        static const size_t FetchSize = 1 + 5 + sizeof(uint32_t);
+        static const size_t MaxBlockSize = 1 + 4 * 5 + MaxBlockLength * (ExecuteSize + FetchSize);
+
+        // A record can flush a pending block and execute, the room left must hold the next pending block
+        static const size_t MaxEventSize = 2 * (MaxBlockSize + ExecuteSize);
+        static const bool DirectWrite = false;
+
+        static size_t getStateSize(size_t size)
+        {
+            return 1 + size;
+        }
+
+        static size_t getDeltaSize(size_t count)
+        {
+            return 1 + 5 + count * (5 + 5);
+        }
+
+        static size_t getBatchSize(uint32_t count, uint32_t size, bool gather)
+        {
+            return 1 + 5 + 5 + (gather ? count : 1) * 5 + count * size;
+        }
+
+        static uint8_t* writeTag(uint8_t* pos, Command command, uint32_t arg)
+        {
+            if (arg < CompactTag::ArgEscape)
+            {
+                *pos++ = static_cast<uint8_t>(static_cast<uint32_t>(command) | (arg << CompactTag::CommandBits));
+                return pos;
+            }
+            *pos++ = static_cast<uint8_t>(static_cast<uint32_t>(command) | (CompactTag::ArgEscape << CompactTag::CommandBits));
+            return writeVarint(pos, arg);
+        }
+
+        static uint8_t* writeHash(uint8_t* pos, const uint32_t* hash)
+        {
+            memcpy(pos, hash, 4 * sizeof(uint32_t));
+            return pos + 4 * sizeof(uint32_t);
+        }
+
+        CompactEncoder(const CaptureSettings& settings, size_t stateSize)
+        {
+            mState.mStateSize = stateSize;
+            mState.mCodeType = settings.codeType;
+            mState.mVerifyMode = settings.verifyPolicy.mode;
+            reset();
+        }
+
+        void reset()
+        {
+            mState.reset();
+            memset(mBlockTable, 0, sizeof(mBlockTable));
+            mRunLength = 0;
+            mRunHashMask = 0;
+            mExecuteHashed = false;
+            mExecutePending = false;
+        }
+
+        // Writes the instructions held back
+        uint8_t* flush(uint8_t* pos)
+        {
+            pos = writeRun(pos);
+            if (mExecutePending)
+            {
+                pos = writeExecute(pos, mExecuteHashed ? mExecuteHash : nullptr);
+                mExecutePending = false;
+            }
+            return pos;
+        }
+
+        uint8_t* setState(uint8_t* pos, const void* state, size_t size, uint32_t flags)
+        {
+            pos = flush(pos);
+            reset();
+            pos = writeTag(pos, Command::SetState, flags);
+            memcpy(pos, state, size);
+            return pos + size;
+        }
+
+        uint8_t* execute(uint8_t* pos, const uint32_t* hash)
+        {
+            if (mExecutePending)
+                pos = flush(pos);
+            mExecuteHashed = hash != nullptr;
+            if (hash)
+                memcpy(mExecuteHash, hash, sizeof(mExecuteHash));
+            mExecutePending = true;
+            return pos;
+        }
+
+        uint8_t* delta(uint8_t* pos, const uint32_t* words, size_t count)
+        {
+            pos = flush(pos);
+            pos = writeTag(pos, Command::Delta, static_cast<uint32_t>(count));
+            uint32_t next = 0;
+            for (size_t index = 0; index < count; ++index)
+            {
+                pos = writeVarint(pos, words[index * 2] - next);
+                pos = writeVarint(pos, zigzag(words[index * 2 + 1]));
+                next = words[index * 2] + 1;
+            }
+            return pos;
+        }
+
+        uint8_t* event(uint8_t* pos, Command command, uint32_t type)
+        {
+            pos = flush(pos);
+            return writeTag(pos, command, type);
+        }
+
+        // Times are stored as the difference with the previous one in the chunk
+        uint8_t* sync(uint8_t* pos, uint64_t time)
+        {
+            pos = flush(pos);
+            auto delta = time - mState.mSyncTime;
+            mState.mSyncTime = time;
+            pos = writeTag(pos, Command::Sync, 0);
+            pos = writeVarint(pos, static_cast<uint32_t>(delta));
+            return writeVarint(pos, static_cast<uint32_t>(delta >> 32));
+        }
+
+        uint8_t* access(uint8_t* pos, Command command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (mExecutePending && (command == mState.mFetchCommand) && mState.isFetch(command, type))
+            {
+                if (mRunLength && (addr != mRunStart + mRunLength * getAccessSize(command)))
+                    pos = writeRun(pos);
+                if (!mRunLength)
+                {
+                    mRunStart = addr;
+                    mRunHashMask = 0;
+                }
+                if (mExecuteHashed)
+                {
+                    memcpy(mRunHashes[mRunLength], mExecuteHash, sizeof(mExecuteHash));
+                    mRunHashMask |= 1u << mRunLength;
+                }
+                mRunOpcodes[mRunLength++] = value;
+                mExecutePending = false;
+                if (mRunLength == MaxBlockLength)
+                    pos = writeRun(pos);
+                return pos;
+            }
+
+            pos = flush(pos);
+            return writeAccess(pos, command, addr, value, type);
+        }
+
+        // Batches store their addresses like single accesses and their values as they are
+        uint8_t* range(uint8_t* pos, Command command, uint32_t addr, const uint8_t* data, uint32_t count, uint32_t type)
+        {
+            auto slot = getAccessSlot(command);
+            auto size = count * getAccessSize(command);
+            pos = flush(pos);
+            pos = writeTag(pos, Command::Range, type);
+            pos = writeVarint(pos, packBatch(command, count));
+            pos = writeVarint(pos, zigzag(addr - mState.mAddress[slot]));
+            mState.mAddress[slot] = addr + size;
+            memcpy(pos, data, size);
+            return pos + size;
+        }
+
+        uint8_t* gather(uint8_t* pos, Command command, const uint32_t* addrs, const uint8_t* data, uint32_t count, uint32_t type)
+        {
+            auto slot = getAccessSlot(command);
+            auto size = getAccessSize(command);
+            pos = flush(pos);
+            pos = writeTag(pos, Command::Gather, type);
+            pos = writeVarint(pos, packBatch(command, count));
+            for (uint32_t index = 0; index < count; ++index)
+            {
+                pos = writeVarint(pos, zigzag(addrs[index] - mState.mAddress[slot]));
+                mState.mAddress[slot] = addrs[index] + size;
+            }
+            memcpy(pos, data, count * size);
+            return pos + count * size;
+        }
+
+    private:
+        uint8_t* writeExecute(uint8_t* pos, const uint32_t* hash)
+        {
+            if (!hash)
+                return writeTag(pos, Command::Execute, ExecuteFlag::NoHash);
+            pos = writeTag(pos, Command::Execute, 0);
+            return writeHash(pos, hash);
+        }
+
+        uint8_t* writeAccess(uint8_t* pos, Command command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (mState.isFetch(command, type))
+            {
+                if (command == mState.mFetchCommand)
+                    return writeFetch(pos, addr, value);
+                mState.setFetch(command, addr, value);
+            }
+
+            auto slot = getAccessSlot(command);
+            auto size = getAccessSize(command);
+            pos = writeTag(pos, command, type);
+            pos = writeVarint(pos, zigzag(addr - mState.mAddress[slot]));
+            mState.mAddress[slot] = addr + size;
+            if (size == 1)
+            {
+                *pos++ = static_cast<uint8_t>(value);
+                return pos;
+            }
+            return writeVarint(pos, value);
+        }
+
+        uint8_t* writeFetch(uint8_t* pos, uint32_t addr, uint32_t value)
+        {
+            auto size = getAccessSize(mState.mFetchCommand);
+            auto& cached = mState.mFetchCache[getFetchSlot(addr)];
+            uint32_t flags = 0;
+            if (addr != mState.mFetchAddress)
+                flags |= FetchFlag::Branch;
+            if (value != cached)
+                flags |= FetchFlag::Literal;
+
+            pos = writeTag(pos, Command::Fetch, flags);
+            if (flags & FetchFlag::Branch)
+                pos = writeVarint(pos, zigzag(addr - mState.mFetchAddress));
+            if (flags & FetchFlag::Literal)
+            {
+                memcpy(pos, &value, size);
+                pos += size;
+                cached = value;
+            }
+            mState.mFetchAddress = addr + size;
+            return pos;
+        }
+
+        uint32_t& getBlockEntry()
+        {
+            return mBlockTable[((mRunStart >> 1) ^ (mRunLength * 97)) & (BlockTableSize - 1)];
+        }
+
+        uint32_t* findBlock()
+        {
+            auto& entry = getBlockEntry();
+            if (entry)
+            {
+                const auto& block = mState.mBlocks[entry - 1];
+                if ((block.mCommand == mState.mFetchCommand) && (block.mStart == mRunStart) && (block.mLength == mRunLength) &&
+                    !memcmp(&mState.mBlockOpcodes[block.mOpcodes], mRunOpcodes, mRunLength * sizeof(uint32_t)))
+                    return &entry;
+            }
+            return nullptr;
+        }
+
+        uint8_t* writeRun(uint8_t* pos)
+        {
+            auto length = mRunLength;
+            if (!length)
+                return pos;
+
+            auto entry = findBlock();
+            if (!entry && ((length < MinBlockLength) || (mState.mBlocks.size() >= MaxBlockCount)))
+            {
+                mRunLength = 0;
+                auto size = getAccessSize(mState.mFetchCommand);
+                for (uint32_t index = 0; index < length; ++index)
+                {
+                    pos = writeExecute(pos, (mRunHashMask & (1u << index)) ? mRunHashes[index] : nullptr);
+                    pos = writeFetch(pos, mRunStart + index * size, mRunOpcodes[index]);
+                }
+                return pos;
+            }
+
+            uint32_t id = 0;
+            if (entry)
+            {
+                id = *entry - 1;
+                pos = writeTag(pos, Command::RepeatBlock, id);
+            }
+            else
+            {
+                // Opcodes already in the fetch cache are not repeated
+                auto size = getAccessSize(mState.mFetchCommand);
+                uint32_t literals = 0;
+                for (uint32_t index = 0; index < length; ++index)
+                {
+                    if (mRunOpcodes[index] != mState.mFetchCache[getFetchSlot(mRunStart + index * size)])
+                        literals |= 1u << index;
+                }
+                pos = writeTag(pos, Command::DefineBlock, length);
+                pos = writeVarint(pos, zigzag(mRunStart - mState.mFetchAddress));
+                pos = writeVarint(pos, literals);
+                for (uint32_t index = 0; index < length; ++index)
+                {
+                    if (literals & (1u << index))
+                    {
+                        memcpy(pos, &mRunOpcodes[index], size);
+                        pos += size;
+                    }
+                }
+                id = mState.addBlock(mState.mFetchCommand, mRunStart, length, mRunOpcodes);
+                getBlockEntry() = id + 1;
+            }
+            mRunLength = 0;
+
+            if (mState.hasHashMask())
+                pos = writeVarint(pos, mRunHashMask);
+            const auto& block = mState.mBlocks[id];
+            for (uint32_t index = 0; index < length; ++index)
+            {
+                if (mRunHashMask & (1u << index))
+                    pos = writeHash(pos, mRunHashes[index]);
+                mState.setBlockFetch(block, index);
+            }
+            return pos;
+        }
+
+        CompactState    mState;
+        uint32_t        mBlockTable[BlockTableSize];
+        uint32_t        mRunStart;
+        uint32_t        mRunLength;
+        uint32_t        mRunHashMask;
+        uint32_t        mRunOpcodes[MaxBlockLength];
+        uint32_t        mRunHashes[MaxBlockLength][4];
+        uint32_t        mExecuteHash[4];
+        bool            mExecuteHashed;
+        bool            mExecutePending;
+    };
+
+    // Access command and count, then the start address or the addresses, then the values
+    template <typename THandler>
+    bool decodeRawBatch(Command command, const uint32_t* payload, uint32_t blocks, uint32_t type, THandler& handler)
+    {
+        auto access = Command::Header;
+        uint32_t count = 0;
+        if (!blocks || !unpackBatch(payload[0], access, count))
+            return false;
+        size_t addrCount = command == Command::Gather ? count : 1;
+        if (1 + addrCount + blockCount(count * getAccessSize(access)) > blocks)
+            return false;
+        auto data = reinterpret_cast<const uint8_t*>(payload + 1 + addrCount);
+        if (command == Command::Gather)
+            handler.batch(access, 0, payload + 1, data, count, type);
+        else
+            handler.batch(access, payload[1], nullptr, data, count, type);
+        return true;
+    }
+
+    // Decodes raw records, returns where decoding stopped when the handler asks to stop
+    template <typename THandler>
+    const uint8_t* decodeRaw(const uint8_t* pos, const uint8_t* end, THandler& handler)
+    {
+        while (pos < end)
+        {
+            auto words = reinterpret_cast<const uint32_t*>(pos);
+            auto header = CommandHeader::from(words[0]);
+            auto payload = words + 1;
+            auto next = reinterpret_cast<const uint8_t*>(payload + header.fields.blocks);
+            if (next > end)
+            {
+                handler.invalid();
+                return end;
+            }
+
+            uint32_t extra = header.fields.extra;
+            auto command = static_cast<Command>(header.fields.command);
+            switch (command)
+            {
+            case Command::Footer:
+                handler.footer();
+                return end;
+
+            case Command::SetState:
+                if (!handler.setState(payload, extra))
+                    return next;
+                break;
+
+            case Command::Execute:
+                if (!handler.canExecute())
+                    return pos;
+                if (!handler.execute(header.fields.blocks >= 4 ? payload : nullptr))
+                    return next;
+                break;
+
+            case Command::Delta:
+                for (uint32_t index = 0; index + 1 < header.fields.blocks; index += 2)
+                {
+                    if (!handler.deltaWord(payload[index], payload[index + 1]))
+                    {
+                        handler.invalid();
+                        return end;
+                    }
+                }
+                if (!handler.delta())
+                    return next;
+                break;
+
+            case Command::Interrupt:
+                handler.interrupt(payload[0]);
+                break;
+
+            case Command::Sync:
+                if (!handler.sync(makeU64(payload[0], payload[1])))
+                    return next;
+                break;
+
+            case Command::Signal:
+                handler.signal(payload[0]);
+                break;
+
+            case Command::Read8:
+            case Command::Read16:
+            case Command::Read32:
+            case Command::Write8:
+            case Command::Write16:
+            case Command::Write32:
+                handler.access(command, payload[0], payload[1], extra);
+                break;
+
+            case Command::Range:
+            case Command::Gather:
+                if (!decodeRawBatch(command, payload, header.fields.blocks, extra, handler))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                break;
+
+            default:
+                break;
+            }
+            pos = next;
+        }
+        return pos;
+    }
+
+    // Reads which instructions of the block being expanded have a hash
+    bool readBlockHashes(const uint8_t*& pos, const uint8_t* end, CompactState& state)
+    {
+        state.mBlockHashes = UINT32_MAX;
+        return !state.hasHashMask() || readVarint(pos, end, state.mBlockHashes);
+    }
+
+    // Decodes compact records, returns where decoding stopped when the handler asks to stop
+    template <typename THandler>
+    const uint8_t* decodeCompact(const uint8_t* pos, const uint8_t* end, CompactState& state, THandler& handler)
+    {
+        auto stateSize = state.mStateSize;
+        while ((pos < end) || state.isExpanding())
+        {
+            // Each instruction of a block is an execute record holding a hash followed by a fetch from the dictionary
+            if (state.mBlockFetch)
+            {
+                const auto& block = state.mBlocks[state.mBlock];
+                auto step = state.mBlockStep - 1;
+                state.mBlockFetch = false;
+                state.setBlockFetch(block, step);
+                handler.access(block.mCommand, block.mStart + step * getAccessSize(block.mCommand), state.mBlockOpcodes[block.mOpcodes + step], state.mCodeType);
+                continue;
+            }
+            if (state.mBlockStep < state.mBlockLength)
+            {
+                if (!handler.canExecute())
+                    return pos;
+                const uint8_t* hash = nullptr;
+                if (state.mBlockHashes & (1u << state.mBlockStep))
+                {
+                    if (end - pos < static_cast<ptrdiff_t>(4 * sizeof(uint32_t)))
+                    {
+                        handler.invalid();
+                        return end;
+                    }
+                    hash = pos;
+                    pos += 4 * sizeof(uint32_t);
+                }
+                ++state.mBlockStep;
+                state.mBlockFetch = true;
+                if (!handler.execute(hash))
+                    return pos;
+                continue;
+            }
+
+            auto record = pos;
+            uint32_t tag = *pos++;
+            auto command = static_cast<Command>(tag & CompactTag::CommandMask);
+            uint32_t arg = tag >> CompactTag::CommandBits;
+            if ((arg == CompactTag::ArgEscape) && !readVarint(pos, end, arg))
+            {
+                handler.invalid();
+                return end;
+            }
+
+            switch (command)
+            {
+            case Command::Header:
+                // Padding up to the end of the chunk
+                return end;
+
+            case Command::SetState:
+                if (static_cast<size_t>(end - pos) < stateSize)
+                {
+                    handler.invalid();
+                    return end;
+                }
+                state.reset();
+                pos += stateSize;
+                if (!handler.setState(pos - stateSize, arg))
+                    return pos;
+                break;
+
+            case Command::Execute:
+                if (!handler.canExecute())
+                    return record;
+                if (arg & ExecuteFlag::NoHash)
+                {
+                    if (!handler.execute(nullptr))
+                        return pos;
+                    break;
+                }
+                if (end - pos < static_cast<ptrdiff_t>(4 * sizeof(uint32_t)))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                pos += 4 * sizeof(uint32_t);
+                if (!handler.execute(pos - 4 * sizeof(uint32_t)))
+                    return pos;
+                break;
+
+            case Command::Delta:
+            {
+                uint32_t next = 0;
+                for (uint32_t count = 0; count < arg; ++count)
+                {
+                    uint32_t gap = 0;
+                    uint32_t difference = 0;
+                    if (!readVarint(pos, end, gap) || !readVarint(pos, end, difference) || !handler.deltaWord(next + gap, unzigzag(difference)))
+                    {
+                        handler.invalid();
+                        return end;
+                    }
+                    next += gap + 1;
+                }
+                if (!handler.delta())
+                    return pos;
+                break;
+            }
+
+            case Command::Interrupt:
+                handler.interrupt(arg);
+                break;
+
+            case Command::Sync:
+            {
+                uint32_t low = 0;
+                uint32_t high = 0;
+                if (!readVarint(pos, end, low) || !readVarint(pos, end, high))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                state.mSyncTime += makeU64(low, high);
+                if (!handler.sync(state.mSyncTime))
+                    return pos;
+                break;
+            }
+
+            case Command::Signal:
+                handler.signal(arg);
+                break;
+
+            case Command::Read8:
+            case Command::Read16:
+            case Command::Read32:
+            case Command::Write8:
+            case Command::Write16:
+            case Command::Write32:
+            {
+                auto slot = getAccessSlot(command);
+                auto size = getAccessSize(command);
+                uint32_t delta = 0;
+                uint32_t value = 0;
+                if (!readVarint(pos, end, delta))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                auto addr = state.mAddress[slot] + unzigzag(delta);
+                state.mAddress[slot] = addr + size;
+                if (size == 1)
+                {
+                    if (pos == end)
+                    {
+                        handler.invalid();
+                        return end;
+                    }
+                    value = *pos++;
+                }
+                else if (!readVarint(pos, end, value))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                if (state.isFetch(command, arg))
+                    state.setFetch(command, addr, value);
+                handler.access(command, addr, value, arg);
+                break;
+            }
+
+            case Command::Range:
+            case Command::Gather:
+            {
+                auto access = Command::Header;
+                uint32_t value = 0;
+                uint32_t count = 0;
+                if (!readVarint(pos, end, value) || !unpackBatch(value, access, count))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                auto slot = getAccessSlot(access);
+                auto size = getAccessSize(access);
+                uint32_t addrs[MaxBatchCount];
+                uint32_t addrCount = command == Command::Gather ? count : 1;
+                for (uint32_t index = 0; index < addrCount; ++index)
+                {
+                    uint32_t delta = 0;
+                    if (!readVarint(pos, end, delta))
+                    {
+                        handler.invalid();
+                        return end;
+                    }
+                    addrs[index] = state.mAddress[slot] + unzigzag(delta);
+                    state.mAddress[slot] = addrs[index] + size;
+                }
+                if (static_cast<size_t>(end - pos) < count * size)
+                {
+                    handler.invalid();
+                    return end;
+                }
+                if (command == Command::Gather)
+                {
+                    handler.batch(access, 0, addrs, pos, count, arg);
+                }
+                else
+                {
+                    state.mAddress[slot] = addrs[0] + count * size;
+                    handler.batch(access, addrs[0], nullptr, pos, count, arg);
+                }
+                pos += count * size;
+                break;
+            }
+
+            case Command::Fetch:
+            {
+                if (state.mFetchCommand == Command::Header)
+                {
+                    handler.invalid();
+                    return end;
+                }
+                auto size = getAccessSize(state.mFetchCommand);
+                auto addr = state.mFetchAddress;
+                if (arg & FetchFlag::Branch)
+                {
+                    uint32_t delta = 0;
+                    if (!readVarint(pos, end, delta))
+                    {
+                        handler.invalid();
+                        return end;
+                    }
+                    addr += unzigzag(delta);
+                }
+                auto& cached = state.mFetchCache[getFetchSlot(addr)];
+                if (arg & FetchFlag::Literal)
+                {
+                    if (static_cast<size_t>(end - pos) < size)
+                    {
+                        handler.invalid();
+                        return end;
+                    }
+                    uint32_t value = 0;
+                    memcpy(&value, pos, size);
+                    pos += size;
+                    cached = value;
+                }
+                state.mFetchAddress = addr + size;
+                handler.access(state.mFetchCommand, addr, cached, state.mCodeType);
+                break;
+            }
+
+            case Command::DefineBlock:
+            {
+                uint32_t delta = 0;
+                uint32_t literals = 0;
+                if ((state.mFetchCommand == Command::Header) || !arg || (arg > MaxBlockLength) || (state.mBlocks.size() >= MaxBlockCount) ||
+                    !readVarint(pos, end, delta) || !readVarint(pos, end, literals))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                auto size = getAccessSize(state.mFetchCommand);
+                auto start = state.mFetchAddress + unzigzag(delta);
+                uint32_t opcodes[MaxBlockLength];
+                for (uint32_t index = 0; index < arg; ++index)
+                {
+                    if (!(literals & (1u << index)))
+                    {
+                        opcodes[index] = state.mFetchCache[getFetchSlot(start + index * size)];
+                        continue;
+                    }
+                    if (static_cast<size_t>(end - pos) < size)
+                    {
+                        handler.invalid();
+                        return end;
+                    }
+                    opcodes[index] = 0;
+                    memcpy(&opcodes[index], pos, size);
+                    pos += size;
+                }
+                state.mBlock = state.addBlock(state.mFetchCommand, start, arg, opcodes);
+                state.mBlockStep = 0;
+                state.mBlockLength = arg;
+                if (!readBlockHashes(pos, end, state))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                handler.block(arg, false);
+                break;
+            }
+
+            case Command::RepeatBlock:
+                if (arg >= state.mBlocks.size())
+                {
+                    handler.invalid();
+                    return end;
+                }
+                state.mBlock = arg;
+                state.mBlockStep = 0;
+                state.mBlockLength = state.mBlocks[arg].mLength;
+                if (!readBlockHashes(pos, end, state))
+                {
+                    handler.invalid();
+                    return end;
+                }
+                handler.block(state.mBlockLength, true);
+                break;
+
+            default:
+                handler.invalid();
+                return end;
+            }
+        }
+        return pos;
+    }
+
+    // Multilinear hash of the state words with one random odd key per word and lane, updated by only adding the difference of the
+    // words that changed since the previous state. A single changed word always changes the hash, the two lanes use independent keys.
+    class StateHasher
+    {
+    public:
+        explicit StateHasher(size_t size)
+            : mPrevious(alignUp<4>(blockCount(size)), 0)
+            , mKeys(mPrevious.size() * 2)
+            , mSize(size)
+        {
+            uint64_t seed = 0x9e3779b97f4a7c15ull;
+            for (auto& key : mKeys)
+            {
+                seed += 0x9e3779b97f4a7c15ull;
+                key = mix(seed) | 1;
+            }
+            mSum[0] = 0;
+            mSum[1] = 0;
+        }
+
+        void update(const void* state, uint32_t hash[4])
+        {
+            auto words = static_cast<const uint8_t*>(state);
+            size_t offset = 0;
+#if CPUTRACE_SSE2
+            auto fullSize = mSize & ~static_cast<size_t>(15);
+            for (; offset < fullSize; offset += 16)
+            {
+                auto current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + offset));
+                auto previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mPrevious[offset / sizeof(uint32_t)]));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi32(current, previous)) != 0xffff)
+                    updateWords(words, offset, offset + 16);
+            }
+#endif
+            updateWords(words, offset, mSize);
+
+            // Finalize so the hash bits do not depend linearly on the state
+            uint64_t result[2] = { mix(mSum[0]), mix(mSum[1] ^ mSum[0]) };
+            memcpy(hash, result, sizeof(result));
+        }
+
+    private:
+        static uint64_t mix(uint64_t key)
+        {
+            key ^= key >> 33;
+            key *= 0xff51afd7ed558ccdull;
+            key ^= key >> 33;
+            key *= 0xc4ceb9fe1a85ec53ull;
+            key ^= key >> 33;
+            return key;
+        }
+
+        void updateWords(const uint8_t* words, size_t begin, size_t end)
+        {
+            for (auto offset = begin; offset < end; offset += sizeof(uint32_t))
+            {
+                // A partial last word is padded with zeros
+                uint32_t value = 0;
+                if (end - offset >= sizeof(uint32_t))
+                    memcpy(&value, words + offset, sizeof(uint32_t));
+                else
+                    memcpy(&value, words + offset, end - offset);
+
+                auto index = offset / sizeof(uint32_t);
+                auto& previous = mPrevious[index];
+                if (value != previous)
+                {
+                    auto delta = static_cast<uint64_t>(value) - static_cast<uint64_t>(previous);
+                    mSum[0] += mKeys[index * 2] * delta;
+                    mSum[1] += mKeys[index * 2 + 1] * delta;
+                    previous = value;
+                }
+            }
+        }
+
+        std::vector<uint32_t>   mPrevious;
+        std::vector<uint64_t>   mKeys;
+        size_t                  mSize;
+        uint64_t                mSum[2];
+    };
+
+#if CPUTRACE_CAPTURE_STATS
+    // Counters of a capture, only touched by the thread recording it. Reading the clock costs more than most calls to
+    // the device or the hasher, so one call in SampleInterval is timed.
+    class CaptureCounters
+    {
+    public:
+        static const uint64_t SampleInterval = 64;
+
+        CaptureCounters()
+            : mStats()
+            , mGetStateSampleCount(0)
+            , mGetStateSampleTime(0)
+            , mHashSampleCount(0)
+            , mHashSampleTime(0)
+        {
+        }
+
+        void addRecord(RecordCommand command, const uint8_t* begin, const uint8_t* end, uint64_t count = 1)
+        {
+            auto index = static_cast<uint32_t>(command);
+            mStats.recordCount[index] += count;
+            mStats.byteCount[index] += static_cast<uint64_t>(end - begin);
+        }
+
+        void addDirectBytes(const uint8_t* begin, const uint8_t* end)
+        {
+            mStats.directByteCount += static_cast<uint64_t>(end - begin);
+        }
+
+        // Returns the start time of the sampled calls, 0 for the others
+        uint64_t startGetState()
+        {
+            return mStats.getStateCount++ % SampleInterval ? 0 : getTime();
+        }
+
+        void endGetState(uint64_t start)
+        {
+            if (start)
+            {
+                ++mGetStateSampleCount;
+                mGetStateSampleTime += getTime() - start;
+            }
+        }
+
+        uint64_t startHash()
+        {
+            return mStats.hashCount++ % SampleInterval ? 0 : getTime();
+        }
+
+        void endHash(uint64_t start)
+        {
+            if (start)
+            {
+                ++mHashSampleCount;
+                mHashSampleTime += getTime() - start;
+            }
+        }
+
+        void addFullBuffer()
+        {
+            ++mStats.fullBufferCount;
+        }
+
+        uint64_t startFlush()
+        {
+            return getTime();
+        }
+
+        void endFlush(uint64_t start)
+        {
+            auto time = getTime() - start;
+            ++mStats.flushCount;
+            mStats.flushTime += time;
+
+            uint32_t bucket = 0;
+            for (auto micros = time / 1000; micros && (bucket + 1 < CaptureStats::LatencyBucketCount); micros >>= 1)
+                ++bucket;
+            ++mStats.flushLatency[bucket];
+        }
+
+        void getStats(CaptureStats& stats) const
+        {
+            stats = mStats;
+            stats.getStateTime = estimateTime(mGetStateSampleTime, mGetStateSampleCount, mStats.getStateCount);
+            stats.hashTime = estimateTime(mHashSampleTime, mHashSampleCount, mStats.hashCount);
+        }
+
+    private:
+        static uint64_t estimateTime(uint64_t sampleTime, uint64_t sampleCount, uint64_t count)
+        {
+            return sampleCount ? static_cast<uint64_t>(static_cast<double>(sampleTime) * static_cast<double>(count) / static_cast<double>(sampleCount)) : 0;
+        }
+
+        CaptureStats    mStats;
+        uint64_t        mGetStateSampleCount;
+        uint64_t        mGetStateSampleTime;
+        uint64_t        mHashSampleCount;
+        uint64_t        mHashSampleTime;
+    };
+#else
+    class CaptureCounters
+    {
+    public:
+        void addRecord(RecordCommand, const uint8_t*, const uint8_t*, uint64_t = 1)
+        {
+        }
+
+        void addDirectBytes(const uint8_t*, const uint8_t*)
+        {
+        }
+
+        uint64_t startGetState()
+        {
+            return 0;
+        }
+
+        void endGetState(uint64_t)
+        {
+        }
+
+        uint64_t startHash()
+        {
+            return 0;
+        }
+
+        void endHash(uint64_t)
+        {
+        }
+
+        void addFullBuffer()
+        {
+        }
+
+        uint64_t startFlush()
+        {
+            return 0;
+        }
+
+        void endFlush(uint64_t)
+        {
+        }
+
+        void getStats(CaptureStats& stats) const
+        {
+            stats = CaptureStats();
+        }
+    };
+#endif
+
+    class Capture : public ICapture
+    {
+    public:
+        Capture(ICaptureDevice& device, TraceSink& sink, uint32_t streamIndex, const CaptureSettings& settings, size_t maxEventSize)
+            : mDevice(device)
+            , mGroup(nullptr)
+            , mStreamIndex(streamIndex)
+            , mSink(sink)
+            , mWriter(sink, streamIndex, getChunkWords(device, settings, maxEventSize), settings)
+            , mChunkBegin(reinterpret_cast<uint8_t*>(mWriter.getFirstBuffer()))
+            , mChunkPos(mChunkBegin)
+            , mChunkEnd(mChunkBegin + mWriter.getChunkWords() * sizeof(uint32_t))
+            , mChunkIndex(0)
+            , mChunkInstruction(0)
+            , mInstruction(0)
+            , mKeyframeInterval(settings.keyframeInterval)
+            , mKeyframeSize(settings.keyframeSize)
+            , mKeyframeInstruction(0)
+            , mKeyframeOffset(0)
+            , mByteCount(0)
+            , mInvalidated(true)
+            , mVerifyPolicy(settings.verifyPolicy)
+            , mVerifyInstruction(0)
+            , mVerifyDue(false)
+            , mCodeType(settings.codeType)
+            , mNextFetch(0)
+            , mRing(settings.ringSize != 0)
+            , mChunkKeyframe(false)
+            , mFilter(settings.filter, settings.codeType)
+        {
+            mState.resize(mDevice.getStateSize(), 0);
+            if (settings.stateHash == StateHash::Incremental)
+                mHasher.reset(new StateHasher(mState.size()));
+            if (mVerifyPolicy.mode == VerifyMode::Delta)
+            {
+                mVerified.resize(blockCount(mState.size()), 0);
+                mDelta.resize(mVerified.size() * 2);
+            }
+        }
+
+        virtual ~Capture()
+        {
+        }
+
+        void start()
+        {
+            mWriter.start();
+            mDevice.startCapture(*this);
+        }
+
+        void stop()
+        {
+            mDevice.stopCapture(*this);
+
+            flushChunk();
+            mWriter.stop();
+        }
+
+        virtual void invalidateState() override
+        {
+            mInvalidated = true;
+        }
+
+        virtual void getWriterStats(WriterStats& stats) override
+        {
+            mWriter.getStats(stats);
+        }
+
+        virtual void getStats(CaptureStats& stats) override
+        {
+            mCounters.getStats(stats);
+        }
+
+        virtual bool dump(IStream& stream) override
+        {
+            if (!mRing)
+                return false;
+
+            // Records written so far go in the snapshot, the next chunk starts with a keyframe again
+            flushChunk();
+            mWriter.drain();
+            mSink.dump(stream, mStreamIndex, mKeyframes, mInstruction);
+            return true;
+        }
+
+        Trace::Stream getStreamInfo()
+        {
+            Trace::Stream stream = { mDevice.getVersion(), static_cast<uint32_t>(mState.size()), 0 };
+            return stream;
+        }
+
+        size_t getChunkSize() const
+        {
+            return mWriter.getChunkWords() * sizeof(uint32_t);
+        }
+
+        uint64_t getInstructionCount() const
+        {
+            return mInstruction;
+        }
+
+        ICaptureGroup& getGroup()
+        {
+            return *mGroup;
+        }
+
+        void setGroup(ICaptureGroup& group)
+        {
+            mGroup = &group;
+        }
+
+        // Keyframes refer to chunks by their position in the stream
+        const std::vector<Trace::Keyframe>& getKeyframes() const
+        {
+            return mKeyframes;
+        }
+
+    protected:
+        virtual void resetEncoder() = 0;
+        virtual void flushEncoder() = 0;
+
+        // Makes sure the current chunk has room for a record of the given size
+        void reserve(size_t size)
+        {
+            if (static_cast<size_t>(mChunkEnd - mChunkPos) < size)
+            {
+                mCounters.addFullBuffer();
+                flushChunk();
+            }
+        }
+
+        void getState()
+        {
+            auto start = mCounters.startGetState();
+            mDevice.getState(mState.data(), mState.size());
+            mCounters.endGetState(start);
+        }
+
+        void hashState(uint32_t hash[4])
+        {
+            auto start = mCounters.startHash();
+            if (mHasher)
+                mHasher->update(mState.data(), hash);
+            else
+                MurmurHash3_x64_128(mState.data(), static_cast<int>(mState.size()), 0, hash);
+            mCounters.endHash(start);
+        }
+
+        // Tells whether the state of the current instruction must be hashed
+        bool isHashDue() const
+        {
+            auto interval = mVerifyPolicy.interval;
+            switch (mVerifyPolicy.mode)
+            {
+            case VerifyMode::Interval:
+                return mInstruction - mVerifyInstruction >= std::max<uint64_t>(interval, 1);
+
+            case VerifyMode::Events:
+                return mVerifyDue || (interval && (mInstruction - mVerifyInstruction >= interval));
+
+            case VerifyMode::Delta:
+                return false;
+
+            default:
+                return true;
+            }
+        }
+
+        // Called for each state written or checked by a hash or a delta
+        void setVerified()
+        {
+            mVerifyInstruction = mInstruction;
+            mVerifyDue = false;
+            if (!mVerified.empty())
+                memcpy(mVerified.data(), mState.data(), mState.size());
+        }
+
+        // Fills the index and difference of the state words that changed since the last verified state, returns how many changed
+        size_t diffState()
+        {
+            size_t count = 0;
+            size_t offset = 0;
+#if CPUTRACE_SSE2
+            auto bytes = mState.data();
+            auto fullSize = mState.size() & ~static_cast<size_t>(15);
+            for (; offset < fullSize; offset += 16)
+            {
+                auto current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + offset));
+                auto previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mVerified[offset / sizeof(uint32_t)]));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi32(current, previous)) != 0xffff)
+                    count = diffWords(offset, offset + 16, count);
+            }
+#endif
+            return diffWords(offset, mState.size(), count);
+        }
+
+        size_t diffWords(size_t begin, size_t end, size_t count)
+        {
+            auto bytes = mState.data();
+            for (auto offset = begin; offset < end; offset += sizeof(uint32_t))
+            {
+                // A partial last word is padded with zeros
+                uint32_t value = 0;
+                if (end - offset >= sizeof(uint32_t))
+                    memcpy(&value, bytes + offset, sizeof(uint32_t));
+                else
+                    memcpy(&value, bytes + offset, end - offset);
+
+                auto index = offset / sizeof(uint32_t);
+                if (value != mVerified[index])
+                {
+                    mDelta[count * 2] = static_cast<uint32_t>(index);
+                    mDelta[count * 2 + 1] = value - mVerified[index];
+                    mVerified[index] = value;
+                    ++count;
+                }
+            }
+            return count;
+        }
+
+        // Branches are found from instruction fetches that do not follow the previous one
+        void checkBranch(Command command, uint32_t addr, uint32_t type)
+        {
+            if ((type != mCodeType) || ((command != Command::Read16) && (command != Command::Read32)))
+                return;
+            if (addr != mNextFetch)
+                mVerifyDue = true;
+            mNextFetch = addr + getAccessSize(command);
+        }
+
+        bool isKeyframeDue() const
+        {
+            if (mChunkKeyframe)
+                return true;
+            if (mKeyframeInterval && (mInstruction - mKeyframeInstruction >= mKeyframeInterval))
+                return true;
+            if (mKeyframeSize && (mByteCount + static_cast<uint64_t>(mChunkPos - mChunkBegin) - mKeyframeOffset >= mKeyframeSize))
+                return true;
+            return false;
+        }
+
+        // Registers a state record about to be written at the current position
+        void addKeyframe()
+        {
+            auto offset = static_cast<size_t>(mChunkPos - mChunkBegin);
+            Trace::Keyframe keyframe = { mInstruction, static_cast<uint32_t>(mChunkIndex), static_cast<uint32_t>(offset), mStreamIndex };
+            mKeyframes.push_back(keyframe);
+            mKeyframeInstruction = mInstruction;
+            mKeyframeOffset = mByteCount + offset;
+            mChunkKeyframe = false;
+        }
+
+        // Instructions outside of the capture windows are dropped, each window starts with a full state record
+        bool startInstruction()
+        {
+            if (mFilter.execute())
+                return true;
+            mInvalidated = true;
+            return false;
+        }
+
+        // Ring chunks are closed between instructions once mostly full, so they usually start with a keyframe
+        void closeRingChunk()
+        {
+            if (mRing && (static_cast<size_t>(mChunkEnd - mChunkPos) < getChunkSize() / 8))
+                flushChunk();
+        }
+
+        ICaptureDevice&              mDevice;
+        ICaptureGroup*               mGroup;
+        uint32_t                     mStreamIndex;
+        TraceSink&                   mSink;
+        ChunkWriter                  mWriter;
+        uint8_t*                     mChunkBegin;
+        uint8_t*                     mChunkPos;
+        uint8_t*                     mChunkEnd;
+        size_t                       mChunkIndex;
+        uint64_t                     mChunkInstruction;
+        uint64_t                     mInstruction;
+        uint64_t                     mKeyframeInterval;
+        uint64_t                     mKeyframeSize;
+        uint64_t                     mKeyframeInstruction;
+        uint64_t                     mKeyframeOffset;
+        uint64_t                     mByteCount;
+        bool                         mInvalidated;
+        std::vector<uint8_t>         mState;
+        std::unique_ptr<StateHasher> mHasher;
+        VerifyPolicy                 mVerifyPolicy;
+        uint64_t                     mVerifyInstruction;
+        bool                         mVerifyDue;
+        uint32_t                     mCodeType;
+        uint32_t                     mNextFetch;
+        std::vector<uint32_t>        mVerified;
+        std::vector<uint32_t>        mDelta;
+        std::vector<Trace::Keyframe> mKeyframes;
+        bool                         mRing;
+        bool                         mChunkKeyframe;
+        EventFilter                  mFilter;
+        CaptureCounters              mCounters;
+
+    private:
+        static size_t getChunkWords(ICaptureDevice& device, const CaptureSettings& settings, size_t maxEventSize)
+        {
+            // A chunk must at least be able to hold the biggest record
+            auto minChunkSize = alignUp<sizeof(uint32_t)>(device.getStateSize()) + std::max<size_t>(maxEventSize, 16 * sizeof(uint32_t));
+            return std::max(settings.chunkSize, minChunkSize) / sizeof(uint32_t);
+        }
+
+        void flushChunk()
+        {
+            flushEncoder();
+            auto size = static_cast<size_t>(mChunkPos - mChunkBegin);
+            if (!size)
+                return;
+
+            auto start = mCounters.startFlush();
+            // Chunks are padded to whole words, a zero byte also ends a compact chunk
+            auto alignedSize = alignUp<sizeof(uint32_t)>(size);
+            memset(mChunkPos, 0, alignedSize - size);
+
+            auto buffer = mWriter.submit(reinterpret_cast<uint32_t*>(mChunkBegin), alignedSize / sizeof(uint32_t), mChunkInstruction);
+            mChunkInstruction = mInstruction;
+            mChunkBegin = reinterpret_cast<uint8_t*>(buffer);
+            mChunkPos = mChunkBegin;
+            mChunkEnd = mChunkBegin + mWriter.getChunkWords() * sizeof(uint32_t);
+            mByteCount += alignedSize;
+            ++mChunkIndex;
+            mCounters.endFlush(start);
+
+            // Each chunk can be decoded on its own
+            resetEncoder();
+
+            // Keyframes of the chunks dropped by the ring are of no use
+            if (mRing)
+            {
+                mChunkKeyframe = true;
+                auto start = mSink.getRingStart(mStreamIndex);
+                auto end = std::find_if(mKeyframes.begin(), mKeyframes.end(), [start](const Trace::Keyframe& keyframe) { return keyframe.mChunk >= start; });
+                mKeyframes.erase(mKeyframes.begin(), end);
+            }
+        }
+    };
+
+    template <typename TEncoder>
+    class EncodedCapture : public Capture
+    {
+    public:
+        EncodedCapture(ICaptureDevice& device, TraceSink& sink, uint32_t streamIndex, const CaptureSettings& settings)
+            : Capture(device, sink, streamIndex, settings, TEncoder::MaxEventSize + std::max(TEncoder::getDeltaSize(blockCount(device.getStateSize())), TEncoder::getBatchSize(MaxBatchCount, sizeof(uint32_t), true)))
+            , mEncoder(settings, device.getStateSize())
+        {
+            mEncoder.reset();
+        }
+
+        virtual void execute() override
+        {
+            if (!mFilter.isEmpty() && !startInstruction())
+                return;
+
+            closeRingChunk();
+            getState();
+            auto stateWritten = true;
+            if (mInvalidated)
+            {
+                emitState(0);
+                mInvalidated = false;
+            }
+            else if (isKeyframeDue())
+            {
+                emitState(StateFlag::Keyframe);
+            }
+            else
+            {
+                stateWritten = false;
+            }
+
+            if (mVerifyPolicy.mode == VerifyMode::Delta)
+            {
+                // The state record already holds the full state
+                auto count = stateWritten ? 0 : diffState();
+                reserve(TEncoder::MaxEventSize + TEncoder::getDeltaSize(count));
+                auto begin = mChunkPos;
+                mChunkPos = mEncoder.execute(mChunkPos, nullptr);
+                if (!stateWritten)
+                    mChunkPos = mEncoder.delta(mChunkPos, mDelta.data(), count);
+                mCounters.addRecord(RecordCommand::Execute, begin, mChunkPos);
+            }
+            else if (isHashDue())
+            {
+                uint32_t hash[4];
+                hashState(hash);
+                setVerified();
+                reserve(TEncoder::MaxEventSize);
+                auto begin = mChunkPos;
+                mChunkPos = mEncoder.execute(mChunkPos, hash);
+                mCounters.addRecord(RecordCommand::Execute, begin, mChunkPos);
+            }
+            else
+            {
+                reserve(TEncoder::MaxEventSize);
+                auto begin = mChunkPos;
+                mChunkPos = mEncoder.execute(mChunkPos, nullptr);
+                mCounters.addRecord(RecordCommand::Execute, begin, mChunkPos);
+            }
+            ++mInstruction;
+        }
+
+        virtual void interrupt(uint32_t type) override
+        {
+            if (!mFilter.isEmpty() && !mFilter.interrupt())
+                return;
+            mVerifyDue = true;
+            reserve(TEncoder::MaxEventSize);
+            auto begin = mChunkPos;
+            mChunkPos = mEncoder.event(mChunkPos, Command::Interrupt, type);
+            mCounters.addRecord(RecordCommand::Interrupt, begin, mChunkPos);
+        }
+
+        virtual void signal(uint32_t type) override
+        {
+            if (!mFilter.isEmpty() && !mFilter.signal())
+                return;
+            reserve(TEncoder::MaxEventSize);
+            auto begin = mChunkPos;
+            mChunkPos = mEncoder.event(mChunkPos, Command::Signal, type);
+            mCounters.addRecord(RecordCommand::Signal, begin, mChunkPos);
+        }
+
+        virtual void sync(uint64_t time) override
+        {
+            if (!mFilter.isEmpty() && !mFilter.isRecording())
+                return;
+            reserve(TEncoder::MaxEventSize);
+            auto begin = mChunkPos;
+            mChunkPos = mEncoder.sync(mChunkPos, time);
+            mCounters.addRecord(RecordCommand::Sync, begin, mChunkPos);
+        }
+
+        virtual bool beginWrite(uint8_t*& begin, uint8_t*& end) override
+        {
+            // Branches have to be seen to hash on events and accesses to be filtered
+            if (!TEncoder::DirectWrite || (mVerifyPolicy.mode == VerifyMode::Events) || !mFilter.isEmpty())
+                return false;
+            reserve(TEncoder::MaxEventSize);
+            begin = mChunkPos;
+            end = mChunkEnd;
+            return true;
+        }
+
+        virtual void endWrite(uint8_t* pos) override
+        {
+            mCounters.addDirectBytes(mChunkPos, pos);
+            mChunkPos = pos;
+        }
+
+        virtual bool executeWrite(uint8_t*& pos, uint8_t*& end) override
+        {
+            mCounters.addDirectBytes(mChunkPos, pos);
+            mChunkPos = pos;
+            EncodedCapture::execute();
+            return EncodedCapture::beginWrite(pos, end);
+        }
+
+        virtual void read8(uint32_t addr, uint32_t value, uint32_t type) override
+        {
+            emitAccess(Command::Read8, addr, value, type);
+        }
+
+        virtual void read16(uint32_t addr, uint32_t value, uint32_t type) override
+        {
+            emitAccess(Command::Read16, addr, value, type);
+        }
+
+        virtual void read32(uint32_t addr, uint32_t value, uint32_t type) override
+        {
+            emitAccess(Command::Read32, addr, value, type);
+        }
+
+        virtual void write8(uint32_t addr, uint32_t value, uint32_t type) override
+        {
+            emitAccess(Command::Write8, addr, value, type);
+        }
+
+        virtual void write16(uint32_t addr, uint32_t value, uint32_t type) override
+        {
+            emitAccess(Command::Write16, addr, value, type);
+        }
+
+        virtual void write32(uint32_t addr, uint32_t value, uint32_t type) override
+        {
+            emitAccess(Command::Write32, addr, value, type);
+        }
+
+        virtual void readRange(uint32_t addr, const void* data, uint32_t size, uint32_t count, uint32_t type) override
+        {
+            emitBatch(getSizedAccess(Command::Read8, size), addr, nullptr, data, count, type);
+        }
+
+        virtual void writeRange(uint32_t addr, const void* data, uint32_t size, uint32_t count, uint32_t type) override
+        {
+            emitBatch(getSizedAccess(Command::Write8, size), addr, nullptr, data, count, type);
+        }
+
+        virtual void readGather(const uint32_t* addrs, const void* data, uint32_t size, uint32_t count, uint32_t type) override
+        {
+            emitBatch(getSizedAccess(Command::Read8, size), 0, addrs, data, count, type);
+        }
+
+        virtual void writeScatter(const uint32_t* addrs, const void* data, uint32_t size, uint32_t count, uint32_t type) override
+        {
+            emitBatch(getSizedAccess(Command::Write8, size), 0, addrs, data, count, type);
+        }
+
+    protected:
+        virtual void resetEncoder() override
+        {
+            mEncoder.reset();
+        }
+
+        virtual void flushEncoder() override
+        {
+            mChunkPos = mEncoder.flush(mChunkPos);
+        }
+
+    private:
+        void emitState(uint32_t flags)
+        {
+            // Records held back by the encoder go before the keyframe
+            flushEncoder();
+            reserve(TEncoder::getStateSize(mState.size()));
+            addKeyframe();
+            auto begin = mChunkPos;
+            mChunkPos = mEncoder.setState(mChunkPos, mState.data(), mState.size(), flags);
+            mCounters.addRecord(RecordCommand::State, begin, mChunkPos);
+            setVerified();
+        }
+
+        void emitAccess(Command command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (!mFilter.isEmpty() && !mFilter.access(command >= Command::Write8, addr, getAccessSize(command), type))
+                return;
+            if (mVerifyPolicy.mode == VerifyMode::Events)
+                checkBranch(command, addr, type);
+            reserve(TEncoder::MaxEventSize);
+            auto begin = mChunkPos;
+            mChunkPos = mEncoder.access(mChunkPos, command, addr, value, type);
+            mCounters.addRecord(getRecordCommand(command), begin, mChunkPos);
+        }
+
+        void emitBatch(Command command, uint32_t addr, const uint32_t* addrs, const void* data, uint32_t count, uint32_t type)
+        {
+            if (mFilter.isEmpty())
+                writeBatch(command, addr, addrs, static_cast<const uint8_t*>(data), count, type);
+            else
+                filterBatch(command, addr, addrs, static_cast<const uint8_t*>(data), count, type);
+        }
+
+        // Runs of consecutive accesses passing the filter are recorded as batches of their own
+        void filterBatch(Command command, uint32_t addr, const uint32_t* addrs, const uint8_t* values, uint32_t count, uint32_t type)
+        {
+            auto size = getAccessSize(command);
+            auto write = command >= Command::Write8;
+            uint32_t first = 0;
+            for (uint32_t index = 0; index <= count; ++index)
+            {
+                if ((index < count) && mFilter.access(write, addrs ? addrs[index] : addr + index * size, size, type))
+                    continue;
+                if (index > first)
+                    writeBatch(command, addr + first * size, addrs ? addrs + first : nullptr, values + first * size, index - first, type);
+                first = index + 1;
+            }
+        }
+
+        // Batches are split in records of a bounded size so they always fit in a chunk
+        void writeBatch(Command command, uint32_t addr, const uint32_t* addrs, const uint8_t* values, uint32_t count, uint32_t type)
+        {
+            auto size = getAccessSize(command);
+            while (count)
+            {
+                auto pieceCount = std::min(count, MaxBatchCount);
+                reserve(TEncoder::MaxEventSize + TEncoder::getBatchSize(pieceCount, size, addrs != nullptr));
+                auto begin = mChunkPos;
+                if (addrs)
+                {
+                    mChunkPos = mEncoder.gather(mChunkPos, command, addrs, values, pieceCount, type);
+                    addrs += pieceCount;
+                }
+                else
+                {
+                    mChunkPos = mEncoder.range(mChunkPos, command, addr, values, pieceCount, type);
+                    addr += pieceCount * size;
+                }
+                mCounters.addRecord(getRecordCommand(command), begin, mChunkPos, pieceCount);
+                values += pieceCount * size;
+                count -= pieceCount;
+            }
+        }
+
+        TEncoder    mEncoder;
+    };
+
+    // Captures of devices recording into the same trace, each with its own buffers, encoder and writer.
+    class CaptureGroup final : public ICaptureGroup
+    {
+    public:
+        CaptureGroup(ICaptureDevice* const* devices, uint32_t deviceCount, Trace& trace, const CaptureSettings& settings)
+            : mSink(prepare(trace), settings.stream ? *settings.stream : trace.getData())
+        {
+            std::vector<Trace::Stream> streams;
+            size_t chunkSize = 0;
+            for (uint32_t index = 0; index < deviceCount; ++index)
+            {
+                Capture* capture = nullptr;
+                if (settings.encoding == Encoding::Compact)
+                    capture = new EncodedCapture<CompactEncoder>(*devices[index], mSink, index, settings);
+                else
+                    capture = new EncodedCapture<RawEncoder>(*devices[index], mSink, index, settings);
+                capture->setGroup(*this);
+                mCaptures.emplace_back(capture);
+                streams.push_back(capture->getStreamInfo());
+                chunkSize = std::max(chunkSize, capture->getChunkSize());
+            }
+
+            mSink.writeHeader(streams, chunkSize, settings);
+            for (auto& capture : mCaptures)
+                capture->start();
+        }
+
+        void stop()
+        {
+            std::vector<Trace::Keyframe> keyframes;
+            uint64_t instructionCount = 0;
+            for (auto& capture : mCaptures)
+            {
+                capture->stop();
+                keyframes.insert(keyframes.end(), capture->getKeyframes().begin(), capture->getKeyframes().end());
+                instructionCount += capture->getInstructionCount();
+            }
+            mSink.writeFooter(keyframes, instructionCount);
+        }
+
+        virtual uint32_t getStreamCount() const override
+        {
+            return static_cast<uint32_t>(mCaptures.size());
+        }
+
+        virtual ICapture& getCapture(uint32_t stream) override
+        {
+            return *mCaptures[stream];
+        }
+
+    private:
+        static Trace& prepare(Trace& trace)
+        {
+            trace.clear();
+            return trace;
+        }
+
+        TraceSink                               mSink;
+        std::vector<std::unique_ptr<Capture>>   mCaptures;
+    };
+
+    class Replayer final : public IReplayer
+    {
+    public:
+        Replayer(IReplayDevice& device, IReplay& replay, const Trace& trace, uint32_t streamIndex)
+            : mDevice(device)
+            , mReplay(replay)
+            , mTrace(trace)
+            , mStreamIndex(streamIndex)
+            , mChunkIndex(0)
+            , mPos(nullptr)
+            , mEnd(nullptr)
+            , mInstruction(0)
+            , mTarget(0)
+            , mVerifiedInstruction(0)
+            , mStatus(ReplayStatus::Completed)
+            , mPending(false)
+            , mValid(true)
+            , mStopAtSync(false)
+            , mAtSync(false)
+            , mSyncTime(0)
+        {
+            ReplayStats stats = {};
+            mStats = stats;
+
+            const auto& info = mTrace.getInfo();
+            const auto& streams = mTrace.getStreams();
+            Trace::Stream stream = {};
+            if (mStreamIndex < streams.size())
+                stream = streams[mStreamIndex];
+            mCompactState.mStateSize = stream.mStateSize;
+            mCompactState.mCodeType = info.mCodeType;
+            mCompactState.mVerifyMode = info.mVerifyMode;
+            if ((mStreamIndex >= streams.size()) || (stream.mStateSize != mDevice.getStateSize()) || (stream.mDeviceVersion != mDevice.getVersion()) || (info.mEncoding > Encoding::Columnar) ||
+                (info.mCompression > Codec::Lz) || (info.mStateHash > StateHash::Incremental) || (info.mVerifyMode > VerifyMode::Delta))
+                mValid = false;
+            mState.resize(mDevice.getStateSize(), 0);
+            mExpected.resize(blockCount(mState.size()), 0);
+            if (info.mStateHash == StateHash::Incremental)
+                mHasher.reset(new StateHasher(mState.size()));
+
+            // The tail kept by a ring capture goes on with the instruction indices of the capture
+            mInstruction = stream.mFirstInstruction;
+            mVerifiedInstruction = mInstruction;
+
+            mDevice.getSkipRules(mSkipTable);
+            mSkipTable.compile();
+        }
+
+        virtual ReplayStatus run(uint64_t instructionCount) override
+        {
+            if (!mValid)
+                return ReplayStatus::Invalid;
+
+            auto startTime = getTime();
+            mTarget = instructionCount > UINT64_MAX - mInstruction ? UINT64_MAX : mInstruction + instructionCount;
+            mAtSync = false;
+            auto status = ReplayStatus::Completed;
+            for (;;)
+            {
+                // A block can end the chunk with instructions or the fetch of its last instruction still to deliver
+                if ((mPos == mEnd) && !mCompactState.isExpanding())
+                {
+                    if (!nextChunk())
+                    {
+                        status = mValid ? ReplayStatus::Completed : ReplayStatus::Invalid;
+                        break;
+                    }
+                }
+
+                status = decode();
+                if (status != ReplayStatus::Completed)
+                    break;
+            }
+
+            // Pausing on the count leaves the device at the state before the next instruction, wherever the keyframes fall.
+            // All the accesses of the pending instruction came before the execute record that stopped the run, while a sync
+            // record can still be followed by some of them.
+            if ((status == ReplayStatus::Completed) || ((status == ReplayStatus::Paused) && !mAtSync))
+                executePending();
+
+            mStats.instructionCount = mInstruction;
+            mStats.time += getTime() - startTime;
+            mStats.instructionsPerSecond = mStats.time ? static_cast<double>(mStats.instructionCount) * 1e9 / static_cast<double>(mStats.time) : 0.0;
+            auto blockCount = mStats.blockDefinitionCount + mStats.blockRepeatCount;
+            mStats.blockHitRate = blockCount ? static_cast<double>(mStats.blockRepeatCount) / static_cast<double>(blockCount) : 0.0;
+            return status;
+        }
+
+        virtual ReplayStatus seek(uint64_t instruction) override
+        {
+            if (!mValid)
+                return ReplayStatus::Invalid;
+
+            auto keyframe = mTrace.findKeyframe(mStreamIndex, instruction);
+            if (!keyframe || (keyframe->mChunk >= mTrace.getChunks().size()))
+                return ReplayStatus::Invalid;
+
+            size_t size = 0;
+            auto data = mTrace.getChunkData(keyframe->mChunk, mChunkBuffer, size);
+            if (!data || (keyframe->mOffset > size))
+                return ReplayStatus::Invalid;
+
+            mChunkIndex = keyframe->mChunk + 1;
+            mPos = data + keyframe->mOffset;
+            mEnd = data + size;
+            mInstruction = keyframe->mInstruction;
+            mPending = false;
+            mSyncTime = 0;
+            mCompactState.reset();
+            return run(instruction - keyframe->mInstruction);
+        }
+
+        virtual uint64_t getInstruction() const override
+        {
+            return mInstruction;
+        }
+
+        virtual void getStats(ReplayStats& stats) const override
+        {
+            stats = mStats;
+        }
+
+        uint64_t getFirstInstruction() const
+        {
+            const auto& streams = mTrace.getStreams();
+            return mStreamIndex < streams.size() ? streams[mStreamIndex].mFirstInstruction : 0;
+        }
+
+        // Pauses on each sync record so the streams of a group can be interleaved
+        void setStopAtSync(bool stop)
+        {
+            mStopAtSync = stop;
+        }
+
+        // Tells whether the last run paused on a sync record rather than on the instruction count
+        bool isAtSync() const
+        {
+            return mAtSync;
+        }
+
+        uint64_t getSyncTime() const
+        {
+            return mSyncTime;
+        }
+
+        // Decoder callbacks
+        void invalid()
+        {
+            mValid = false;
+            mStatus = ReplayStatus::Invalid;
+        }
+
+        void footer()
+        {
+            mChunkIndex = mTrace.getChunks().size();
+        }
+
+        bool setState(const void* state, uint32_t flags)
+        {
+            ++mStats.recordCount;
+            if (mPending && (flags & StateFlag::Keyframe))
+            {
+                // Forced keyframes hold the state the pending instruction must produce
+                executePending();
+                if (!verifyFullState(state))
+                {
+                    diverge(mInstruction);
+                    mStatus = ReplayStatus::Diverged;
+                }
+            }
+            executePending();
+            mDevice.loadState(state, mState.size());
+            mReplay.syncState(state, mState.size());
+            memcpy(mExpected.data(), state, mState.size());
+            mVerifiedInstruction = mInstruction;
+            return mStatus == ReplayStatus::Completed;
+        }
+
+        bool canExecute()
+        {
+            if (mInstruction < mTarget)
+                return true;
+            mStatus = ReplayStatus::Paused;
+            return false;
+        }
+
+        bool execute(const void* hash)
+        {
+            ++mStats.recordCount;
+            executePending();
+            if (hash)
+            {
+                ++mStats.verifiedCount;
+                if (verifyState(hash))
+                {
+                    mVerifiedInstruction = mInstruction;
+                }
+                else
+                {
+                    diverge(mInstruction);
+                    mStatus = ReplayStatus::Diverged;
+                }
+            }
+            mPending = true;
+            ++mInstruction;
+            return mStatus == ReplayStatus::Completed;
+        }
+
+        bool deltaWord(uint32_t index, uint32_t difference)
+        {
+            if (index >= mExpected.size())
+                return false;
+            mExpected[index] += difference;
+            return true;
+        }
+
+        // A delta follows the execute record of the instruction whose state it describes, before that instruction is executed
+        bool delta()
+        {
+            ++mStats.recordCount;
+            ++mStats.verifiedCount;
+            auto instruction = mInstruction - 1;
+            if (verifyFullState(mExpected.data()))
+            {
+                mVerifiedInstruction = instruction;
+            }
+            else
+            {
+                diverge(instruction);
+                mStatus = ReplayStatus::Diverged;
+            }
+            return mStatus == ReplayStatus::Completed;
+        }
+
+        void interrupt(uint32_t type)
+        {
+            ++mStats.recordCount;
+            mReplay.interrupt(type);
+        }
+
+        void signal(uint32_t type)
+        {
+            ++mStats.recordCount;
+            mReplay.signal(type);
+        }
+
+        bool sync(uint64_t time)
+        {
+            ++mStats.recordCount;
+            mSyncTime = time;
+            if (!mStopAtSync)
+                return true;
+            mAtSync = true;
+            mStatus = ReplayStatus::Paused;
+            return false;
+        }
+
+        void block(uint32_t length, bool repeated)
+        {
+            ++mStats.recordCount;
+            if (repeated)
+                ++mStats.blockRepeatCount;
+            else
+                ++mStats.blockDefinitionCount;
+            mStats.blockInstructionCount += length;
+        }
+
+        void access(Command command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            ++mStats.recordCount;
+            if (canSkip(addr, value, type))
+            {
+                ++mStats.skippedCount;
+                return;
+            }
+            replayAccess(command, addr, value, type);
+        }
+
+        // Batches are replayed whole unless the device skips some of their accesses
+        void batch(Command command, uint32_t addr, const uint32_t* addrs, const uint8_t* data, uint32_t count, uint32_t type)
+        {
+            ++mStats.recordCount;
+            auto size = getAccessSize(command);
+            uint32_t skip = 0;
+            while ((skip < count) && !canSkip(addrs ? addrs[skip] : addr + skip * size, readValue(data, skip, size), type))
+                ++skip;
+
+            if (skip == count)
+            {
+                replayBatch(command, addr, addrs, data, count, type);
+                return;
+            }
+
+            for (uint32_t index = 0; index < count; ++index)
+            {
+                auto accessAddr = addrs ? addrs[index] : addr + index * size;
+                auto value = readValue(data, index, size);
+                if ((index == skip) || ((index > skip) && canSkip(accessAddr, value, type)))
+                    ++mStats.skippedCount;
+                else
+                    replayAccess(command, accessAddr, value, type);
+            }
+        }
+
+    private:
+        // Only accesses the rules of the device leave dynamic are left to the device
+        bool canSkip(uint32_t addr, uint32_t value, uint32_t type)
+        {
+            auto mode = mSkipTable.getMode(addr, type);
+            if (mode == SkipMode::Dynamic)
+                return mDevice.canSkip(addr, value, type);
+            return mode == SkipMode::Skip;
+        }
+
+        void replayAccess(Command command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            switch (command)
+            {
+            case Command::Read8:
+                mReplay.read8(addr, value, type);
+                break;
+
+            case Command::Read16:
+                mReplay.read16(addr, value, type);
+                break;
+
+            case Command::Read32:
+                mReplay.read32(addr, value, type);
+                break;
+
+            case Command::Write8:
+                mReplay.write8(addr, value, type);
+                break;
+
+            case Command::Write16:
+                mReplay.write16(addr, value, type);
+                break;
+
+            case Command::Write32:
+                mReplay.write32(addr, value, type);
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        void replayBatch(Command command, uint32_t addr, const uint32_t* addrs, const uint8_t* data, uint32_t count, uint32_t type)
+        {
+            auto size = getAccessSize(command);
+            auto isRead = command <= Command::Read32;
+            if (addrs && isRead)
+                mReplay.readGather(addrs, data, size, count, type);
+            else if (addrs)
+                mReplay.writeScatter(addrs, data, size, count, type);
+            else if (isRead)
+                mReplay.readRange(addr, data, size, count, type);
+            else
+                mReplay.writeRange(addr, data, size, count, type);
+        }
+
+        bool nextChunk()
+        {
+            const auto& chunks = mTrace.getChunks();
+            while (mChunkIndex < chunks.size())
+            {
+                auto index = mChunkIndex++;
+                if (chunks[index].mStream != mStreamIndex)
+                    continue;
+                size_t size = 0;
+                auto data = mTrace.getChunkData(index, mChunkBuffer, size);
+                if (!data)
+                {
+                    mValid = false;
+                    return false;
+                }
+                mPos = data;
+                mEnd = data + size;
+                mTrace.prefetchChunk(mChunkIndex);
+                mCompactState.reset();
+                if (mPos != mEnd)
+                    return true;
+            }
+            return false;
+        }
+
+        // Decodes records of the current chunk until it is exhausted or the replay has to stop
+        ReplayStatus decode()
+        {
+            mStatus = ReplayStatus::Completed;
+            if (mTrace.getInfo().mEncoding == Encoding::Compact)
+                mPos = decodeCompact(mPos, mEnd, mCompactState, *this);
+            else
+                mPos = decodeRaw(mPos, mEnd, *this);
+            return mStatus;
+        }
+
+        void executePending()
+        {
+            if (mPending)
+            {
+                mDevice.execute();
+                mPending = false;
+            }
+        }
+
+        void diverge(uint64_t instruction)
+        {
+            if (!mStats.divergenceCount++)
+            {
+                mStats.firstDivergence = instruction;
+                mStats.firstDivergenceStart = mVerifiedInstruction;
+            }
+            mStats.lastDivergence = instruction;
+            mStats.lastDivergenceStart = mVerifiedInstruction;
+        }
+
+        bool verifyFullState(const void* expected)
+        {
+            mDevice.getState(mState.data(), mState.size());
+            return memcmp(mState.data(), expected, mState.size()) == 0;
+        }
+
+        bool verifyState(const void* expected)
+        {
+            mDevice.getState(mState.data(), mState.size());
+
+            uint32_t hash[4];
+            if (mHasher)
+                mHasher->update(mState.data(), hash);
+            else
+                MurmurHash3_x64_128(mState.data(), static_cast<int>(mState.size()), 0, hash);
+            return memcmp(hash, expected, sizeof(hash)) == 0;
+        }
+
+        IReplayDevice&               mDevice;
+        IReplay&                     mReplay;
+        const Trace&                 mTrace;
+        uint32_t                     mStreamIndex;
+        size_t                       mChunkIndex;
+        const uint8_t*               mPos;
+        const uint8_t*               mEnd;
+        uint64_t                     mInstruction;
+        uint64_t                     mTarget;
+        uint64_t                     mVerifiedInstruction;
+        ReplayStatus                 mStatus;
+        bool                         mPending;
+        bool                         mValid;
+        CompactState                 mCompactState;
+        std::vector<uint8_t>         mChunkBuffer;
+        ReplayStats                  mStats;
+        std::vector<uint8_t>         mState;
+        std::vector<uint32_t>        mExpected;
+        std::unique_ptr<StateHasher> mHasher;
+        bool                         mStopAtSync;
+        bool                         mAtSync;
+        uint64_t                     mSyncTime;
+        SkipTable                    mSkipTable;
+    };
+
+    // Replays the streams of a capture group one sync interval at a time, always advancing the stream with the earliest time.
+    class GroupReplayer final : public IReplayer
+    {
+    public:
+        GroupReplayer(IReplayDevice* const* devices, IReplay* const* replays, uint32_t deviceCount, const Trace& trace)
+            : mInstruction(0)
+            , mTime(0)
+            , mValid(deviceCount == trace.getStreams().size())
+        {
+            for (uint32_t index = 0; index < deviceCount; ++index)
+            {
+                mReplayers.emplace_back(new Replayer(*devices[index], *replays[index], trace, index));
+                mReplayers.back()->setStopAtSync(true);
+            }
+            mDone.resize(deviceCount, false);
+        }
+
+        virtual ReplayStatus run(uint64_t instructionCount) override
+        {
+            if (!mValid)
+                return ReplayStatus::Invalid;
+
+            auto startTime = getTime();
+            auto status = ReplayStatus::Completed;
+            while (status == ReplayStatus::Completed)
+            {
+                // Ties go to the first stream
+                size_t next = mReplayers.size();
+                for (size_t index = 0; index < mReplayers.size(); ++index)
+                {
+                    if (!mDone[index] && ((next == mReplayers.size()) || (mReplayers[index]->getSyncTime() < mReplayers[next]->getSyncTime())))
+                        next = index;
+                }
+                if (next == mReplayers.size())
+                    break;
+
+                auto& replayer = *mReplayers[next];
+                auto before = replayer.getInstruction();
+                status = replayer.run(instructionCount);
+                auto executed = replayer.getInstruction() - before;
+                mInstruction += executed;
+                instructionCount -= executed;
+                if (status == ReplayStatus::Completed)
+                    mDone[next] = true;
+                else if ((status == ReplayStatus::Paused) && replayer.isAtSync())
+                    status = ReplayStatus::Completed;
+            }
+            mTime += getTime() - startTime;
+            return status;
+        }
+
+        virtual ReplayStatus seek(uint64_t instruction) override
+        {
+            if (!mValid)
+                return ReplayStatus::Invalid;
+
+            // Keyframes of different streams do not share a global position, all streams restart from their first state
+            mInstruction = 0;
+            for (size_t index = 0; index < mReplayers.size(); ++index)
+            {
+                auto status = mReplayers[index]->seek(mReplayers[index]->getFirstInstruction());
+                if ((status == ReplayStatus::Invalid) || (status == ReplayStatus::Diverged))
+                    return status;
+                mDone[index] = status == ReplayStatus::Completed;
+            }
+            return run(instruction);
+        }
+
+        virtual uint64_t getInstruction() const override
+        {
+            return mInstruction;
+        }
+
+        // Counts are summed over the streams, divergences are those of the first stream that diverged
+        virtual void getStats(ReplayStats& stats) const override
+        {
+            ReplayStats total = {};
+            for (const auto& replayer : mReplayers)
+            {
+                ReplayStats stream;
+                replayer->getStats(stream);
+                total.instructionCount += stream.instructionCount;
+                total.recordCount += stream.recordCount;
+                total.skippedCount += stream.skippedCount;
+                total.verifiedCount += stream.verifiedCount;
+                total.blockDefinitionCount += stream.blockDefinitionCount;
+                total.blockRepeatCount += stream.blockRepeatCount;
+                total.blockInstructionCount += stream.blockInstructionCount;
+                if (stream.divergenceCount && !total.divergenceCount)
+                {
+                    total.firstDivergence = stream.firstDivergence;
+                    total.firstDivergenceStart = stream.firstDivergenceStart;
+                    total.lastDivergence = stream.lastDivergence;
+                    total.lastDivergenceStart = stream.lastDivergenceStart;
+                }
+                total.divergenceCount += stream.divergenceCount;
+            }
+            auto blockCount = total.blockDefinitionCount + total.blockRepeatCount;
+            total.blockHitRate = blockCount ? static_cast<double>(total.blockRepeatCount) / static_cast<double>(blockCount) : 0.0;
+            total.time = mTime;
+            total.instructionsPerSecond = mTime ? static_cast<double>(total.instructionCount) * 1e9 / static_cast<double>(mTime) : 0.0;
+            stats = total;
+        }
+
+    private:
+        std::vector<std::unique_ptr<Replayer>>  mReplayers;
+        std::vector<bool>                       mDone;
+        uint64_t                                mInstruction;
+        uint64_t                                mTime;
+        bool                                    mValid;
+    };
+
+    // Replays keyframe segments of a trace on several threads. Idle workers steal segments from the back of other queues.
+    class Verifier
+    {
+    public:
+        Verifier(const Trace& trace, IReplayFactory& factory, const VerifySettings& settings)
+            : mTrace(trace)
+            , mFactory(factory)
+            , mSettings(settings)
+            , mFirstDiverged(SIZE_MAX)
+        {
+            buildSegments();
+        }
+
+        ReplayStatus run(VerifyResult& result)
+        {
+            auto startTime = getTime();
+
+            auto threadCount = static_cast<size_t>(mSettings.threadCount ? mSettings.threadCount : std::thread::hardware_concurrency());
+            threadCount = std::max<size_t>(1, std::min(threadCount, mSegments.size()));
+
+            // Segments are dealt in contiguous ranges so workers start on neighboring data
+            for (size_t index = 0; index < threadCount; ++index)
+            {
+                mWorkers.emplace_back(new Worker());
+                mWorkers.back()->mDevice = &mFactory.createDevice();
+            }
+            for (size_t index = 0; index < mSegments.size(); ++index)
+                mWorkers[index * threadCount / mSegments.size()]->mQueue.push_back(index);
+
+            std::vector<std::thread> threads;
+            for (size_t index = 1; index < threadCount; ++index)
+                threads.push_back(std::thread([this, index]() { work(index); }));
+            if (!mWorkers.empty())
+                work(0);
+            for (auto& thread : threads)
+                thread.join();
+
+            for (auto& worker : mWorkers)
+                mFactory.destroyDevice(*worker->mDevice);
+
+            result.status = mSegments.empty() ? ReplayStatus::Invalid : ReplayStatus::Completed;
+            result.instructionCount = 0;
+            result.recordCount = 0;
+            result.firstDivergence = 0;
+            result.firstDivergenceStart = 0;
+            for (size_t index = 0; index < mSegments.size(); ++index)
+            {
+                const auto& segment = mSegments[index];
+                result.instructionCount += segment.mInstructionCount;
+                result.recordCount += segment.mRecordCount;
+                if (result.status != ReplayStatus::Completed)
+                    continue;
+                if (segment.mStatus == ReplayStatus::Diverged)
+                {
+                    result.status = ReplayStatus::Diverged;
+                    result.firstDivergence = segment.mDivergence;
+                    result.firstDivergenceStart = segment.mDivergenceStart;
+                }
+                else if (segment.mStatus == ReplayStatus::Invalid)
+                {
+                    result.status = ReplayStatus::Invalid;
+                }
+            }
+            result.segmentCount = static_cast<uint32_t>(mSegments.size());
+            result.threadCount = static_cast<uint32_t>(threadCount);
+            result.time = getTime() - startTime;
+            result.instructionsPerSecond = result.time ? static_cast<double>(result.instructionCount) * 1e9 / static_cast<double>(result.time) : 0.0;
+            return result.status;
+        }
+
+    private:
+        struct Segment
+        {
+            uint64_t        mBegin;
+            uint64_t        mEnd;
+            ReplayStatus    mStatus;
+            uint64_t        mDivergence;
+            uint64_t        mDivergenceStart;
+            uint64_t        mInstructionCount;
+            uint64_t        mRecordCount;
+        };
+
+        struct Worker
+        {
+            std::mutex          mMutex;
+            std::deque<size_t>  mQueue;
+            IReplayDevice*      mDevice;
+        };
+
+        void buildSegments()
+        {
+            const auto& keyframes = mTrace.getKeyframes();
+            for (size_t index = 0; index < keyframes.size(); ++index)
+            {
+                if (keyframes[index].mStream != mSettings.stream)
+                    continue;
+                auto begin = keyframes[index].mInstruction;
+                if (!mSegments.empty() && (begin - mSegments.back().mBegin < mSettings.segmentSize))
+                    continue;
+                if (!mSegments.empty())
+                    mSegments.back().mEnd = begin;
+                Segment segment = { begin, UINT64_MAX, ReplayStatus::Paused, 0, 0, 0, 0 };
+                mSegments.push_back(segment);
+            }
+        }
+
+        bool pop(size_t workerIndex, size_t& segment)
+        {
+            auto& worker = *mWorkers[workerIndex];
+            {
+                std::lock_guard<std::mutex> lock(worker.mMutex);
+                if (!worker.mQueue.empty())
+                {
+                    segment = worker.mQueue.front();
+                    worker.mQueue.pop_front();
+                    return true;
+                }
+            }
+
+            for (size_t offset = 1; offset < mWorkers.size(); ++offset)
+            {
+                auto& victim = *mWorkers[(workerIndex + offset) % mWorkers.size()];
+                std::lock_guard<std::mutex> lock(victim.mMutex);
+                if (!victim.mQueue.empty())
+                {
+                    segment = victim.mQueue.back();
+                    victim.mQueue.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void work(size_t workerIndex)
+        {
+            auto& device = *mWorkers[workerIndex]->mDevice;
+            Replayer replayer(device, mFactory.getReplay(device), mTrace, mSettings.stream);
+
+            size_t index = 0;
+            while (pop(workerIndex, index))
+            {
+                // Segments after a known divergence cannot change the result
+                if (index > mFirstDiverged.load())
+                    continue;
+
+                auto& segment = mSegments[index];
+                ReplayStats before;
+                replayer.getStats(before);
+
+                segment.mStatus = replayer.seek(segment.mBegin);
+                if (segment.mStatus == ReplayStatus::Paused)
+                    segment.mStatus = replayer.run(segment.mEnd - segment.mBegin);
+                if (segment.mStatus == ReplayStatus::Paused)
+                    segment.mStatus = ReplayStatus::Completed;
+
+                ReplayStats after;
+                replayer.getStats(after);
+                segment.mInstructionCount = replayer.getInstruction() - segment.mBegin;
+                segment.mRecordCount = after.recordCount - before.recordCount;
+                if (segment.mStatus == ReplayStatus::Diverged)
+                {
+                    segment.mDivergence = after.lastDivergence;
+                    segment.mDivergenceStart = after.lastDivergenceStart;
+                    auto first = mFirstDiverged.load();
+                    while ((index < first) && !mFirstDiverged.compare_exchange_weak(first, index))
+                    {
+                    }
+                }
+            }
+        }
+
+        const Trace&                            mTrace;
+        IReplayFactory&                         mFactory;
+        VerifySettings                          mSettings;
+        std::vector<Segment>                    mSegments;
+        std::vector<std::unique_ptr<Worker>>    mWorkers;
+        std::atomic<size_t>                     mFirstDiverged;
+    };
+
+    // Decodes the records of one stream of a trace a chunk at a time for a diff
+    class DiffCursor
+    {
+    public:
+        DiffCursor(const Trace& trace, uint32_t stream, const std::vector<uint32_t>& chunks, bool verifiedDeltas)
+            : mTrace(trace)
+            , mChunks(chunks)
+            , mChunkIndex(0)
+            , mRecordIndex(0)
+            , mStateSize(0)
+            , mInstruction(0)
+            , mDecodedChunkCount(0)
+            , mVerifiedDeltas(verifiedDeltas)
+            , mValid(true)
+            , mEnded(false)
+        {
+            const auto& info = mTrace.getInfo();
+            const auto& streams = mTrace.getStreams();
+            mStateSize = stream < streams.size() ? streams[stream].mStateSize : 0;
+            mInstruction = stream < streams.size() ? streams[stream].mFirstInstruction : 0;
+            mCompactState.mStateSize = mStateSize;
+            mCompactState.mCodeType = info.mCodeType;
+            mCompactState.mVerifyMode = info.mVerifyMode;
+        }
+
+        // Continues from a chunk of the stream, the chunks before it are left out
+        void seek(size_t chunkIndex)
+        {
+            mChunkIndex = chunkIndex;
+            mRecords.clear();
+            mRecordIndex = 0;
+            if (chunkIndex < mChunks.size())
+                mInstruction = mTrace.getChunks()[mChunks[chunkIndex]].mInstruction;
+        }
+
+        // Returns false when the trace is invalid, the record is End past the last one
+        bool next(DiffRecord& record)
+        {
+            while (mRecordIndex == mRecords.size())
+            {
+                if (mEnded || (mChunkIndex == mChunks.size()))
+                {
+                    DiffRecord end = { RecordCommand::End, mInstruction, 0, 0, 0, 0 };
+                    record = end;
+                    return mValid;
+                }
+                if (!decodeChunk())
+                    return false;
+            }
+            record = mRecords[mRecordIndex++];
+            return true;
+        }
+
+        uint32_t getDecodedChunkCount() const
+        {
+            return mDecodedChunkCount;
+        }
+
+        // Decoder callbacks
+        void invalid()
+        {
+            mValid = false;
+        }
+
+        void footer()
+        {
+            mEnded = true;
+        }
+
+        bool setState(const void* state, uint32_t flags)
+        {
+            // Keyframes depend on the capture settings rather than on the device
+            if (!(flags & StateFlag::Keyframe))
+                add(RecordCommand::State, mInstruction, 0, 0, 0, hashBytes(state, mStateSize));
+            return true;
+        }
+
+        bool canExecute()
+        {
+            return true;
+        }
+
+        bool execute(const void* hash)
+        {
+            uint64_t data = 0;
+            if (hash)
+                memcpy(&data, hash, sizeof(data));
+            add(RecordCommand::Execute, mInstruction++, 0, 0, 0, data);
+            return true;
+        }
+
+        bool deltaWord(uint32_t index, uint32_t difference)
+        {
+            mDelta.push_back(index);
+            mDelta.push_back(difference);
+            return true;
+        }
+
+        // The delta verifies the state of the execute record it follows
+        bool delta()
+        {
+            if (mVerifiedDeltas && !mRecords.empty() && (mRecords.back().command == RecordCommand::Execute))
+                mRecords.back().data = hashBytes(mDelta.data(), mDelta.size() * sizeof(uint32_t));
+            mDelta.clear();
+            return true;
+        }
+
+        void interrupt(uint32_t type)
+        {
+            add(RecordCommand::Interrupt, getCurrentInstruction(), 0, type, 0, 0);
+        }
+
+        void signal(uint32_t type)
+        {
+            add(RecordCommand::Signal, getCurrentInstruction(), 0, type, 0, 0);
+        }
+
+        bool sync(uint64_t time)
+        {
+            add(RecordCommand::Sync, getCurrentInstruction(), 0, 0, 0, time);
+            return true;
+        }
+
+        void block(uint32_t, bool)
+        {
+        }
+
+        void access(Command command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            add(getRecordCommand(command), getCurrentInstruction(), addr, value, type, 0);
+        }
+
+        void batch(Command command, uint32_t addr, const uint32_t* addrs, const uint8_t* data, uint32_t count, uint32_t type)
+        {
+            auto size = getAccessSize(command);
+            for (uint32_t index = 0; index < count; ++index)
+                access(command, addrs ? addrs[index] : addr + index * size, readValue(data, index, size), type);
+        }
+
+    private:
+        DiffCursor(const DiffCursor&);
+        DiffCursor& operator=(const DiffCursor&);
+
+        uint64_t getCurrentInstruction() const
+        {
+            return mInstruction ? mInstruction - 1 : 0;
+        }
+
+        void add(RecordCommand command, uint64_t instruction, uint32_t addr, uint32_t value, uint32_t type, uint64_t data)
+        {
+            DiffRecord record = { command, instruction, addr, value, type, data };
+            mRecords.push_back(record);
+        }
+
+        bool decodeChunk()
+        {
+            size_t size = 0;
+            auto data = mTrace.getChunkData(mChunks[mChunkIndex], mChunkBuffer, size);
+            ++mChunkIndex;
+            ++mDecodedChunkCount;
+            if (!data)
+                mValid = false;
+            mRecords.clear();
+            mRecordIndex = 0;
+            if (!mValid)
+                return false;
+
+            // Each chunk can be decoded on its own
+            mCompactState.reset();
+            if (mTrace.getInfo().mEncoding == Encoding::Compact)
+                decodeCompact(data, data + size, mCompactState, *this);
+            else
+                decodeRaw(data, data + size, *this);
+            return mValid;
+        }
+
+        const Trace&                mTrace;
+        const std::vector<uint32_t>& mChunks;
+        size_t                      mChunkIndex;
+        std::vector<DiffRecord>     mRecords;
+        size_t                      mRecordIndex;
+        std::vector<uint8_t>        mChunkBuffer;
+        std::vector<uint32_t>       mDelta;
+        CompactState                mCompactState;
+        size_t                      mStateSize;
+        uint64_t                    mInstruction;
+        uint32_t                    mDecodedChunkCount;
+        bool                        mVerifiedDeltas;
+        bool                        mValid;
+        bool                        mEnded;
+    };
+
+    // Compares a stream of two traces record by record. The chunk hashes of each trace are the leaves of a binary tree whose nodes
+    // hash their two children, the first chunk that differs is found by going down from the root towards the first child that differs.
+    class TraceDiff
+    {
+    public:
+        TraceDiff(const Trace& left, const Trace& right, uint32_t stream)
+            : mStream(stream)
+        {
+            mTraces[0] = &left;
+            mTraces[1] = &right;
+            for (size_t side = 0; side < 2; ++side)
+            {
+                const auto& chunks = mTraces[side]->getChunks();
+                for (size_t index = 0; index < chunks.size(); ++index)
+                {
+                    if (chunks[index].mStream == stream)
+                        mChunks[side].push_back(static_cast<uint32_t>(index));
+                }
+            }
+        }
+
+        bool run(DiffResult& result)
+        {
+            auto startTime = getTime();
+            DiffRecord end = { RecordCommand::End, 0, 0, 0, 0, 0 };
+            result.different = false;
+            result.records[0] = end;
+            result.records[1] = end;
+            result.recordCount = 0;
+            result.skippedChunkCount = 0;
+            result.decodedChunkCount = 0;
+
+            const auto& left = mTraces[0]->getInfo();
+            const auto& right = mTraces[1]->getInfo();
+            auto valid = isValid(*mTraces[0]) && isValid(*mTraces[1]);
+            if (valid)
+            {
+                // Hashes of states are only comparable when they are computed the same way
+                auto leftDeltas = left.mVerifyMode == VerifyMode::Delta;
+                auto rightDeltas = right.mVerifyMode == VerifyMode::Delta;
+                mCompareHashes = (left.mStateHash == right.mStateHash) && (leftDeltas == rightDeltas);
+
+                DiffCursor leftCursor(*mTraces[0], mStream, mChunks[0], leftDeltas);
+                DiffCursor rightCursor(*mTraces[1], mStream, mChunks[1], rightDeltas);
+                if (canSkipChunks())
+                {
+                    auto chunk = findFirstChunk();
+                    leftCursor.seek(chunk);
+                    rightCursor.seek(chunk);
+                    result.skippedChunkCount = static_cast<uint32_t>(chunk);
+                }
+
+                for (;;)
+                {
+                    auto& records = result.records;
+                    if (!leftCursor.next(records[0]) || !rightCursor.next(records[1]))
+                    {
+                        valid = false;
+                        break;
+                    }
+                    if (!isSame(records[0], records[1]))
+                    {
+                        result.different = true;
+                        break;
+                    }
+                    if (records[0].command == RecordCommand::End)
+                        break;
+                    ++result.recordCount;
+                }
+                result.decodedChunkCount = leftCursor.getDecodedChunkCount() + rightCursor.getDecodedChunkCount();
+            }
+            result.time = getTime() - startTime;
+            return valid;
+        }
+
+    private:
+        bool isValid(const Trace& trace) const
+        {
+            const auto& info = trace.getInfo();
+            return (mStream < trace.getStreams().size()) && (info.mEncoding <= Encoding::Columnar) && (info.mCompression <= Codec::Lz);
+        }
+
+        // Chunks with the same content hold the same records when they are decoded the same way
+        bool canSkipChunks() const
+        {
+            const auto& left = mTraces[0]->getInfo();
+            const auto& right = mTraces[1]->getInfo();
+            // Columnar chunks hold raw records
+            auto leftCompact = left.mEncoding == Encoding::Compact;
+            auto rightCompact = right.mEncoding == Encoding::Compact;
+            if ((leftCompact != rightCompact) || (left.mCodeType != right.mCodeType) || (left.mVerifyMode != right.mVerifyMode) ||
+                (mTraces[0]->getStreams()[mStream].mStateSize != mTraces[1]->getStreams()[mStream].mStateSize))
+                return false;
+            for (size_t side = 0; side < 2; ++side)
+            {
+                for (auto index : mChunks[side])
+                {
+                    if (!mTraces[side]->getChunks()[index].mHash)
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        // Returns the index of the first chunk that differs, the chunk count when both streams are the same
+        size_t findFirstChunk() const
+        {
+            // Both trees have the same shape, a stream with fewer chunks has unknown hashes for the missing ones
+            auto leafCount = std::max(mChunks[0].size(), mChunks[1].size());
+            std::vector<std::vector<uint64_t>> levels[2];
+            for (size_t side = 0; side < 2; ++side)
+            {
+                levels[side].resize(1);
+                auto& leaves = levels[side][0];
+                leaves.resize(leafCount, 0);
+                for (size_t index = 0; index < mChunks[side].size(); ++index)
+                {
+                    const auto& chunk = mTraces[side]->getChunks()[mChunks[side][index]];
+                    uint64_t leaf[2] = { chunk.mHash, chunk.mInstruction };
+                    leaves[index] = hashBytes(leaf, sizeof(leaf));
+                }
+                buildTree(levels[side]);
+            }
+
+            if (levels[0].back()[0] == levels[1].back()[0])
+                return leafCount;
+
+            // A node without a second child holds the hash of its first child
+            size_t node = 0;
+            for (auto level = levels[0].size() - 1; level > 0; --level)
+            {
+                auto child = node * 2;
+                const auto& children = levels[0][level - 1];
+                node = (child + 1 < children.size()) && (children[child] == levels[1][level - 1][child]) ? child + 1 : child;
+            }
+            return node;
+        }
+
+        static void buildTree(std::vector<std::vector<uint64_t>>& levels)
+        {
+            while (levels.back().size() > 1)
+            {
+                const auto& children = levels.back();
+                std::vector<uint64_t> parents((children.size() + 1) / 2);
+                for (size_t index = 0; index < parents.size(); ++index)
+                    parents[index] = index * 2 + 1 < children.size() ? hashBytes(&children[index * 2], 2 * sizeof(uint64_t)) : children[index * 2];
+                levels.push_back(std::move(parents));
+            }
+            if (levels.back().empty())
+                levels.back().push_back(0);
+        }
+
+        bool isSame(const DiffRecord& left, const DiffRecord& right) const
+        {
+            if ((left.command != right.command) || (left.instruction != right.instruction) || (left.addr != right.addr) ||
+                (left.value != right.value) || (left.type != right.type))
+                return false;
+
+            // Execute records of each trace can verify different instructions
+            if (left.command == RecordCommand::Execute)
+                return !mCompareHashes || !left.data || !right.data || (left.data == right.data);
+            return left.data == right.data;
+        }
+
+        const Trace*                mTraces[2];
+        std::vector<uint32_t>       mChunks[2];
+        uint32_t                    mStream;
+        bool                        mCompareHashes;
+    };
+
+    // Reports the memory accesses of a stream selected by a query. The commands of columnar chunks are checked sixteen at a time,
+    // runs made only of executes and accesses are skipped when none of their addresses is within the range, the others are
+    // walked record by record.
+#if CPUTRACE_SSE2
+    uint32_t countBits(uint32_t value)
+    {
+        value = value - ((value >> 1) & 0x55555555);
+        value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+        return (((value + (value >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+    }
+
+    // Index of the lowest bit set of a value that is not 0
+    uint32_t findLowestBit(uint32_t value)
+    {
+        static const uint8_t indices[32] =
+        {
+            0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+            31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+        };
+        return indices[((value & (0u - value)) * 0x077cb531u) >> 27];
+    }
+
+    // Masks of the accesses and of the executes among sixteen commands
+    void findRecords(const uint8_t* commands, uint32_t& accessMask, uint32_t& executeMask)
+    {
+        auto values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(commands));
+        auto slots = _mm_sub_epi8(values, _mm_set1_epi8(static_cast<char>(Command::Read8)));
+        auto lastSlot = _mm_set1_epi8(static_cast<char>(AccessCount - 1));
+        accessMask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(slots, lastSlot), slots)));
+        executeMask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(values, _mm_set1_epi8(static_cast<char>(Command::Execute)))));
+    }
+#endif
+
+    class AccessScanner
+    {
+    public:
+        AccessScanner(const Trace& trace, const AccessQuery& query, IAccessScan& scan)
+            : mTrace(trace)
+            , mQuery(query)
+            , mScan(scan)
+            , mInstruction(0)
+            , mValid(true)
+        {
+            const auto& info = trace.getInfo();
+            const auto& streams = trace.getStreams();
+            if (query.stream < streams.size())
+            {
+                mInstruction = streams[query.stream].mFirstInstruction;
+                mCompactState.mStateSize = streams[query.stream].mStateSize;
+            }
+            mCompactState.mCodeType = info.mCodeType;
+            mCompactState.mVerifyMode = info.mVerifyMode;
+        }
+
+        bool run()
+        {
+            const auto& info = mTrace.getInfo();
+            if ((mQuery.stream >= mTrace.getStreams().size()) || (info.mEncoding > Encoding::Columnar) || (info.mCompression > Codec::Lz))
+                return false;
+            if (mQuery.range.first > mQuery.range.last)
+                return true;
+
+            const auto& chunks = mTrace.getChunks();
+            for (size_t index = 0; (index < chunks.size()) && mValid; ++index)
+            {
+                if (chunks[index].mStream != mQuery.stream)
+                    continue;
+                mTrace.prefetchChunk(index + 1);
+                if (info.mEncoding == Encoding::Columnar)
+                {
+                    Columns columns;
+                    auto data = mTrace.getStoredData(index, mChunkBuffer);
+                    mValid = data && columns.read(data, chunks[index].mRawSize) && scanColumns(columns);
+                    continue;
+                }
+
+                size_t size = 0;
+                auto data = mTrace.getChunkData(index, mChunkBuffer, size);
+                if (!data)
+                    return false;
+                mCompactState.reset();
+                if (info.mEncoding == Encoding::Compact)
+                    decodeCompact(data, data + size, mCompactState, *this);
+                else
+                    decodeRaw(data, data + size, *this);
+            }
+            return mValid;
+        }
+
+        // Decoder callbacks
+        void invalid()
+        {
+            mValid = false;
+        }
+
+        void footer()
+        {
+        }
+
+        bool setState(const void*, uint32_t)
+        {
+            return true;
+        }
+
+        bool canExecute()
+        {
+            return true;
+        }
+
+        bool execute(const void*)
+        {
+            ++mInstruction;
+            return true;
+        }
+
+        bool deltaWord(uint32_t, uint32_t)
+        {
+            return true;
+        }
+
+        bool delta()
+        {
+            return true;
+        }
+
+        void interrupt(uint32_t)
+        {
+        }
+
+        void signal(uint32_t)
+        {
+        }
+
+        bool sync(uint64_t)
+        {
+            return true;
+        }
+
+        void block(uint32_t, bool)
+        {
+        }
+
+        void access(Command command, uint32_t addr, uint32_t value, uint32_t type)
+        {
+            if (isSelected(command, addr, type))
+                mScan.access(mInstruction ? mInstruction - 1 : 0, getRecordCommand(command), addr, value, type);
+        }
+
+        void batch(Command command, uint32_t addr, const uint32_t* addrs, const uint8_t* data, uint32_t count, uint32_t type)
+        {
+            auto size = getAccessSize(command);
+            for (uint32_t index = 0; index < count; ++index)
+                access(command, addrs ? addrs[index] : addr + index * size, readValue(data, index, size), type);
+        }
+
+    private:
+        AccessScanner(const AccessScanner&);
+        AccessScanner& operator=(const AccessScanner&);
+
+        bool isSelected(Command command, uint32_t addr, uint32_t type) const
+        {
+            if ((type < 32) && !((mQuery.accessTypes >> type) & 1))
+                return false;
+            if (!(command >= Command::Write8 ? mQuery.writes : mQuery.reads))
+                return false;
+            return addr - mQuery.range.first <= mQuery.range.last - mQuery.range.first;
+        }
+
+        bool scanColumns(const Columns& columns)
+        {
+            uint32_t accessIndex = 0;
+            auto other = columns.mOther;
+            uint32_t index = 0;
+            while (index < columns.mRecordCount)
+            {
+                auto end = std::min(index + 16, columns.mRecordCount);
+#if CPUTRACE_SSE2
+                if (end - index == 16)
+                {
+                    uint32_t accessMask = 0;
+                    uint32_t executeMask = 0;
+                    findRecords(columns.mCommands + index, accessMask, executeMask);
+                    auto accessCount = countBits(accessMask);
+                    if (((accessMask | executeMask) == 0xffff) && (accessIndex + accessCount <= columns.mAccessCount) &&
+                        !hasAddressInRange(columns.mAddresses + accessIndex, accessCount))
+                    {
+                        mInstruction += countBits(executeMask);
+                        accessIndex += accessCount;
+                        index = end;
+                        continue;
+                    }
+                }
+#endif
+                for (; index < end; ++index)
+                {
+                    if (!scanRecord(columns, index, accessIndex, other))
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        bool scanRecord(const Columns& columns, uint32_t index, uint32_t& accessIndex, const uint32_t*& other)
+        {
+            auto command = static_cast<Command>(columns.mCommands[index]);
+            if (isAccess(columns.mCommands[index]))
+            {
+                if (accessIndex == columns.mAccessCount)
+                    return false;
+                access(command, columns.mAddresses[accessIndex], columns.mValues[accessIndex], columns.mTypes[index]);
+                ++accessIndex;
+                return true;
+            }
+            if (command == Command::Execute)
+            {
+                ++mInstruction;
+                return true;
+            }
+
+            auto end = columns.mOther + columns.mOtherCount;
+            if ((other == end) || (static_cast<uint32_t>(end - other - 1) < *other))
+                return false;
+            auto blocks = *other++;
+            auto payload = other;
+            other += blocks;
+            if ((command == Command::Range) || (command == Command::Gather))
+                return decodeRawBatch(command, payload, blocks, columns.mTypes[index], *this);
+            return true;
+        }
+
+#if CPUTRACE_SSE2
+        // Addresses are compared as unsigned offsets from the start of the range
+        bool hasAddressInRange(const uint32_t* addrs, uint32_t count) const
+        {
+            auto first = mQuery.range.first;
+            auto length = mQuery.range.last - first;
+            auto sign = _mm_set1_epi32(INT32_MIN);
+            auto start = _mm_set1_epi32(static_cast<int>(first));
+            auto limit = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(length)), sign);
+            uint32_t index = 0;
+            for (; index + 4 <= count; index += 4)
+            {
+                auto offsets = _mm_xor_si128(_mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(addrs + index)), start), sign);
+                if (_mm_movemask_epi8(_mm_cmpgt_epi32(offsets, limit)) != 0xffff)
+                    return true;
+            }
+            for (; index < count; ++index)
+            {
+                if (addrs[index] - first <= length)
+                    return true;
+            }
+            return false;
+        }
+#endif
+
+        const Trace&            mTrace;
+        const AccessQuery&      mQuery;
+        IAccessScan&            mScan;
+        std::vector<uint8_t>    mChunkBuffer;
+        CompactState            mCompactState;
+        uint64_t                mInstruction;
+        bool                    mValid;
+    };
+
+    // Counts of keys in bounded memory. When the table is full, every count is lowered by the count of the first quarter of the
+    // keys and the keys left at 0 are dropped (Misra-Gries), so the counts kept are short by at most the total lowered.
+    class CounterTable
+    {
+    public:
+        static const uint64_t EmptyKey = UINT64_MAX;
+
+        CounterTable(uint32_t capacity)
+            : mCapacity(std::max<uint32_t>(capacity, 16))
+            , mSize(0)
+            , mError(0)
+        {
+            size_t tableSize = 32;
+            while (tableSize < static_cast<size_t>(mCapacity) * 2)
+                tableSize *= 2;
+            Entry empty = { EmptyKey, 0 };
+            mEntries.resize(tableSize, empty);
+            mMask = tableSize - 1;
+        }
+
+        void add(uint64_t key, uint64_t count)
+        {
+            auto& entry = find(key);
+            if (entry.mKey == key)
+            {
+                entry.mCount += count;
+                return;
+            }
+            if (mSize < mCapacity)
+            {
+                entry.mKey = key;
+                entry.mCount = count;
+                ++mSize;
+                return;
+            }
+            reduce();
+            auto& slot = find(key);
+            slot.mKey = key;
+            slot.mCount = count;
+            ++mSize;
+        }
+
+        uint64_t getError() const
+        {
+            return mError;
+        }
+
+        // Calls the visitor with each key and its count
+        template <typename TVisitor>
+        void forEach(TVisitor visitor) const
+        {
+            for (const auto& entry : mEntries)
+            {
+                if (entry.mKey != EmptyKey)
+                    visitor(entry.mKey, entry.mCount);
+            }
+        }
+
+    private:
+        struct Entry
+        {
+            uint64_t    mKey;
+            uint64_t    mCount;
+        };
+
+        // Entry of the key or empty entry where it goes
+        Entry& find(uint64_t key)
+        {
+            auto index = static_cast<size_t>((key * 0x9e3779b97f4a7c15ull) >> 32) & mMask;
+            while ((mEntries[index].mKey != key) && (mEntries[index].mKey != EmptyKey))
+                index = (index + 1) & mMask;
+            return mEntries[index];
+        }
+
+        void reduce()
+        {
+            mCounts.clear();
+            forEach([this](uint64_t, uint64_t count) { mCounts.push_back(count); });
+            auto quarter = mCounts.begin() + mCounts.size() / 4;
+            std::nth_element(mCounts.begin(), quarter, mCounts.end());
+            auto lowered = *quarter;
+
+            Entry empty = { EmptyKey, 0 };
+            mScratch.assign(mEntries.size(), empty);
+            mEntries.swap(mScratch);
+            mSize = 0;
+            for (const auto& entry : mScratch)
+            {
+                if ((entry.mKey == EmptyKey) || (entry.mCount <= lowered))
+                    continue;
+                auto& slot = find(entry.mKey);
+                slot.mKey = entry.mKey;
+                slot.mCount = entry.mCount - lowered;
+                ++mSize;
+            }
+            mError += lowered;
+        }
+
+        std::vector<Entry>      mEntries;
+        std::vector<Entry>      mScratch;
+        std::vector<uint64_t>   mCounts;
+        size_t                  mMask;
+        uint32_t                mCapacity;
+        uint32_t                mSize;
+        uint64_t                mError;
+    };
+
+    // Counts the records of a stream in one pass. Columnar chunks are counted sixteen records at a time from their columns when
+    // they only hold executes and accesses, the other chunks are decoded.
+    class TraceAnalyzer
+    {
+    public:
+        static const uint32_t PageCacheSize = 64;
+
+        TraceAnalyzer(const Trace& trace, const AnalyticsSettings& settings, ITraceAnalytics& analytics)
+            : mTrace(trace)
+            , mSettings(settings)
+            , mAnalytics(analytics)
+            , mCode(settings.counterCount)
+            , mPages(settings.counterCount)
+            , mResult()
+            , mCodeType(trace.getInfo().mCodeType)
+            , mPageShift(std::min<uint32_t>(settings.pageShift, 31))
+            , mLastState(0)
+            , mStateSeen(false)
+            , mValid(true)
+        {
+            const auto& info = trace.getInfo();
+            const auto& streams = trace.getStreams();
+            if (settings.stream < streams.size())
+                mCompactState.mStateSize = streams[settings.stream].mStateSize;
+            mCompactState.mCodeType = info.mCodeType;
+            mCompactState.mVerifyMode = info.mVerifyMode;
+            for (auto& page : mPageCache)
+                page = std::make_pair(0ull, 0ull);
+        }
+
+        bool run(AnalyticsResult& result)
+        {
+            auto startTime = getTime();
+            const auto& info = mTrace.getInfo();
+            if ((mSettings.stream >= mTrace.getStreams().size()) || (info.mEncoding > Encoding::Columnar) || (info.mCompression > Codec::Lz))
+                mValid = false;
+
+            const auto& chunks = mTrace.getChunks();
+            for (size_t index = 0; (index < chunks.size()) && mValid; ++index)
+            {
+                if (chunks[index].mStream != mSettings.stream)
+                    continue;
+                mTrace.prefetchChunk(index + 1);
+                ++mResult.chunkCount;
+                if (info.mEncoding == Encoding::Columnar)
+                {
+                    Columns columns;
+                    auto data = mTrace.getStoredData(index, mChunkBuffer);
+                    mValid = data && columns.read(data, chunks[index].mRawSize) && countColumns(columns);
+                    continue;
+                }
+
+                size_t size = 0;
+                auto data = mTrace.getChunkData(index, mChunkBuffer, size);
+                if (!data)
+                {
+                    mValid = false;
+                    break;
+                }
+                mCompactState.reset();
+                if (info.mEncoding == Encoding::Compact)
+                    decodeCompact(data, data + size, mCompactState, *this);
+                else
+                    decodeRaw(data, data + size, *this);
+            }
+
+            if (mValid)
+                report();
+            mResult.codeCountError = mCode.getError();
+            mResult.pageCountError = mPages.getError();
+            mResult.time = getTime() - startTime;
+            mResult.instructionsPerSecond = mResult.time ? static_cast<double>(mResult.instructionCount) * 1e9 / static_cast<double>(mResult.time) : 0.0;
+            result = mResult;
+            return mValid;
+        }
+
+        // Decoder callbacks
+        void invalid()
+        {
+            mValid = false;
+        }
+
+        void footer()
+        {
+        }
+
+        bool setState(const void*, uint32_t flags)
+        {
+            ++mResult.recordCount[static_cast<uint32_t>(RecordCommand::State)];
+            ++mResult.stateCount;
+            if (flags & StateFlag::Keyframe)
+                ++mResult.keyframeCount;
+            if (mStateSeen)
+            {
+                auto gap = mResult.instructionCount - mLastState;
+                uint32_t bucket = 0;
+                while ((bucket < 64) && (gap >> bucket))
+                    ++bucket;
+                ++mResult.stateGaps[bucket];
+                mResult.maxStateGap = std::max(mResult.maxStateGap, gap);
+            }
+            mLastState = mResult.instructionCount;
+            mStateSeen = true;
+            return true;
+        }
+
+        bool canExecute()
+        {
+            return true;
+        }
+
+        bool execute(const void*)
+        {
+            ++mResult.recordCount[static_cast<uint32_t>(RecordCommand::Execute)];
+            ++mResult.instructionCount;
+            return true;
+        }
+
+        bool deltaWord(uint32_t, uint32_t)
+        {
+            return true;
+        }
+
+        bool delta()
+        {
+            return true;
+        }
+
+        void interrupt(uint32_t type)
+        {
+            ++mResult.recordCount[static_cast<uint32_t>(RecordCommand::Interrupt)];
+            ++mResult.interruptCount[getTypeSlot(type)];
+        }
+
+        void signal(uint32_t type)
+        {
+            ++mResult.recordCount[static_cast<uint32_t>(RecordCommand::Signal)];
+            ++mResult.signalCount[getTypeSlot(type)];
+        }
+
+        bool sync(uint64_t)
+        {
+            ++mResult.recordCount[static_cast<uint32_t>(RecordCommand::Sync)];
+            return true;
+        }
+
+        void block(uint32_t, bool)
+        {
+        }
+
+        void access(Command command, uint32_t addr, uint32_t, uint32_t type)
+        {
+            ++mResult.recordCount[static_cast<uint32_t>(getRecordCommand(command))];
+            countAccess(command, addr, type);
+        }
+
+        void batch(Command command, uint32_t addr, const uint32_t* addrs, const uint8_t*, uint32_t count, uint32_t type)
+        {
+            auto size = getAccessSize(command);
+            for (uint32_t index = 0; index < count; ++index)
+                access(command, addrs ? addrs[index] : addr + index * size, 0, type);
+        }
+
+    private:
+        TraceAnalyzer(const TraceAnalyzer&);
+        TraceAnalyzer& operator=(const TraceAnalyzer&);
+
+        static uint32_t getTypeSlot(uint32_t type)
+        {
+            return std::min(type, AnalyticsResult::TypeCount - 1);
+        }
+
+        // Pages are counted in a small cache before going to the table, instructions and their data rarely share a page
+        void countAccess(Command command, uint32_t addr, uint32_t type)
+        {
+            auto write = command >= Command::Write8;
+            auto slot = getTypeSlot(type);
+            ++(write ? mResult.writeCount : mResult.readCount)[slot];
+            if ((type == mCodeType) && ((command == Command::Read16) || (command == Command::Read32)))
+                mCode.add(addr, 1);
+
+            auto key = (static_cast<uint64_t>(addr >> mPageShift) << 6) | (slot << 1) | (write ? 1 : 0);
+            auto& page = mPageCache[(key ^ (key >> 6) ^ (key >> 12)) % PageCacheSize];
+            if (page.first != key)
+            {
+                if (page.second)
+                    mPages.add(page.first, page.second);
+                page.first = key;
+                page.second = 0;
+            }
+            ++page.second;
+        }
+
+        bool countColumns(const Columns& columns)
+        {
+            uint32_t accessIndex = 0;
+            auto other = columns.mOther;
+            uint32_t index = 0;
+            while (index < columns.mRecordCount)
+            {
+                auto end = std::min(index + 16, columns.mRecordCount);
+#if CPUTRACE_SSE2
+                if (end - index == 16)
+                {
+                    uint32_t accessMask = 0;
+                    uint32_t executeMask = 0;
+                    findRecords(columns.mCommands + index, accessMask, executeMask);
+                    auto accessCount = countBits(accessMask);
+                    if (((accessMask | executeMask) == 0xffff) && (accessIndex + accessCount <= columns.mAccessCount))
+                    {
+                        auto executeCount = countBits(executeMask);
+                        mResult.recordCount[static_cast<uint32_t>(RecordCommand::Execute)] += executeCount;
+                        mResult.instructionCount += executeCount;
+                        countCommands(columns.mCommands + index);
+                        for (; accessMask; accessMask &= accessMask - 1)
+                        {
+                            auto record = index + findLowestBit(accessMask);
+                            countAccess(static_cast<Command>(columns.mCommands[record]), columns.mAddresses[accessIndex++], columns.mTypes[record]);
+                        }
+                        index = end;
+                        continue;
+                    }
+                }
+#endif
+                for (; index < end; ++index)
+                {
+                    if (!countRecord(columns, index, accessIndex, other))
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        bool countRecord(const Columns& columns, uint32_t index, uint32_t& accessIndex, const uint32_t*& other)
+        {
+            auto command = static_cast<Command>(columns.mCommands[index]);
+            if (isAccess(columns.mCommands[index]))
+            {
+                if (accessIndex == columns.mAccessCount)
+                    return false;
+                access(command, columns.mAddresses[accessIndex], 0, columns.mTypes[index]);
+                ++accessIndex;
+                return true;
+            }
+            if (command == Command::Execute)
+                return execute(nullptr);
+
+            auto end = columns.mOther + columns.mOtherCount;
+            if ((other == end) || (static_cast<uint32_t>(end - other - 1) < *other))
+                return false;
+            auto blocks = *other++;
+            auto payload = other;
+            other += blocks;
+            switch (command)
+            {
+            case Command::SetState:
+                return setState(payload, columns.mTypes[index]);
+            case Command::Interrupt:
+                if (blocks)
+                    interrupt(payload[0]);
+                return blocks > 0;
+            case Command::Signal:
+                if (blocks)
+                    signal(payload[0]);
+                return blocks > 0;
+            case Command::Sync:
+                return sync(0);
+            case Command::Range:
+            case Command::Gather:
+                return decodeRawBatch(command, payload, blocks, columns.mTypes[index], *this);
+            default:
+                return true;
+            }
+        }
+
+#if CPUTRACE_SSE2
+        // Adds the accesses among sixteen commands to the counts of their commands
+        void countCommands(const uint8_t* commands)
+        {
+            auto values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(commands));
+            for (uint32_t slot = 0; slot < AccessCount; ++slot)
+            {
+                auto command = _mm_set1_epi8(static_cast<char>(static_cast<uint32_t>(Command::Read8) + slot));
+                auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(values, command)));
+                mResult.recordCount[static_cast<uint32_t>(RecordCommand::Read8) + slot] += countBits(mask);
+            }
+        }
+#endif
+
+        void report()
+        {
+            for (auto& page : mPageCache)
+            {
+                if (page.second)
+                    mPages.add(page.first, page.second);
+                page.second = 0;
+            }
+
+            // Most fetched first, then lowest address
+            std::vector<std::pair<uint64_t, uint32_t>> code;
+            mCode.forEach([&code](uint64_t key, uint64_t count) { code.push_back(std::make_pair(count, static_cast<uint32_t>(key))); });
+            auto hotCount = std::min<size_t>(mSettings.hotCodeCount, code.size());
+            std::partial_sort(code.begin(), code.begin() + hotCount, code.end(),
+                [](const std::pair<uint64_t, uint32_t>& left, const std::pair<uint64_t, uint32_t>& right) {
+                    return (left.first > right.first) || ((left.first == right.first) && (left.second < right.second));
+                });
+            for (size_t index = 0; index < hotCount; ++index)
+                mAnalytics.hotCode(code[index].second, code[index].first);
+
+            // Reads and writes of a page and a type have consecutive keys
+            std::vector<std::pair<uint64_t, uint64_t>> pages;
+            mPages.forEach([&pages](uint64_t key, uint64_t count) { pages.push_back(std::make_pair(key, count)); });
+            std::sort(pages.begin(), pages.end());
+            for (size_t index = 0; index < pages.size();)
+            {
+                auto group = pages[index].first >> 1;
+                uint64_t counts[2] = {};
+                for (; (index < pages.size()) && ((pages[index].first >> 1) == group); ++index)
+                    counts[pages[index].first & 1] = pages[index].second;
+                auto page = static_cast<uint32_t>((group >> 5) << mPageShift);
+                mAnalytics.pageAccesses(page, static_cast<uint32_t>(group & 31), counts[0], counts[1]);
+            }
+        }
+
+        const Trace&                    mTrace;
+        const AnalyticsSettings&        mSettings;
+        ITraceAnalytics&                mAnalytics;
+        std::vector<uint8_t>            mChunkBuffer;
+        CompactState                    mCompactState;
+        CounterTable                    mCode;
+        CounterTable                    mPages;
+        std::pair<uint64_t, uint64_t>   mPageCache[PageCacheSize];
+        AnalyticsResult                 mResult;
+        uint32_t                        mCodeType;
+        uint32_t                        mPageShift;
+        uint64_t                        mLastState;
+        bool                            mStateSeen;
+        bool                            mValid;
+    };
+
+    // Traces created by a context share its pool of segments, memory freed by a trace is reused by the next captures
+    class Context final : public IContext
+    {
+    public:
+        Context()
+            : mPool(std::make_shared<SegmentPool>())
+        {
+        }
+
+        virtual ITrace& createTrace()
+        {
+            return *new Trace(mPool);
+        }
+
+        virtual void destroyTrace(ITrace& trace)
+        {
+            delete static_cast<Trace*>(&trace);
+        }
+
+        virtual void loadTrace(ITrace& trace, IStream& stream)
+        {
+            static_cast<Trace&>(trace).load(stream);
+        }
+
+        virtual bool mapTrace(ITrace& trace, const char* path) override
+        {
+            return static_cast<Trace&>(trace).map(path);
+        }
+
+        virtual void saveTrace(const ITrace& trace, IStream& stream)
+        {
+            static_cast<const Trace&>(trace).save(stream);
+        }
+
+        virtual ICapture& startCapture(ICaptureDevice& device, ITrace& trace) override
+        {
+            return startCapture(device, trace, CaptureSettings());
+        }
+
+        virtual ICapture& startCapture(ICaptureDevice& device, ITrace& trace, const CaptureSettings& settings) override
+        {
+            auto devices = &device;
+            return startCaptureGroup(&devices, 1, trace, settings).getCapture(0);
+        }
+
+        virtual void stopCapture(ICapture& capture) override
+        {
+            stopCaptureGroup(static_cast<Capture&>(capture).getGroup());
+        }
+
+        virtual ICaptureGroup& startCaptureGroup(ICaptureDevice* const* devices, uint32_t deviceCount, ITrace& trace, const CaptureSettings& settings) override
+        {
+            return *(new CaptureGroup(devices, deviceCount, static_cast<Trace&>(trace), settings));
+        }
+
+        virtual void stopCaptureGroup(ICaptureGroup& group) override
+        {
+            auto impl = static_cast<CaptureGroup*>(&group);
+            impl->stop();
+            delete impl;
+        }
+
+        virtual IReplayer& startReplay(IReplayDevice& device, IReplay& replay, const ITrace& trace) override
+        {
+            return *(new Replayer(device, replay, static_cast<const Trace&>(trace), 0));
+        }
+
+        virtual IReplayer& startReplay(IReplayDevice& device, IReplay& replay, const ITrace& trace, uint64_t instruction) override
+        {
+            auto& replayer = startReplay(device, replay, trace);
+            replayer.seek(instruction);
+            return replayer;
+        }
+
+        virtual void stopReplay(IReplayer& replayer) override
+        {
+            delete static_cast<Replayer*>(&replayer);
+        }
+
+        virtual IReplayer& startGroupReplay(IReplayDevice* const* devices, IReplay* const* replays, uint32_t deviceCount, const ITrace& trace) override
+        {
+            return *(new GroupReplayer(devices, replays, deviceCount, static_cast<const Trace&>(trace)));
+        }
+
+        virtual void stopGroupReplay(IReplayer& replayer) override
+        {
+            delete static_cast<GroupReplayer*>(&replayer);
+        }
+
+        virtual ReplayStatus verifyTrace(const ITrace& trace, IReplayFactory& factory, const VerifySettings& settings, VerifyResult& result) override
+        {
+            Verifier verifier(static_cast<const Trace&>(trace), factory, settings);
+            return verifier.run(result);
+        }
+
+        virtual bool diffTraces(const ITrace& left, const ITrace& right, uint32_t stream, DiffResult& result) override
+        {
+            TraceDiff diff(static_cast<const Trace&>(left), static_cast<const Trace&>(right), stream);
+            return diff.run(result);
+        }
+
+        virtual bool scanAccesses(const ITrace& trace, const AccessQuery& query, IAccessScan& scan) override
+        {
+            AccessScanner scanner(static_cast<const Trace&>(trace), query, scan);
+            return scanner.run();
+        }
+
+        virtual bool analyzeTrace(const ITrace& trace, const AnalyticsSettings& settings, ITraceAnalytics& analytics, AnalyticsResult& result) override
+        {
+            TraceAnalyzer analyzer(static_cast<const Trace&>(trace), settings, analytics);
+            return analyzer.run(result);
+        }
+
+    private:
+        std::shared_ptr<SegmentPool>    mPool;
     };
 }
 
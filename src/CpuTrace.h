@@ -1,10 +1,11 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 namespace CpuTrace
 {
-    const uint32_t Version = 1;
+    const uint32_t Version = 10;
 
     class IStream
     {
@@ -22,6 +23,106 @@ namespace CpuTrace
     public:
     };
 
+    // Kinds of records of a trace as reported by diffs, scans and capture statistics
+    enum class RecordCommand : uint32_t
+    {
+        // Past the last record of a trace
+        End,
+        State,
+        Execute,
+        Interrupt,
+        Signal,
+        Sync,
+        Read8,
+        Read16,
+        Read32,
+        Write8,
+        Write16,
+        Write32,
+    };
+
+    struct WriterStats
+    {
+        // Chunks and bytes handed to the stream so far, and bytes before compression
+        uint64_t    chunkCount;
+        uint64_t    byteCount;
+        uint64_t    rawByteCount;
+        // Total time in nanoseconds spent compressing chunks
+        uint64_t    compressTime;
+        // Number of times and total time in nanoseconds the capture waited for a free buffer
+        uint64_t    blockedCount;
+        uint64_t    blockedTime;
+        // Total time in nanoseconds spent writing to the stream
+        uint64_t    writeTime;
+        // Filled buffers waiting to be written, now and at worst
+        uint32_t    queueDepth;
+        uint32_t    maxQueueDepth;
+        uint32_t    bufferCount;
+    };
+
+    struct ReplayStats
+    {
+        uint64_t    instructionCount;
+        uint64_t    recordCount;
+        uint64_t    skippedCount;
+        // Number of states that did not match and index of the first and last instructions that did not match
+        uint64_t    divergenceCount;
+        uint64_t    firstDivergence;
+        uint64_t    lastDivergence;
+        // Instruction of the last state that matched before the first and last divergences, the state went wrong in between
+        uint64_t    firstDivergenceStart;
+        uint64_t    lastDivergenceStart;
+        // Number of states checked against a hash or a state delta
+        uint64_t    verifiedCount;
+        // Code blocks defined and repeated by compact traces, instructions they covered and share of repeats
+        uint64_t    blockDefinitionCount;
+        uint64_t    blockRepeatCount;
+        uint64_t    blockInstructionCount;
+        double      blockHitRate;
+        // Total time in nanoseconds spent replaying
+        uint64_t    time;
+        double      instructionsPerSecond;
+    };
+
+    enum class ReplayStatus : uint32_t
+    {
+        Paused,
+        Completed,
+        Diverged,
+        Invalid,
+    };
+
+    // Capture statistics are gathered unless this is defined to 0, ICapture::getStats then returns zeros
+#ifndef CPUTRACE_CAPTURE_STATS
+#define CPUTRACE_CAPTURE_STATS 1
+#endif
+
+    // Counters of a capture, kept by the thread recording it
+    struct CaptureStats
+    {
+        static const uint32_t CommandCount = static_cast<uint32_t>(RecordCommand::Write32) + 1;
+        static const uint32_t LatencyBucketCount = 20;
+
+        // Records by command and bytes the encoder emitted while writing them, accesses of batches count one by one.
+        // State records are the full states written on start, after invalidation and for keyframes.
+        uint64_t    recordCount[CommandCount];
+        uint64_t    byteCount[CommandCount];
+        // Bytes written by inlined front ends (see beginWrite), not split by command
+        uint64_t    directByteCount;
+        // Calls reading the state of the device and hashing it, with their total time in nanoseconds estimated from one
+        // call in 64
+        uint64_t    getStateCount;
+        uint64_t    getStateTime;
+        uint64_t    hashCount;
+        uint64_t    hashTime;
+        // Chunks handed to the writer, the ones flushed because the buffer was full and the total time in nanoseconds
+        uint64_t    flushCount;
+        uint64_t    fullBufferCount;
+        uint64_t    flushTime;
+        // Flushes by latency, bucket i counts the ones under 2^i microseconds not in the previous bucket, the last one all the others
+        uint64_t    flushLatency[LatencyBucketCount];
+    };
+
     class ICapture
     {
     public:
@@ -35,18 +136,79 @@ namespace CpuTrace
         virtual void write8(uint32_t addr, uint32_t value, uint32_t type) = 0;
         virtual void write16(uint32_t addr, uint32_t value, uint32_t type) = 0;
         virtual void write32(uint32_t addr, uint32_t value, uint32_t type) = 0;
+        // Batches of count accesses of size bytes each (1, 2 or 4) with their values packed in data, such as DMA transfers.
+        // Ranges access consecutive addresses from addr, gathers and scatters access the addresses in addrs.
+        virtual void readRange(uint32_t addr, const void* data, uint32_t size, uint32_t count, uint32_t type) = 0;
+        virtual void writeRange(uint32_t addr, const void* data, uint32_t size, uint32_t count, uint32_t type) = 0;
+        virtual void readGather(const uint32_t* addrs, const void* data, uint32_t size, uint32_t count, uint32_t type) = 0;
+        virtual void writeScatter(const uint32_t* addrs, const void* data, uint32_t size, uint32_t count, uint32_t type) = 0;
+        // Records the time reached by the device, in any unit that increases on all devices of a capture group, so replay can merge their streams.
+        virtual void sync(uint64_t time) = 0;
+        virtual void getWriterStats(WriterStats& stats) = 0;
+        virtual void getStats(CaptureStats& stats) = 0;
+        // Gives out the free part of the record buffer to an inlined front end (see CaptureWriter.h), at least room for one access record.
+        // Returns false when records have to go through the methods above.
+        virtual bool beginWrite(uint8_t*& begin, uint8_t*& end) = 0;
+        // Takes the buffer back up to the first byte not written, required before calling any other method.
+        virtual void endWrite(uint8_t* pos) = 0;
+        // Takes the buffer back, executes and gives out the free part again, returns false like beginWrite.
+        virtual bool executeWrite(uint8_t*& pos, uint8_t*& end) = 0;
+        // Writes the chunks kept by a ring capture (see CaptureSettings::ringSize) as a trace of their own, the capture goes on.
+        // It closes the current chunk, so it must be called from the thread recording the capture, which waits for the stream
+        // while the other captures keep writing. Returns false when the capture does not keep its chunks.
+        virtual bool dump(IStream& stream) = 0;
+    };
+
+    // Devices captured together into one trace, each recording its own stream from its own thread without sharing buffers.
+    class ICaptureGroup
+    {
+    public:
+        virtual uint32_t getStreamCount() const = 0;
+        // Capture of a stream, only to be used from one thread at a time.
+        virtual ICapture& getCapture(uint32_t stream) = 0;
     };
 
     class IReplay
     {
     public:
         virtual void syncState(const void* state, size_t size) = 0;
+        virtual void interrupt(uint32_t type) = 0;
+        virtual void signal(uint32_t type) = 0;
         virtual void read8(uint32_t addr, uint32_t value, uint32_t type) = 0;
         virtual void read16(uint32_t addr, uint32_t value, uint32_t type) = 0;
         virtual void read32(uint32_t addr, uint32_t value, uint32_t type) = 0;
         virtual void write8(uint32_t addr, uint32_t value, uint32_t type) = 0;
         virtual void write16(uint32_t addr, uint32_t value, uint32_t type) = 0;
         virtual void write32(uint32_t addr, uint32_t value, uint32_t type) = 0;
+        // Batches recorded by ICapture, split in pieces of at most a few hundred accesses. Data is not aligned.
+        // Batches holding accesses the device skips are replayed one access at a time.
+        virtual void readRange(uint32_t addr, const void* data, uint32_t size, uint32_t count, uint32_t type) = 0;
+        virtual void writeRange(uint32_t addr, const void* data, uint32_t size, uint32_t count, uint32_t type) = 0;
+        virtual void readGather(const uint32_t* addrs, const void* data, uint32_t size, uint32_t count, uint32_t type) = 0;
+        virtual void writeScatter(const uint32_t* addrs, const void* data, uint32_t size, uint32_t count, uint32_t type) = 0;
+    };
+
+    // Addresses from first to last included
+    struct AddressRange
+    {
+        uint32_t    first;
+        uint32_t    last;
+    };
+
+    enum class SkipMode : uint32_t
+    {
+        Replay,
+        Skip,
+        // Decided for each access by IReplayDevice::canSkip
+        Dynamic,
+    };
+
+    // Receives the skip rules of a replay device, a rule takes precedence over the rules added before it
+    class ISkipRules
+    {
+    public:
+        // Applies to the accesses within the range whose type has its bit set in types. Types from 32 are always dynamic.
+        virtual void add(const AddressRange& range, uint32_t types, SkipMode mode) = 0;
     };
 
     class IDevice
@@ -70,6 +232,327 @@ namespace CpuTrace
     public:
         virtual void loadState(const void* state, size_t size) = 0;
         virtual bool canSkip(uint32_t addr, uint32_t value, uint32_t type) = 0;
+        // Called when a replay starts, accesses not covered by a rule are dynamic. The replay only calls canSkip for dynamic
+        // accesses and looks up the others in tables of pages built from the rules.
+        virtual void getSkipRules(ISkipRules& rules) = 0;
+        // Executes one instruction, consuming the memory accesses received through IReplay since the last one.
+        virtual void execute() = 0;
+    };
+
+    class IReplayer
+    {
+    public:
+        // Replays up to the given number of instructions, stopping early on the first divergence. When it stops on the count,
+        // the device has executed every instruction before getInstruction().
+        virtual ReplayStatus run(uint64_t instructionCount) = 0;
+        // Restarts from the closest keyframe at or before the instruction and replays up to it, the device then holds the
+        // state before the instruction.
+        virtual ReplayStatus seek(uint64_t instruction) = 0;
+        // Index of the next instruction to be replayed.
+        virtual uint64_t getInstruction() const = 0;
+        virtual void getStats(ReplayStats& stats) const = 0;
+    };
+
+    class IReplayFactory
+    {
+    public:
+        virtual IReplayDevice& createDevice() = 0;
+        virtual IReplay& getReplay(IReplayDevice& device) = 0;
+        virtual void destroyDevice(IReplayDevice& device) = 0;
+    };
+
+    struct VerifySettings
+    {
+        VerifySettings()
+            : threadCount(0)
+            , segmentSize(0)
+            , stream(0)
+        {
+        }
+
+        // Number of worker threads, 0 to use all hardware threads.
+        uint32_t    threadCount;
+        // Minimum number of instructions per segment, consecutive keyframes are merged up to this size.
+        uint64_t    segmentSize;
+        // Stream of a trace captured from a group of devices.
+        uint32_t    stream;
+    };
+
+    struct VerifyResult
+    {
+        ReplayStatus    status;
+        uint64_t        instructionCount;
+        uint64_t        recordCount;
+        uint64_t        firstDivergence;
+        uint64_t        firstDivergenceStart;
+        uint32_t        segmentCount;
+        uint32_t        threadCount;
+        // Total time in nanoseconds
+        uint64_t        time;
+        double          instructionsPerSecond;
+    };
+
+    // Record compared by a diff, accesses of batches are compared one by one and keyframes left out
+    struct DiffRecord
+    {
+        RecordCommand   command;
+        // Instruction started by an execute record or following a state record, the instruction being executed otherwise
+        uint64_t        instruction;
+        uint32_t        addr;
+        // Value of an access, type of an interrupt or a signal
+        uint32_t        value;
+        // Type of an access
+        uint32_t        type;
+        // Time of a sync, hash of a state, hash of the state or delta verified by an execute record (0 without one)
+        uint64_t        data;
+    };
+
+    struct DiffResult
+    {
+        bool            different;
+        // First records that differ in each trace
+        DiffRecord      records[2];
+        // Records found the same after the chunks skipped
+        uint64_t        recordCount;
+        // Chunks found identical from their hashes and chunks decoded in both traces
+        uint32_t        skippedChunkCount;
+        uint32_t        decodedChunkCount;
+        // Total time in nanoseconds
+        uint64_t        time;
+    };
+
+    // Memory accesses selected by a scan of a stream, accesses of batches are selected one by one
+    struct AccessQuery
+    {
+        AccessQuery()
+            : accessTypes(~0u)
+            , reads(true)
+            , writes(true)
+            , stream(0)
+        {
+            range.first = 0;
+            range.last = UINT32_MAX;
+        }
+
+        AddressRange    range;
+        // Bit i for type i, types from 32 are always selected
+        uint32_t        accessTypes;
+        bool            reads;
+        bool            writes;
+        uint32_t        stream;
+    };
+
+    class IAccessScan
+    {
+    public:
+        // Access selected by a scan (RecordCommand::Read8 to RecordCommand::Write32) and the instruction executing it
+        virtual void access(uint64_t instruction, RecordCommand command, uint32_t addr, uint32_t value, uint32_t type) = 0;
+    };
+
+    // Single pass over a stream counting its records without replaying them (see IContext::analyzeTrace)
+    struct AnalyticsSettings
+    {
+        static const uint32_t DefaultCounterCount = 64 * 1024;
+
+        AnalyticsSettings()
+            : stream(0)
+            , pageShift(12)
+            , hotCodeCount(32)
+            , counterCount(DefaultCounterCount)
+        {
+        }
+
+        uint32_t    stream;
+        // Pages of the heatmap span 1 << pageShift bytes, up to 31
+        uint32_t    pageShift;
+        // Most fetched code addresses reported
+        uint32_t    hotCodeCount;
+        // Code addresses and pages counted at once. The least counted ones are dropped to make room so memory stays bounded,
+        // their counts are then short by at most the errors of the result.
+        uint32_t    counterCount;
+    };
+
+    struct AnalyticsResult
+    {
+        static const uint32_t TypeCount = 32;
+        static const uint32_t GapBucketCount = 65;
+
+        uint64_t    instructionCount;
+        // Records by command, accesses of batches count one by one
+        uint64_t    recordCount[CaptureStats::CommandCount];
+        // Accesses, interrupts and signals by type, types from 31 are counted together in the last entry
+        uint64_t    readCount[TypeCount];
+        uint64_t    writeCount[TypeCount];
+        uint64_t    interruptCount[TypeCount];
+        uint64_t    signalCount[TypeCount];
+        // State records, keyframes among them, and instructions between consecutive state records by power of two, bucket i
+        // counting the gaps under 2^i not in the previous bucket
+        uint64_t    stateCount;
+        uint64_t    keyframeCount;
+        uint64_t    stateGaps[GapBucketCount];
+        uint64_t    maxStateGap;
+        // Counts reported for code addresses and pages are short of the real ones by at most these
+        uint64_t    codeCountError;
+        uint64_t    pageCountError;
+        uint32_t    chunkCount;
+        // Total time in nanoseconds
+        uint64_t    time;
+        double      instructionsPerSecond;
+    };
+
+    class ITraceAnalytics
+    {
+    public:
+        // Code addresses fetched the most (CaptureSettings::codeType), from the most fetched
+        virtual void hotCode(uint32_t addr, uint64_t count) = 0;
+        // Accesses of a page by type in increasing order of address and type, types from 31 being counted together
+        virtual void pageAccesses(uint32_t page, uint32_t type, uint64_t readCount, uint64_t writeCount) = 0;
+    };
+
+    enum class Encoding : uint32_t
+    {
+        // 32-bit aligned records with full addresses and values
+        Raw,
+        // Byte oriented records with packed headers, address deltas and variable length values
+        Compact,
+        // Raw records stored per chunk in columns of commands, access types, addresses, values, state hashes and other records,
+        // so accesses can be scanned without decoding records (see IContext::scanAccesses)
+        Columnar,
+    };
+
+    enum class StateHash : uint32_t
+    {
+        // Full hash of the state after each instruction
+        Murmur3,
+        // Rolling hash only updated with the state words that changed
+        Incremental,
+    };
+
+    enum class VerifyMode : uint32_t
+    {
+        // Hash of the state at every instruction
+        Every,
+        // Hash of the state every interval instructions
+        Interval,
+        // Hash of the state after branches and interrupts, and at least every interval instructions when not 0
+        Events,
+        // State words that changed at every instruction, compared exactly by the replay
+        Delta,
+    };
+
+    // How much of the state the trace records to detect divergences, a divergence is located between the last two states verified.
+    struct VerifyPolicy
+    {
+        VerifyPolicy()
+            : mode(VerifyMode::Every)
+            , interval(0)
+        {
+        }
+
+        VerifyMode  mode;
+        uint32_t    interval;
+    };
+
+    enum class TriggerType : uint32_t
+    {
+        None,
+        // Instruction fetch (CaptureSettings::codeType) within the range
+        Code,
+        // Write to an address within the range
+        Write,
+        // Instruction of the device reached, counted from the start of the capture
+        Instruction,
+    };
+
+    struct CaptureTrigger
+    {
+        CaptureTrigger()
+            : type(TriggerType::None)
+            , range()
+            , instruction(0)
+        {
+        }
+
+        TriggerType     type;
+        AddressRange    range;
+        uint64_t        instruction;
+    };
+
+    // Events a capture records. Windows of instructions are opened by the start trigger and closed by the stop trigger, each
+    // one starting with a full state record, and they open and close at the next instruction after the trigger. The capture
+    // records from the start without a start trigger. Traces missing accesses only replay on devices that do not need them.
+    struct CaptureFilter
+    {
+        CaptureFilter()
+            : ranges(nullptr)
+            , rangeCount(0)
+            , accessTypes(~0u)
+            , interrupts(true)
+            , signals(true)
+            , start()
+            , stop()
+        {
+        }
+
+        // Memory accesses recorded by address, all of them without ranges. The ranges are copied when the capture starts. Beyond
+        // 16384 of them, they are merged and the closest ones are joined, recording the accesses in between.
+        const AddressRange* ranges;
+        uint32_t            rangeCount;
+        // Memory accesses recorded by type, bit i for type i. Types from 32 are always recorded.
+        uint32_t            accessTypes;
+        bool                interrupts;
+        bool                signals;
+        CaptureTrigger      start;
+        CaptureTrigger      stop;
+    };
+
+    struct CaptureSettings
+    {
+        static const size_t DefaultChunkSize = 1024 * 1024;
+        static const size_t DefaultWriterBufferCount = 4;
+
+        CaptureSettings()
+            : stream(nullptr)
+            , chunkSize(DefaultChunkSize)
+            , writerThread(false)
+            , writerBufferCount(DefaultWriterBufferCount)
+            , keyframeInterval(0)
+            , keyframeSize(0)
+            , encoding(Encoding::Raw)
+            , codeType(1)
+            , compressionLevel(0)
+            , stateHash(StateHash::Murmur3)
+            , verifyPolicy()
+            , ringSize(0)
+            , filter()
+            , chunkHashes(true)
+        {
+        }
+
+        // When set, chunks are written to this stream as they fill up and the trace only keeps the chunk table.
+        IStream*        stream;
+        // Size in bytes of the buffer used to accumulate records before they are written.
+        size_t          chunkSize;
+        // Write chunks from a dedicated thread so stream latency does not stall the capture.
+        bool            writerThread;
+        // Number of chunk buffers shared between the capture and the writer thread (at least 2).
+        size_t          writerBufferCount;
+        // Force a full state record after this many instructions or bytes (0 to disable) so replay can seek.
+        uint64_t        keyframeInterval;
+        uint64_t        keyframeSize;
+        Encoding        encoding;
+        // Access type of instruction fetches (ARM::MemoryAccess::Code), predicted by the compact encoding.
+        uint32_t        codeType;
+        // Compress each chunk before it is written, from 1 (fastest) to 9 (smallest), 0 to disable.
+        uint32_t        compressionLevel;
+        StateHash       stateHash;
+        VerifyPolicy    verifyPolicy;
+        // Keep only the most recent chunks of each device up to this many bytes in memory (0 to disable). Each chunk starts
+        // with a keyframe so the chunks kept can be replayed on their own, they are written when the capture stops or is dumped.
+        uint64_t        ringSize;
+        CaptureFilter   filter;
+        // Store a hash of the content of each chunk so diffs skip the chunks two traces share (see IContext::diffTraces).
+        bool            chunkHashes;
     };
 
     class IContext
@@ -78,9 +561,33 @@ namespace CpuTrace
         virtual ITrace& createTrace() = 0;
         virtual void destroyTrace(ITrace& trace) = 0;
         virtual void loadTrace(ITrace& trace, IStream& stream) = 0;
+        // Maps a trace file in memory instead of reading it, the file must stay unchanged until the trace is destroyed or cleared.
+        virtual bool mapTrace(ITrace& trace, const char* path) = 0;
         virtual void saveTrace(const ITrace& trace, IStream& stream) = 0;
         virtual ICapture& startCapture(ICaptureDevice& device, ITrace& trace) = 0;
+        virtual ICapture& startCapture(ICaptureDevice& device, ITrace& trace, const CaptureSettings& settings) = 0;
         virtual void stopCapture(ICapture& capture) = 0;
+        // Captures several devices into one trace, stream i being recorded from devices[i].
+        virtual ICaptureGroup& startCaptureGroup(ICaptureDevice* const* devices, uint32_t deviceCount, ITrace& trace, const CaptureSettings& settings) = 0;
+        virtual void stopCaptureGroup(ICaptureGroup& group) = 0;
+        virtual IReplayer& startReplay(IReplayDevice& device, IReplay& replay, const ITrace& trace) = 0;
+        virtual IReplayer& startReplay(IReplayDevice& device, IReplay& replay, const ITrace& trace, uint64_t instruction) = 0;
+        virtual void stopReplay(IReplayer& replayer) = 0;
+        // Replays all streams of a group trace in the order of their sync times, instruction counts are summed over the streams.
+        virtual IReplayer& startGroupReplay(IReplayDevice* const* devices, IReplay* const* replays, uint32_t deviceCount, const ITrace& trace) = 0;
+        virtual void stopGroupReplay(IReplayer& replayer) = 0;
+        // Replays all keyframe segments of a trace concurrently, each worker using its own device from the factory.
+        virtual ReplayStatus verifyTrace(const ITrace& trace, IReplayFactory& factory, const VerifySettings& settings, VerifyResult& result) = 0;
+        // Finds the first record of a stream that differs between two traces. Chunks both traces share are skipped from their hashes
+        // when their records are encoded the same way, the traces are decoded from the start otherwise. Returns false when a trace
+        // cannot be decoded.
+        virtual bool diffTraces(const ITrace& left, const ITrace& right, uint32_t stream, DiffResult& result) = 0;
+        // Reports the memory accesses selected by a query in the order of the trace. Columnar traces are scanned a few records at
+        // a time from their columns, the others are decoded. Returns false when the trace cannot be decoded.
+        virtual bool scanAccesses(const ITrace& trace, const AccessQuery& query, IAccessScan& scan) = 0;
+        // Counts the records of a stream, its hot code and its accesses by page in one pass over the trace with bounded memory,
+        // never touching a device. Returns false when the trace cannot be decoded.
+        virtual bool analyzeTrace(const ITrace& trace, const AnalyticsSettings& settings, ITraceAnalytics& analytics, AnalyticsResult& result) = 0;
     };
 
     IContext& createContext();
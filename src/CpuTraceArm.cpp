@@ -1,5 +1,6 @@
 #include "CpuTraceArm.h"
 #include <algorithm>
+#include <cstring>
 #include <string>
 
 namespace
@@ -7,7 +8,7 @@ namespace
     using namespace CpuTrace;
     using namespace CpuTrace::ARM;
 
-    class CaptureDevice : public ICaptureDevice
+    class CaptureDevice final : public ICaptureDevice
     {
     public:
         CaptureDevice(const char* name, ICaptureHandler& handler)
@@ -33,6 +34,13 @@ namespace
 
         virtual void getState(void* state, size_t size)
         {
+            // Buffers of the full state size are filled in place, they hold 32-bit words only
+            if (size == sizeof(CpuTrace::ARM::State))
+            {
+                mHandler.getState(*static_cast<CpuTrace::ARM::State*>(state));
+                return;
+            }
+
             CpuTrace::ARM::State localState;
             mHandler.getState(localState);
             memcpy(state, &localState, std::min(size, sizeof(localState)));
@@ -52,6 +60,72 @@ namespace
         std::string         mName;
         ICaptureHandler&    mHandler;
     };
+
+    class ReplayDevice final : public IReplayDevice
+    {
+    public:
+        ReplayDevice(const char* name, IReplayHandler& handler)
+            : mName(name)
+            , mHandler(handler)
+        {
+        }
+
+        virtual const char* getName() override
+        {
+            return mName.c_str();
+        }
+
+        virtual uint32_t getVersion() override
+        {
+            return CpuTrace::ARM::Version;
+        }
+
+        virtual size_t getStateSize() override
+        {
+            return sizeof(CpuTrace::ARM::State);
+        }
+
+        virtual void getState(void* state, size_t size)
+        {
+            // Buffers of the full state size are filled in place, they hold 32-bit words only
+            if (size == sizeof(CpuTrace::ARM::State))
+            {
+                mHandler.getState(*static_cast<CpuTrace::ARM::State*>(state));
+                return;
+            }
+
+            CpuTrace::ARM::State localState;
+            mHandler.getState(localState);
+            memcpy(state, &localState, std::min(size, sizeof(localState)));
+        }
+
+        virtual void loadState(const void* state, size_t size)
+        {
+            CpuTrace::ARM::State localState;
+            memset(&localState, 0, sizeof(localState));
+            memcpy(&localState, state, std::min(size, sizeof(localState)));
+            mHandler.loadState(localState);
+        }
+
+        virtual bool canSkip(uint32_t addr, uint32_t value, uint32_t type)
+        {
+            return mHandler.canSkip(addr, value, type);
+        }
+
+        virtual void getSkipRules(ISkipRules& rules)
+        {
+            mHandler.getSkipRules(rules);
+        }
+
+        virtual void execute()
+        {
+            mHandler.execute();
+        }
+
+    private:
+        std::string         mName;
+        IReplayHandler&     mHandler;
+    };
 }
 
 namespace CpuTrace
@@ -67,5 +141,15 @@ namespace CpuTrace
         {
             delete &static_cast<CaptureDevice&>(device);
         }
+
+        IReplayDevice& createReplayDevice(const char* name, IReplayHandler& handler)
+        {
+            return *new ReplayDevice(name, handler);
+        }
+
+        void destroyReplayDevice(IReplayDevice& device)
+        {
+            delete &static_cast<ReplayDevice&>(device);
+        }
     }
 }
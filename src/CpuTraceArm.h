@@ -93,7 +93,20 @@ namespace CpuTrace
             virtual void getState(State& state) = 0;
         };
 
+        struct IReplayHandler
+        {
+        public:
+            virtual void loadState(const State& state) = 0;
+            virtual void getState(State& state) = 0;
+            virtual bool canSkip(uint32_t addr, uint32_t value, uint32_t type) = 0;
+            virtual void getSkipRules(ISkipRules& rules) = 0;
+            virtual void execute() = 0;
+        };
+
         ICaptureDevice& createCaptureDevice(const char* name, ICaptureHandler& handler);
         void destroyCaptureDevice(ICaptureDevice& device);
+
+        IReplayDevice& createReplayDevice(const char* name, IReplayHandler& handler);
+        void destroyReplayDevice(IReplayDevice& device);
     }
 }
\ No newline at end of file
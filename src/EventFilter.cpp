@@ -0,0 +1,143 @@
+#include "EventFilter.h"
+#include <algorithm>
+
+namespace
+{
+    using namespace CpuTrace;
+    using namespace CpuTrace::Impl;
+
+    const uint32_t PageSize = 1u << EventFilter::PageShift;
+    const uint32_t PageCount = 1u << (32 - EventFilter::PageShift);
+
+    bool isAddressTrigger(const CaptureTrigger& trigger)
+    {
+        return (trigger.type == TriggerType::Code) || (trigger.type == TriggerType::Write);
+    }
+}
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        EventFilter::EventFilter(const CaptureFilter& filter, uint32_t codeType)
+            : mStart(filter.start)
+            , mStop(filter.stop)
+            , mInstruction(0)
+            , mAccessTypes(filter.accessTypes)
+            , mCodeType(codeType)
+            , mInterrupts(filter.interrupts)
+            , mSignals(filter.signals)
+            , mInstructionTrigger((filter.start.type == TriggerType::Instruction) || (filter.stop.type == TriggerType::Instruction))
+            , mAddressTrigger(isAddressTrigger(filter.start) || isAddressTrigger(filter.stop))
+            , mRecording(filter.start.type == TriggerType::None)
+            , mToggle(false)
+            , mEmpty(false)
+        {
+            // Ranges are sorted and merged so a page is only fully covered by a single range
+            mRanges = mergeRanges(filter);
+            if (!mRanges.empty())
+            {
+                mRangePages.resize(PageCount / 16, 0);
+                for (const auto& range : mRanges)
+                {
+                    for (uint32_t page = range.first >> PageShift; page <= (range.last >> PageShift); ++page)
+                    {
+                        auto begin = page << PageShift;
+                        auto bits = (range.first <= begin) && (range.last >= begin + (PageSize - 1)) ? 3u : 1u;
+                        mRangePages[page >> 4] |= bits << ((page & 15) * 2);
+                    }
+                }
+            }
+
+            if (mAddressTrigger)
+            {
+                mTriggerPages.resize(PageCount / 32, 0);
+                addTriggerPages(mStart);
+                addTriggerPages(mStop);
+            }
+
+            mEmpty = mRanges.empty() && (mAccessTypes == ~0u) && mInterrupts && mSignals && mRecording && (mStop.type == TriggerType::None);
+        }
+
+        std::vector<AddressRange> EventFilter::mergeRanges(const CaptureFilter& filter)
+        {
+            std::vector<AddressRange> ranges;
+            if (filter.ranges)
+                ranges.assign(filter.ranges, filter.ranges + filter.rangeCount);
+            std::sort(ranges.begin(), ranges.end(), [](const AddressRange& left, const AddressRange& right) { return left.first < right.first; });
+            std::vector<AddressRange> merged;
+            for (const auto& range : ranges)
+            {
+                if (range.first > range.last)
+                    continue;
+                if (!merged.empty() && (range.first <= static_cast<uint64_t>(merged.back().last) + 1))
+                    merged.back().last = std::max(merged.back().last, range.last);
+                else
+                    merged.push_back(range);
+            }
+            if (merged.size() <= MaxRangeCount)
+                return merged;
+
+            // Too many ranges, the smallest gaps are filled so the capture records more accesses rather than fewer
+            std::vector<uint32_t> gaps(merged.size() - 1);
+            for (size_t index = 0; index < gaps.size(); ++index)
+                gaps[index] = merged[index + 1].first - merged[index].last;
+            auto fillCount = merged.size() - MaxRangeCount;
+            auto sorted = gaps;
+            std::nth_element(sorted.begin(), sorted.begin() + (fillCount - 1), sorted.end());
+            auto threshold = sorted[fillCount - 1];
+            auto equalCount = fillCount - static_cast<size_t>(std::count_if(gaps.begin(), gaps.end(), [threshold](uint32_t gap) { return gap < threshold; }));
+
+            ranges.clear();
+            ranges.push_back(merged[0]);
+            for (size_t index = 0; index < gaps.size(); ++index)
+            {
+                auto fill = gaps[index] < threshold;
+                if (!fill && (gaps[index] == threshold) && equalCount)
+                {
+                    fill = true;
+                    --equalCount;
+                }
+                if (fill)
+                    ranges.back().last = merged[index + 1].last;
+                else
+                    ranges.push_back(merged[index + 1]);
+            }
+            return ranges;
+        }
+
+        bool EventFilter::findRange(uint32_t addr) const
+        {
+            auto next = std::upper_bound(mRanges.begin(), mRanges.end(), addr, [](uint32_t value, const AddressRange& range) { return value < range.first; });
+            return (next != mRanges.begin()) && (addr <= (next - 1)->last);
+        }
+
+        void EventFilter::checkTrigger(bool write, uint32_t addr, uint32_t size, uint32_t type)
+        {
+            const auto& trigger = getTrigger();
+            if (trigger.type == TriggerType::Write)
+            {
+                if (!write)
+                    return;
+            }
+            else if ((trigger.type != TriggerType::Code) || write || (type != mCodeType))
+            {
+                return;
+            }
+
+            if ((addr <= trigger.range.last) && (static_cast<uint64_t>(addr) + size > trigger.range.first))
+                mToggle = true;
+        }
+
+        void EventFilter::addTriggerPages(const CaptureTrigger& trigger)
+        {
+            if (!isAddressTrigger(trigger) || (trigger.range.first > trigger.range.last))
+                return;
+
+            // Accesses are looked up by the page of their first byte, those starting just before the range can still reach it
+            auto first = trigger.range.first > 3 ? trigger.range.first - 3 : 0;
+            for (uint32_t page = first >> PageShift; page <= (trigger.range.last >> PageShift); ++page)
+                mTriggerPages[page >> 5] |= 1u << (page & 31);
+        }
+    }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "CpuTrace.h"
+#include <vector>
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        // Decides which events of a capture are recorded (see CaptureFilter). Address ranges and trigger addresses are looked
+        // up in bitmaps of pages, so an access far from them is decided by a single bit test.
+        class EventFilter
+        {
+        public:
+            static const uint32_t PageShift = 12;
+            // Ranges are recorded in the header of the trace, which is limited to 65535 words with the streams
+            static const uint32_t MaxRangeCount = 16384;
+
+            EventFilter(const CaptureFilter& filter, uint32_t codeType);
+
+            // Sorted and merged ranges of a filter, the closest ones are joined down to MaxRangeCount
+            static std::vector<AddressRange> mergeRanges(const CaptureFilter& filter);
+
+            // True when every event is recorded, the other methods do not have to be called
+            bool isEmpty() const
+            {
+                return mEmpty;
+            }
+
+            bool isRecording() const
+            {
+                return mRecording;
+            }
+
+            // Called when an instruction starts, returns whether it is recorded
+            bool execute()
+            {
+                auto instruction = mInstruction++;
+                if (mInstructionTrigger && (instruction == getTrigger().instruction) && (getTrigger().type == TriggerType::Instruction))
+                    mToggle = true;
+                if (mToggle)
+                {
+                    mRecording = !mRecording;
+                    mToggle = false;
+                }
+                return mRecording;
+            }
+
+            // Returns whether a memory access is recorded, the access can fire a trigger for the next instruction
+            bool access(bool write, uint32_t addr, uint32_t size, uint32_t type)
+            {
+                if (mAddressTrigger && testBit(mTriggerPages, addr >> PageShift))
+                    checkTrigger(write, addr, size, type);
+                if (!mRecording || ((type < 32) && !((mAccessTypes >> type) & 1)))
+                    return false;
+                return mRanges.empty() || isInRange(addr);
+            }
+
+            bool interrupt() const
+            {
+                return mRecording && mInterrupts;
+            }
+
+            bool signal() const
+            {
+                return mRecording && mSignals;
+            }
+
+        private:
+            static bool testBit(const std::vector<uint32_t>& bits, uint32_t index)
+            {
+                return ((bits[index >> 5] >> (index & 31)) & 1) != 0;
+            }
+
+            // Trigger that changes the current state of the capture
+            const CaptureTrigger& getTrigger() const
+            {
+                return mRecording ? mStop : mStart;
+            }
+
+            bool isInRange(uint32_t addr) const
+            {
+                // Two bits per page: touched by a range and fully covered
+                auto page = addr >> PageShift;
+                auto bits = (mRangePages[page >> 4] >> ((page & 15) * 2)) & 3;
+                return (bits == 3) || ((bits == 1) && findRange(addr));
+            }
+
+            bool findRange(uint32_t addr) const;
+            void checkTrigger(bool write, uint32_t addr, uint32_t size, uint32_t type);
+            void addTriggerPages(const CaptureTrigger& trigger);
+
+            CaptureTrigger              mStart;
+            CaptureTrigger              mStop;
+            std::vector<AddressRange>   mRanges;
+            std::vector<uint32_t>       mRangePages;
+            std::vector<uint32_t>       mTriggerPages;
+            uint64_t                    mInstruction;
+            uint32_t                    mAccessTypes;
+            uint32_t                    mCodeType;
+            bool                        mInterrupts;
+            bool                        mSignals;
+            bool                        mInstructionTrigger;
+            bool                        mAddressTrigger;
+            bool                        mRecording;
+            bool                        mToggle;
+            bool                        mEmpty;
+        };
+    }
+}
@@ -1,12 +1,14 @@
 #pragma once
 
-#include "CpuTrace.h"
-#include <cstdio>
-
 #ifndef _CRT_SECURE_NO_WARNINGS
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#include "CpuTrace.h"
+#include <cstdio>
+#include <sys/stat.h>
+#include <sys/types.h>
+
 namespace CpuTrace
 {
     class FileStream : public IStream
@@ -26,36 +28,51 @@ namespace CpuTrace
 
         ~FileStream()
         {
-            if (mClose)
-                fclose(mFile);
+            close();
         }
 
         void close()
         {
             if (mFile)
             {
+                if (mClose)
+                    fclose(mFile);
                 mFile = nullptr;
-                fclose(mFile);
             }
         }
 
         virtual void seek(uint64_t offset) override
         {
+#if defined(_WIN32)
             _fseeki64(mFile, offset, SEEK_SET);
+#else
+            fseeko(mFile, static_cast<off_t>(offset), SEEK_SET);
+#endif
         }
 
+        // Buffered writes are flushed so the size of the file includes them
         virtual uint64_t size() const override
         {
-            uint64_t curPos = pos();
-            _fseeki64(mFile, 0, SEEK_END);
-            uint64_t size = pos();
-            _fseeki64(mFile, curPos, SEEK_SET);
-            return size;
+            fflush(mFile);
+#if defined(_WIN32)
+            struct _stat64 info;
+            if (_fstat64(_fileno(mFile), &info) != 0)
+                return 0;
+#else
+            struct stat info;
+            if (fstat(fileno(mFile), &info) != 0)
+                return 0;
+#endif
+            return static_cast<uint64_t>(info.st_size);
         }
 
         virtual uint64_t pos() const override
         {
+#if defined(_WIN32)
             return _ftelli64(mFile);
+#else
+            return static_cast<uint64_t>(ftello(mFile));
+#endif
         }
 
         virtual uint64_t write(const void* data, uint64_t size) override
@@ -64,8 +81,12 @@ namespace CpuTrace
             while (size > 0)
             {
                 size_t chunkSize = size > static_cast<uint64_t>(SIZE_MAX) ? SIZE_MAX : static_cast<size_t>(size);
-                total += fwrite(data, 1, chunkSize, mFile);
-                size -= chunkSize;
+                size_t ioSize = fwrite(data, 1, chunkSize, mFile);
+                total += ioSize;
+                data = static_cast<const uint8_t*>(data) + ioSize;
+                if (ioSize < chunkSize)
+                    break;
+                size -= ioSize;
             }
             return total;
         }
@@ -95,4 +116,4 @@ namespace CpuTrace
         FILE*   mFile;
         bool    mClose;
     };
-}
\ No newline at end of file
+}
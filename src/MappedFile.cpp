@@ -0,0 +1,144 @@
+#include "MappedFile.h"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+#if defined(_WIN32)
+        MappedFile::MappedFile()
+            : mData(nullptr)
+            , mSize(0)
+            , mFile(INVALID_HANDLE_VALUE)
+            , mMapping(nullptr)
+        {
+        }
+
+        bool MappedFile::open(const char* path)
+        {
+            close();
+
+            mFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (mFile == INVALID_HANDLE_VALUE)
+                return false;
+
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(mFile, &size))
+            {
+                close();
+                return false;
+            }
+            mSize = static_cast<uint64_t>(size.QuadPart);
+            if (!mSize)
+                return true;
+
+            mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mMapping)
+                mData = static_cast<const uint8_t*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+            if (!mData)
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void MappedFile::close()
+        {
+            if (mData)
+                UnmapViewOfFile(mData);
+            if (mMapping)
+                CloseHandle(mMapping);
+            if (mFile != INVALID_HANDLE_VALUE)
+                CloseHandle(mFile);
+            mData = nullptr;
+            mSize = 0;
+            mFile = INVALID_HANDLE_VALUE;
+            mMapping = nullptr;
+        }
+
+        void MappedFile::prefetch(uint64_t, uint64_t) const
+        {
+        }
+#else
+        MappedFile::MappedFile()
+            : mData(nullptr)
+            , mSize(0)
+        {
+        }
+
+        bool MappedFile::open(const char* path)
+        {
+            close();
+
+            int file = ::open(path, O_RDONLY);
+            if (file < 0)
+                return false;
+
+            struct stat info;
+            if (fstat(file, &info) != 0)
+            {
+                ::close(file);
+                return false;
+            }
+            mSize = static_cast<uint64_t>(info.st_size);
+            if (!mSize)
+            {
+                ::close(file);
+                return true;
+            }
+
+            // The mapping stays valid once the descriptor is closed
+            auto data = mmap(nullptr, static_cast<size_t>(mSize), PROT_READ, MAP_PRIVATE, file, 0);
+            ::close(file);
+            if (data == MAP_FAILED)
+            {
+                mSize = 0;
+                return false;
+            }
+            mData = static_cast<const uint8_t*>(data);
+            madvise(data, static_cast<size_t>(mSize), MADV_SEQUENTIAL);
+            return true;
+        }
+
+        void MappedFile::close()
+        {
+            if (mData)
+                munmap(const_cast<uint8_t*>(mData), static_cast<size_t>(mSize));
+            mData = nullptr;
+            mSize = 0;
+        }
+
+        void MappedFile::prefetch(uint64_t offset, uint64_t size) const
+        {
+            if (!mData || (offset >= mSize))
+                return;
+
+            // Advice ranges must start on a page boundary
+            auto pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+            auto begin = offset - offset % pageSize;
+            auto end = offset + size < mSize ? offset + size : mSize;
+            madvise(const_cast<uint8_t*>(mData) + begin, static_cast<size_t>(end - begin), MADV_WILLNEED);
+        }
+#endif
+
+        MappedFile::~MappedFile()
+        {
+            close();
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "CpuTrace.h"
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        // Read-only view of a whole file, pages are loaded by the system as they are touched
+        class MappedFile
+        {
+        public:
+            MappedFile();
+            ~MappedFile();
+
+            bool open(const char* path);
+            void close();
+
+            const uint8_t* getData() const
+            {
+                return mData;
+            }
+
+            uint64_t getSize() const
+            {
+                return mSize;
+            }
+
+            // Hints that a range is about to be read
+            void prefetch(uint64_t offset, uint64_t size) const;
+
+        private:
+            MappedFile(const MappedFile&);
+            MappedFile& operator=(const MappedFile&);
+
+            const uint8_t*  mData;
+            uint64_t        mSize;
+#if defined(_WIN32)
+            void*           mFile;
+            void*           mMapping;
+#endif
+        };
+    }
+}
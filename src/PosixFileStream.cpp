@@ -0,0 +1,323 @@
+#include "PosixFileStream.h"
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    // Alignment of the buffer, the offsets and the sizes of direct I/O
+    const size_t BlockSize = 4096;
+
+    uint64_t alignUp(uint64_t value)
+    {
+        return (value + BlockSize - 1) & ~static_cast<uint64_t>(BlockSize - 1);
+    }
+
+    bool writeAll(int file, const uint8_t* data, size_t size, uint64_t offset)
+    {
+        while (size)
+        {
+            auto count = pwrite(file, data, size, static_cast<off_t>(offset));
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += count;
+            size -= static_cast<size_t>(count);
+            offset += static_cast<uint64_t>(count);
+        }
+        return true;
+    }
+
+    size_t readAll(int file, uint8_t* data, size_t size, uint64_t offset)
+    {
+        size_t total = 0;
+        while (total < size)
+        {
+            auto count = pread(file, data + total, size - total, static_cast<off_t>(offset + total));
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            if (!count)
+                break;
+            total += static_cast<size_t>(count);
+        }
+        return total;
+    }
+}
+
+namespace CpuTrace
+{
+    PosixFileStream::PosixFileStream()
+        : mFile(-1)
+        , mMode(Mode::Read)
+        , mBuffer(nullptr)
+        , mBufferSize(0)
+        , mBufferOffset(0)
+        , mBufferCount(0)
+        , mPos(0)
+        , mSize(0)
+        , mReserved(0)
+        , mDirect(false)
+        , mPadded(false)
+    {
+    }
+
+    PosixFileStream::PosixFileStream(const char* path, Mode mode, const PosixFileSettings& settings)
+        : PosixFileStream()
+    {
+        open(path, mode, settings);
+    }
+
+    PosixFileStream::~PosixFileStream()
+    {
+        close();
+    }
+
+    bool PosixFileStream::open(const char* path, Mode mode, const PosixFileSettings& settings)
+    {
+        close();
+
+        int flags = (mode == Mode::Write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY) | O_CLOEXEC;
+#if defined(O_DIRECT)
+        if (settings.directIo)
+        {
+            mFile = ::open(path, flags | O_DIRECT, 0644);
+            mDirect = mFile >= 0;
+        }
+#endif
+        if (mFile < 0)
+            mFile = ::open(path, flags, 0644);
+        if (mFile < 0)
+            return false;
+
+        struct stat info;
+        void* buffer = nullptr;
+        mBufferSize = static_cast<size_t>(alignUp(std::max(settings.bufferSize, BlockSize)));
+        if ((fstat(mFile, &info) != 0) || (posix_memalign(&buffer, BlockSize, mBufferSize) != 0))
+        {
+            close();
+            return false;
+        }
+
+        mMode = mode;
+        mSettings = settings;
+        mBuffer = static_cast<uint8_t*>(buffer);
+        mSize = mode == Mode::Read ? static_cast<uint64_t>(info.st_size) : 0;
+#if defined(POSIX_FADV_SEQUENTIAL)
+        if ((mode == Mode::Read) && settings.readahead)
+            posix_fadvise(mFile, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        if (mode == Mode::Write)
+            reserve(settings.reserveSize);
+        return true;
+    }
+
+    void PosixFileStream::close()
+    {
+        if (mFile >= 0)
+        {
+            // Drops the padding of the last block and the space reserved past the end
+            if (mMode == Mode::Write)
+            {
+                writeBuffer();
+                if (mPadded || (mReserved > mSize))
+                {
+                    auto result = ftruncate(mFile, static_cast<off_t>(mSize));
+                    (void)result;
+                }
+            }
+            ::close(mFile);
+            mFile = -1;
+        }
+        free(mBuffer);
+        mBuffer = nullptr;
+        mBufferSize = 0;
+        mBufferOffset = 0;
+        mBufferCount = 0;
+        mPos = 0;
+        mSize = 0;
+        mReserved = 0;
+        mDirect = false;
+        mPadded = false;
+    }
+
+    void PosixFileStream::seek(uint64_t offset)
+    {
+        if ((mFile >= 0) && (mMode == Mode::Write) && (offset != mPos))
+        {
+            // Direct I/O writes whole blocks padded with zeros, which would overwrite the data after a seek back into the file.
+            // It only goes on from an aligned offset past everything written, the partial block kept is already on disk.
+            writeBuffer();
+            if (mDirect && ((offset % BlockSize) || (offset < size())))
+                disableDirectIo();
+            mBufferOffset = offset;
+            mBufferCount = 0;
+        }
+        mPos = offset;
+    }
+
+    uint64_t PosixFileStream::size() const
+    {
+        if (mMode == Mode::Write)
+            return std::max(mSize, mBufferOffset + mBufferCount);
+        return mSize;
+    }
+
+    uint64_t PosixFileStream::pos() const
+    {
+        return mPos;
+    }
+
+    uint64_t PosixFileStream::write(const void* data, uint64_t size)
+    {
+        if ((mFile < 0) || (mMode != Mode::Write))
+            return 0;
+
+        auto bytes = static_cast<const uint8_t*>(data);
+        uint64_t total = 0;
+        while (total < size)
+        {
+            // Large writes skip the buffer unless direct I/O needs them aligned
+            auto remaining = size - total;
+            if (!mBufferCount && !mDirect && (remaining >= mBufferSize))
+            {
+                reserve(mPos + remaining);
+                auto count = static_cast<size_t>(std::min(remaining, static_cast<uint64_t>(SIZE_MAX)));
+                if (!writeAll(mFile, bytes + total, count, mPos))
+                    break;
+                total += count;
+                mPos += count;
+                mBufferOffset = mPos;
+                mSize = std::max(mSize, mPos);
+                continue;
+            }
+
+            if ((mBufferCount == mBufferSize) && !writeBuffer())
+                break;
+            auto count = static_cast<size_t>(std::min(remaining, static_cast<uint64_t>(mBufferSize - mBufferCount)));
+            memcpy(mBuffer + mBufferCount, bytes + total, count);
+            mBufferCount += count;
+            total += count;
+            mPos += count;
+        }
+        return total;
+    }
+
+    uint64_t PosixFileStream::read(void* data, uint64_t size)
+    {
+        if ((mFile < 0) || (mMode != Mode::Read))
+            return 0;
+
+        auto bytes = static_cast<uint8_t*>(data);
+        uint64_t total = 0;
+        while ((total < size) && (mPos < mSize))
+        {
+            auto remaining = std::min(size - total, mSize - mPos);
+            if ((mPos >= mBufferOffset) && (mPos < mBufferOffset + mBufferCount))
+            {
+                auto offset = static_cast<size_t>(mPos - mBufferOffset);
+                auto count = static_cast<size_t>(std::min(remaining, static_cast<uint64_t>(mBufferCount - offset)));
+                memcpy(bytes + total, mBuffer + offset, count);
+                total += count;
+                mPos += count;
+                continue;
+            }
+
+            // Large reads skip the buffer unless direct I/O needs them aligned
+            if (!mDirect && (remaining >= mBufferSize))
+            {
+                auto count = readAll(mFile, bytes + total, static_cast<size_t>(std::min(remaining, static_cast<uint64_t>(SIZE_MAX))), mPos);
+                total += count;
+                mPos += count;
+                if (!count)
+                    break;
+                continue;
+            }
+
+            if (!readBuffer(mPos))
+                break;
+        }
+        return total;
+    }
+
+    void PosixFileStream::flush()
+    {
+        if ((mFile >= 0) && (mMode == Mode::Write))
+            writeBuffer();
+    }
+
+    // Direct I/O writes whole blocks, the last partial block stays in the buffer to be written again once it is complete
+    bool PosixFileStream::writeBuffer()
+    {
+        if (!mBufferCount)
+            return true;
+
+        size_t size = mBufferCount;
+        if (mDirect)
+        {
+            size = static_cast<size_t>(alignUp(size));
+            memset(mBuffer + mBufferCount, 0, size - mBufferCount);
+        }
+        reserve(mBufferOffset + size);
+        if (!writeAll(mFile, mBuffer, size, mBufferOffset))
+            return false;
+
+        mSize = std::max(mSize, mBufferOffset + mBufferCount);
+        size_t kept = mDirect ? mBufferCount % BlockSize : 0;
+        mPadded = mPadded || (kept != 0);
+        memmove(mBuffer, mBuffer + mBufferCount - kept, kept);
+        mBufferOffset += mBufferCount - kept;
+        mBufferCount = kept;
+        return true;
+    }
+
+    bool PosixFileStream::readBuffer(uint64_t offset)
+    {
+        mBufferOffset = offset & ~static_cast<uint64_t>(BlockSize - 1);
+        mBufferCount = readAll(mFile, mBuffer, mBufferSize, mBufferOffset);
+#if defined(POSIX_FADV_WILLNEED)
+        if (mSettings.readahead && (mBufferOffset + mBufferSize < mSize))
+            posix_fadvise(mFile, static_cast<off_t>(mBufferOffset + mBufferSize), static_cast<off_t>(mBufferSize), POSIX_FADV_WILLNEED);
+#endif
+        return offset < mBufferOffset + mBufferCount;
+    }
+
+    // Space is reserved without changing the size of the file, a file system without support stops being asked
+    void PosixFileStream::reserve(uint64_t size)
+    {
+#if defined(__linux__)
+        if (!mSettings.reserveSize || (size <= mReserved))
+            return;
+        auto reserved = std::max(size, mReserved + mSettings.reserveSize);
+        if (fallocate(mFile, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(reserved)) != 0)
+            mSettings.reserveSize = 0;
+        else
+            mReserved = reserved;
+#else
+        (void)size;
+#endif
+    }
+
+    void PosixFileStream::disableDirectIo()
+    {
+#if defined(O_DIRECT)
+        fcntl(mFile, F_SETFL, fcntl(mFile, F_GETFL) & ~O_DIRECT);
+#endif
+        mDirect = false;
+    }
+}
+
+#endif
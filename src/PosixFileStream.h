@@ -0,0 +1,85 @@
+#pragma once
+
+#include "CpuTrace.h"
+
+#if !defined(_WIN32)
+
+namespace CpuTrace
+{
+    struct PosixFileSettings
+    {
+        static const size_t DefaultBufferSize = 8 * 1024 * 1024;
+
+        PosixFileSettings()
+            : bufferSize(DefaultBufferSize)
+            , reserveSize(0)
+            , directIo(false)
+            , readahead(true)
+        {
+        }
+
+        // Size of the buffer writes are gathered in and reads are done through, rounded up to whole blocks.
+        size_t          bufferSize;
+        // Disk space allocated ahead of the writes in steps of this size (0 to let the file grow with each write).
+        uint64_t        reserveSize;
+        // Bypass the page cache, falls back to buffered I/O when the file system does not support it.
+        bool            directIo;
+        // Ask the system to read the next buffer of the file while the current one is consumed.
+        bool            readahead;
+    };
+
+    // File stream doing large block aligned reads and writes at explicit offsets, for capturing to and replaying from disk
+    class PosixFileStream : public IStream
+    {
+    public:
+        enum class Mode
+        {
+            Read,
+            Write,
+        };
+
+        PosixFileStream();
+        PosixFileStream(const char* path, Mode mode, const PosixFileSettings& settings = PosixFileSettings());
+        ~PosixFileStream();
+
+        bool open(const char* path, Mode mode, const PosixFileSettings& settings = PosixFileSettings());
+        void close();
+
+        bool isOpen() const
+        {
+            return mFile >= 0;
+        }
+
+        virtual void seek(uint64_t offset) override;
+        virtual uint64_t size() const override;
+        virtual uint64_t pos() const override;
+        virtual uint64_t write(const void* data, uint64_t size) override;
+        virtual uint64_t read(void* data, uint64_t size) override;
+        virtual void flush() override;
+
+    private:
+        PosixFileStream(const PosixFileStream&);
+        PosixFileStream& operator=(const PosixFileStream&);
+
+        bool writeBuffer();
+        bool readBuffer(uint64_t offset);
+        void reserve(uint64_t size);
+        void disableDirectIo();
+
+        // The buffer holds mBufferCount bytes of the file from mBufferOffset: data read ahead or writes not done yet
+        int                 mFile;
+        Mode                mMode;
+        PosixFileSettings   mSettings;
+        uint8_t*            mBuffer;
+        size_t              mBufferSize;
+        uint64_t            mBufferOffset;
+        size_t              mBufferCount;
+        uint64_t            mPos;
+        uint64_t            mSize;
+        uint64_t            mReserved;
+        bool                mDirect;
+        bool                mPadded;
+    };
+}
+
+#endif
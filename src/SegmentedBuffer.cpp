@@ -0,0 +1,144 @@
+#include "SegmentedBuffer.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    using namespace CpuTrace::Impl;
+
+    const uint64_t SegmentSize = SegmentPool::SegmentSize;
+}
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        SegmentPool::SegmentPool()
+        {
+        }
+
+        SegmentPool::~SegmentPool()
+        {
+            for (auto segment : mFree)
+                delete[] segment;
+        }
+
+        uint8_t* SegmentPool::allocate()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if (!mFree.empty())
+                {
+                    auto segment = mFree.back();
+                    mFree.pop_back();
+                    return segment;
+                }
+            }
+            return new uint8_t[SegmentSize];
+        }
+
+        void SegmentPool::release(uint8_t* segment)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mFree.push_back(segment);
+        }
+
+        SegmentedBuffer::SegmentedBuffer(const std::shared_ptr<SegmentPool>& pool)
+            : mPool(pool)
+            , mSize(0)
+        {
+        }
+
+        SegmentedBuffer::~SegmentedBuffer()
+        {
+            clear();
+        }
+
+        void SegmentedBuffer::clear()
+        {
+            for (auto segment : mSegments)
+                mPool->release(segment);
+            mSegments.clear();
+            mSize = 0;
+        }
+
+        void SegmentedBuffer::write(uint64_t offset, const void* data, size_t size)
+        {
+            if (offset > mSize)
+                copy(mSize, nullptr, offset - mSize);
+            copy(offset, static_cast<const uint8_t*>(data), size);
+        }
+
+        size_t SegmentedBuffer::read(uint64_t offset, void* data, size_t size) const
+        {
+            auto bytes = static_cast<uint8_t*>(data);
+            size_t count = 0;
+            while (count < size)
+            {
+                size_t available = 0;
+                auto segment = getSegment(offset + count, available);
+                if (!segment)
+                    break;
+                available = std::min(available, size - count);
+                memcpy(bytes + count, segment, available);
+                count += available;
+            }
+            return count;
+        }
+
+        const uint8_t* SegmentedBuffer::getSegment(uint64_t offset, size_t& size) const
+        {
+            if (offset >= mSize)
+            {
+                size = 0;
+                return nullptr;
+            }
+            auto pos = offset % SegmentSize;
+            size = static_cast<size_t>(std::min(SegmentSize - pos, mSize - offset));
+            return mSegments[static_cast<size_t>(offset / SegmentSize)] + pos;
+        }
+
+        uint8_t* SegmentedBuffer::reserve(size_t& size)
+        {
+            grow(mSize + 1);
+            auto pos = mSize % SegmentSize;
+            size = static_cast<size_t>(std::min<uint64_t>(size, SegmentSize - pos));
+            return mSegments[static_cast<size_t>(mSize / SegmentSize)] + pos;
+        }
+
+        void SegmentedBuffer::commit(size_t size)
+        {
+            mSize += size;
+        }
+
+        void SegmentedBuffer::grow(uint64_t size)
+        {
+            while (mSegments.size() * SegmentSize < size)
+                mSegments.push_back(mPool->allocate());
+        }
+
+        // Fills with zeros without data
+        void SegmentedBuffer::copy(uint64_t offset, const uint8_t* data, uint64_t size)
+        {
+            grow(offset + size);
+            while (size)
+            {
+                auto pos = offset % SegmentSize;
+                auto count = static_cast<size_t>(std::min(size, SegmentSize - pos));
+                auto segment = mSegments[static_cast<size_t>(offset / SegmentSize)] + pos;
+                if (data)
+                {
+                    memcpy(segment, data, count);
+                    data += count;
+                }
+                else
+                {
+                    memset(segment, 0, count);
+                }
+                offset += count;
+                size -= count;
+            }
+            mSize = std::max(mSize, offset);
+        }
+    }
+}
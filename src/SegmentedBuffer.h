@@ -0,0 +1,77 @@
+#pragma once
+
+#include "CpuTrace.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        // Fixed size segments of memory, released segments are kept for the next buffers instead of going back to the allocator
+        class SegmentPool
+        {
+        public:
+            static const size_t SegmentSize = 4 * 1024 * 1024;
+
+            SegmentPool();
+            ~SegmentPool();
+
+            uint8_t* allocate();
+            void release(uint8_t* segment);
+
+        private:
+            SegmentPool(const SegmentPool&);
+            SegmentPool& operator=(const SegmentPool&);
+
+            std::mutex              mMutex;
+            std::vector<uint8_t*>   mFree;
+        };
+
+        // Bytes held in segments of a pool, segments never move so growing the buffer never copies what was already written
+        class SegmentedBuffer
+        {
+        public:
+            explicit SegmentedBuffer(const std::shared_ptr<SegmentPool>& pool);
+            ~SegmentedBuffer();
+
+            const std::shared_ptr<SegmentPool>& getPool() const
+            {
+                return mPool;
+            }
+
+            uint64_t size() const
+            {
+                return mSize;
+            }
+
+            // Returns all segments to the pool
+            void clear();
+
+            // Copies bytes at an offset, writing past the end fills the gap with zeros
+            void write(uint64_t offset, const void* data, size_t size);
+
+            // Copies bytes at an offset up to the end of the buffer, returns the number of bytes copied
+            size_t read(uint64_t offset, void* data, size_t size) const;
+
+            // Returns the bytes from an offset up to the end of their segment or of the buffer
+            const uint8_t* getSegment(uint64_t offset, size_t& size) const;
+
+            // Returns room past the end of the buffer up to the end of its segment, commit adds the bytes filled to the buffer
+            uint8_t* reserve(size_t& size);
+            void commit(size_t size);
+
+        private:
+            SegmentedBuffer(const SegmentedBuffer&);
+            SegmentedBuffer& operator=(const SegmentedBuffer&);
+
+            void grow(uint64_t size);
+            void copy(uint64_t offset, const uint8_t* data, uint64_t size);
+
+            std::shared_ptr<SegmentPool>    mPool;
+            std::vector<uint8_t*>           mSegments;
+            uint64_t                        mSize;
+        };
+    }
+}
@@ -0,0 +1,138 @@
+#include "SkipTable.h"
+#include <algorithm>
+
+namespace
+{
+    using namespace CpuTrace;
+    using namespace CpuTrace::Impl;
+
+    const uint32_t TypeCount = 32;
+    const uint32_t PageSize = 1u << SkipTable::PageShift;
+    const uint32_t PageCount = 1u << (32 - SkipTable::PageShift);
+}
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        SkipTable::SkipTable()
+        {
+            std::fill(mTypeTables, mTypeTables + TypeCount, nullptr);
+        }
+
+        void SkipTable::add(const AddressRange& range, uint32_t types, SkipMode mode)
+        {
+            if ((range.first > range.last) || !types || (mode > SkipMode::Dynamic))
+                return;
+            Rule rule = { range, types, mode };
+            mRules.push_back(rule);
+        }
+
+        void SkipTable::compile()
+        {
+            mTables.clear();
+            std::vector<size_t> typeTables(TypeCount, SIZE_MAX);
+            for (uint32_t type = 0; type < TypeCount; ++type)
+            {
+                std::vector<size_t> rules;
+                for (size_t index = 0; index < mRules.size(); ++index)
+                {
+                    if ((mRules[index].mTypes >> type) & 1)
+                        rules.push_back(index);
+                }
+                if (rules.empty())
+                    continue;
+
+                auto table = std::find_if(mTables.begin(), mTables.end(), [&rules](const Table& other) { return other.mRules == rules; });
+                typeTables[type] = static_cast<size_t>(table - mTables.begin());
+                if (table == mTables.end())
+                {
+                    mTables.push_back(Table());
+                    mTables.back().mRules.swap(rules);
+                }
+            }
+
+            for (auto& table : mTables)
+                build(table);
+            for (uint32_t type = 0; type < TypeCount; ++type)
+                mTypeTables[type] = typeTables[type] == SIZE_MAX ? nullptr : &mTables[typeTables[type]];
+        }
+
+        SkipMode SkipTable::findMode(const Table& table, uint32_t addr)
+        {
+            return findInterval(table, addr)->mMode;
+        }
+
+        // The first interval starts at 0
+        std::vector<SkipTable::Interval>::const_iterator SkipTable::findInterval(const Table& table, uint32_t addr)
+        {
+            auto next = std::upper_bound(table.mIntervals.begin(), table.mIntervals.end(), addr, [](uint32_t value, const Interval& interval) { return value < interval.mFirst; });
+            return next - 1;
+        }
+
+        void SkipTable::build(Table& table) const
+        {
+            // The mode can only change where a rule starts or right after it ends
+            std::vector<uint64_t> bounds(1, 0);
+            for (auto index : table.mRules)
+            {
+                bounds.push_back(mRules[index].mRange.first);
+                bounds.push_back(static_cast<uint64_t>(mRules[index].mRange.last) + 1);
+            }
+            std::sort(bounds.begin(), bounds.end());
+            bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+            for (auto bound : bounds)
+            {
+                if (bound > UINT32_MAX)
+                    break;
+                auto addr = static_cast<uint32_t>(bound);
+                auto mode = SkipMode::Dynamic;
+                for (auto index : table.mRules)
+                {
+                    const auto& range = mRules[index].mRange;
+                    if ((range.first <= addr) && (addr <= range.last))
+                        mode = mRules[index].mMode;
+                }
+                if (table.mIntervals.empty() || (table.mIntervals.back().mMode != mode))
+                {
+                    Interval interval = { addr, mode };
+                    table.mIntervals.push_back(interval);
+                }
+            }
+
+            // Pages covered by a single interval take its mode, the others get a table of words while there are entries left
+            table.mPages.assign(PageCount, static_cast<uint8_t>(Search));
+            for (size_t index = 0; index < table.mIntervals.size(); ++index)
+            {
+                auto first = table.mIntervals[index].mFirst;
+                auto last = index + 1 < table.mIntervals.size() ? table.mIntervals[index + 1].mFirst - 1 : UINT32_MAX;
+                for (uint32_t page = first >> PageShift; page <= (last >> PageShift); ++page)
+                {
+                    auto begin = page << PageShift;
+                    if ((first <= begin) && (last >= begin + (PageSize - 1)))
+                        table.mPages[page] = static_cast<uint8_t>(table.mIntervals[index].mMode);
+                }
+            }
+
+            uint32_t wordTableCount = 0;
+            for (uint32_t page = 0; (page < PageCount) && (Mixed + wordTableCount < Search); ++page)
+            {
+                if (table.mPages[page] != Search)
+                    continue;
+                table.mPages[page] = static_cast<uint8_t>(Mixed + wordTableCount);
+                table.mWords.resize(++wordTableCount * WordTableSize, 0);
+                auto words = table.mWords.data() + table.mWords.size() - WordTableSize;
+                for (uint32_t word = 0; word < PageSize / sizeof(uint32_t); ++word)
+                {
+                    auto addr = (page << PageShift) + word * static_cast<uint32_t>(sizeof(uint32_t));
+                    auto next = findInterval(table, addr) + 1;
+                    auto mode = static_cast<uint32_t>((next - 1)->mMode);
+                    if ((next != table.mIntervals.end()) && (next->mFirst - addr < sizeof(uint32_t)))
+                        mode = Mixed;
+                    words[word >> 4] |= mode << ((word & 15) * 2);
+                }
+            }
+        }
+    }
+}
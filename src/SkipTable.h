@@ -0,0 +1,87 @@
+#pragma once
+
+#include "CpuTrace.h"
+#include <vector>
+
+namespace CpuTrace
+{
+    namespace Impl
+    {
+        // Skip rules of a replay device compiled into a table of pages per access type, types with the same rules share their
+        // table. Pages where the mode changes have a table of words of their own, words where the mode changes and pages past
+        // the last table of words are resolved from the sorted list of intervals of the rules.
+        class SkipTable : public ISkipRules
+        {
+        public:
+            static const uint32_t PageShift = 12;
+
+            SkipTable();
+
+            virtual void add(const AddressRange& range, uint32_t types, SkipMode mode) override;
+
+            // Builds the tables from the rules added so far
+            void compile();
+
+            SkipMode getMode(uint32_t addr, uint32_t type) const
+            {
+                if (type >= 32)
+                    return SkipMode::Dynamic;
+                auto table = mTypeTables[type];
+                if (!table)
+                    return SkipMode::Dynamic;
+
+                uint32_t mode = table->mPages[addr >> PageShift];
+                if (mode < Mixed)
+                    return static_cast<SkipMode>(mode);
+                if (mode != Search)
+                {
+                    // Two bits per word
+                    auto word = (addr & ((1u << PageShift) - 1)) >> 2;
+                    mode = (table->mWords[(mode - Mixed) * WordTableSize + (word >> 4)] >> ((word & 15) * 2)) & 3;
+                    if (mode < Mixed)
+                        return static_cast<SkipMode>(mode);
+                }
+                return findMode(*table, addr);
+            }
+
+        private:
+            // Page entries past the modes: index of a table of words from Mixed, Search without one
+            static const uint32_t Mixed = 3;
+            static const uint32_t Search = 0xff;
+            static const uint32_t WordTableSize = (1u << PageShift) / sizeof(uint32_t) / 16;
+
+            struct Rule
+            {
+                AddressRange    mRange;
+                uint32_t        mTypes;
+                SkipMode        mMode;
+            };
+
+            // Mode of the addresses from mFirst up to the first address of the next interval
+            struct Interval
+            {
+                uint32_t        mFirst;
+                SkipMode        mMode;
+            };
+
+            struct Table
+            {
+                std::vector<size_t>     mRules;
+                std::vector<Interval>   mIntervals;
+                std::vector<uint8_t>    mPages;
+                std::vector<uint32_t>   mWords;
+            };
+
+            SkipTable(const SkipTable&);
+            SkipTable& operator=(const SkipTable&);
+
+            static SkipMode findMode(const Table& table, uint32_t addr);
+            static std::vector<Interval>::const_iterator findInterval(const Table& table, uint32_t addr);
+            void build(Table& table) const;
+
+            std::vector<Rule>   mRules;
+            std::vector<Table>  mTables;
+            const Table*        mTypeTables[32];
+        };
+    }
+}
@@ -0,0 +1,627 @@
+#include "src/CpuTrace.h"
+#include "src/CpuTraceArm.h"
+#include "src/FileStream.h"
+#include "src/PosixFileStream.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+    using namespace CpuTrace;
+
+    enum class Workload
+    {
+        // Small loops over an array with loads and stores
+        Loop,
+        // Loops with DMA transfers of whole blocks between them
+        Dma,
+        // Loops interrupted every few dozen instructions by a handler reading and acknowledging a device
+        Interrupt,
+        COUNT
+    };
+
+    const char* getWorkloadName(Workload workload)
+    {
+        static const char* names[] = { "loop", "dma", "interrupt" };
+        return names[static_cast<size_t>(workload)];
+    }
+
+    const char* getEncodingName(Encoding encoding)
+    {
+        static const char* names[] = { "raw", "compact", "columnar" };
+        return names[static_cast<size_t>(encoding)];
+    }
+
+    const char* getVerifyModeName(VerifyMode mode)
+    {
+        static const char* names[] = { "every", "interval", "events", "delta" };
+        return names[static_cast<size_t>(mode)];
+    }
+
+    const uint32_t LoopBase = 0x00001000;
+    const uint32_t LoopSize = 16;
+    const uint32_t OuterBase = 0x00002000;
+    const uint32_t OuterSize = 6;
+    const uint32_t IrqVector = 0x00000018;
+    const uint32_t IrqSize = 10;
+    const uint32_t ArrayBase = 0x02000000;
+    const uint32_t DeviceBase = 0x04000000;
+    const uint32_t DmaSource = 0x08000000;
+    const uint32_t DmaTarget = 0x02200000;
+    const uint32_t DmaInterval = 4096;
+    const uint32_t DmaWordCount = 512;
+    const uint32_t IrqInterval = 48;
+    const uint32_t ModeIrq = 0x12;
+    const uint32_t ModeUsr = 0x10;
+
+    // Synthetic CPU whose next state only depends on its state and the values it reads, so replay reproduces it from the
+    // values of the trace. Reads and writes go through the functions given to step.
+    class Cpu
+    {
+    public:
+        Cpu()
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            memset(&mState, 0, sizeof(mState));
+            mState.usr.r[1] = 100;
+            mState.usr.r[15] = LoopBase;
+            mState.usr.cpsr = ModeUsr;
+            mIrqPending = false;
+        }
+
+        ARM::State& getState()
+        {
+            return mState;
+        }
+
+        void raiseIrq()
+        {
+            mIrqPending = true;
+        }
+
+        template <typename Read, typename Write>
+        void step(Read read, Write write)
+        {
+            auto& r = mState.usr.r;
+            if (mIrqPending)
+            {
+                mIrqPending = false;
+                mState.irq.r14 = r[15];
+                mState.irq.spsr = mState.usr.cpsr;
+                mState.usr.cpsr = (mState.usr.cpsr & ~0x1fu) | ModeIrq | 0x80;
+                r[15] = IrqVector;
+            }
+
+            auto pc = r[15];
+            auto opcode = read(pc, 4, ARM::MemoryAccess::Code);
+            r[0] = (r[0] ^ opcode) * 0x01000193u;
+            auto next = pc + 4;
+
+            if ((pc >= LoopBase) && (pc < LoopBase + LoopSize * 4))
+            {
+                switch ((pc - LoopBase) / 4)
+                {
+                case 2:
+                    r[4] += read(ArrayBase + (r[2] & 0xffc), 4, ARM::MemoryAccess::Data);
+                    r[2] += 4;
+                    break;
+
+                case 6:
+                    r[5] ^= read(ArrayBase + 0x1000 + (r[2] & 0x7fe), 2, ARM::MemoryAccess::Data);
+                    break;
+
+                case 9:
+                    write(ArrayBase + 0x2000 + (r[3] & 0xffc), r[4], 4, ARM::MemoryAccess::Data);
+                    r[3] += 4;
+                    break;
+
+                case 12:
+                    write(ArrayBase + 0x3000 + (r[0] & 0xff), r[0] & 0xff, 1, ARM::MemoryAccess::Data);
+                    break;
+
+                case LoopSize - 1:
+                    next = --r[1] ? LoopBase : OuterBase;
+                    break;
+                }
+            }
+            else if ((pc >= OuterBase) && (pc < OuterBase + OuterSize * 4))
+            {
+                if (pc == OuterBase + 4)
+                    r[1] = 64 + (read(DeviceBase + 0x10, 4, ARM::MemoryAccess::Data) & 63);
+                if (pc == OuterBase + (OuterSize - 1) * 4)
+                    next = LoopBase;
+            }
+            else if ((pc >= IrqVector) && (pc < IrqVector + IrqSize * 4))
+            {
+                if (pc == IrqVector + 8)
+                    r[6] += read(DeviceBase, 4, ARM::MemoryAccess::Data);
+                if (pc == IrqVector + 16)
+                    write(DeviceBase + 4, r[6], 4, ARM::MemoryAccess::Data);
+                if (pc == IrqVector + (IrqSize - 1) * 4)
+                {
+                    next = mState.irq.r14;
+                    mState.usr.cpsr = mState.irq.spsr;
+                }
+            }
+            else
+            {
+                next = LoopBase;
+            }
+            r[15] = next;
+            r[12] = (r[12] + 1) & 0xffff;
+            mState.usr.cpsr = (mState.usr.cpsr & 0x0fffffffu) | (r[0] & 0xf0000000u);
+        }
+
+    private:
+        ARM::State  mState;
+        bool        mIrqPending;
+    };
+
+    // Values read by the capture, a cheap generator standing in for memory and devices
+    class Memory
+    {
+    public:
+        Memory()
+            : mSeed(0x12345678)
+        {
+        }
+
+        uint32_t read(uint32_t addr, uint32_t type)
+        {
+            if (type == ARM::MemoryAccess::Code)
+                return (addr * 0x9e3779b1u) ^ (addr >> 7);
+            mSeed ^= mSeed << 13;
+            mSeed ^= mSeed >> 17;
+            mSeed ^= mSeed << 5;
+            return mSeed;
+        }
+
+    private:
+        uint32_t    mSeed;
+    };
+
+    class CaptureHandler : public ARM::ICaptureHandler
+    {
+    public:
+        explicit CaptureHandler(Cpu& cpu)
+            : mCpu(cpu)
+        {
+        }
+
+        virtual void start(ICapture&) override
+        {
+        }
+
+        virtual void stop(ICapture&) override
+        {
+        }
+
+        virtual void getState(ARM::State& state) override
+        {
+            state = mCpu.getState();
+        }
+
+    private:
+        Cpu&    mCpu;
+    };
+
+    // Runs the workload through a capture, returns the number of events recorded
+    uint64_t runWorkload(Workload workload, ICapture& capture, Cpu& cpu, uint64_t instructionCount)
+    {
+        Memory memory;
+        std::vector<uint32_t> block(DmaWordCount);
+        std::vector<uint32_t> addrs(DmaWordCount / 8);
+        uint64_t events = 0;
+        auto read = [&](uint32_t addr, uint32_t size, uint32_t type)
+        {
+            auto value = memory.read(addr, type);
+            ++events;
+            if (size == 4)
+            {
+                capture.read32(addr, value, type);
+                return value;
+            }
+            value &= size == 2 ? 0xffff : 0xff;
+            if (size == 2)
+                capture.read16(addr, value, type);
+            else
+                capture.read8(addr, value, type);
+            return value;
+        };
+        auto write = [&](uint32_t addr, uint32_t value, uint32_t size, uint32_t type)
+        {
+            ++events;
+            if (size == 4)
+                capture.write32(addr, value, type);
+            else if (size == 2)
+                capture.write16(addr, value & 0xffff, type);
+            else
+                capture.write8(addr, value & 0xff, type);
+        };
+
+        for (uint64_t instruction = 0; instruction < instructionCount; ++instruction)
+        {
+            capture.execute();
+            ++events;
+            if ((workload == Workload::Interrupt) && ((instruction % IrqInterval) == IrqInterval - 1))
+            {
+                // Interrupts are recorded before the instruction they divert
+                capture.interrupt(ARM::Interrupt::IRQ);
+                cpu.raiseIrq();
+                ++events;
+            }
+            cpu.step(read, write);
+
+            if ((workload == Workload::Dma) && ((instruction % DmaInterval) == DmaInterval - 1))
+            {
+                for (auto& word : block)
+                    word = memory.read(DmaSource, ARM::MemoryAccess::DMA);
+                auto offset = static_cast<uint32_t>((instruction / DmaInterval) % 16) * DmaWordCount * 4;
+                capture.readRange(DmaSource + offset, block.data(), 4, DmaWordCount, ARM::MemoryAccess::DMA);
+                capture.writeRange(DmaTarget + offset, block.data(), 4, DmaWordCount, ARM::MemoryAccess::DMA);
+                for (size_t index = 0; index < addrs.size(); ++index)
+                    addrs[index] = DmaTarget + static_cast<uint32_t>(index * 64) + (offset & 0x3c);
+                capture.writeScatter(addrs.data(), block.data(), 4, static_cast<uint32_t>(addrs.size()), ARM::MemoryAccess::DMA);
+                events += 3;
+            }
+        }
+        return events;
+    }
+
+    // Replays the CPU from the values of the trace, writes and transfers are not needed to reproduce it
+    class ReplayHandler : public ARM::IReplayHandler, public IReplay
+    {
+    public:
+        virtual void loadState(const ARM::State& state) override
+        {
+            mCpu.getState() = state;
+        }
+
+        virtual void getState(ARM::State& state) override
+        {
+            state = mCpu.getState();
+        }
+
+        virtual bool canSkip(uint32_t, uint32_t, uint32_t) override
+        {
+            return false;
+        }
+
+        virtual void getSkipRules(ISkipRules&) override
+        {
+        }
+
+        virtual void execute() override
+        {
+            mCpu.step([this](uint32_t, uint32_t, uint32_t)
+            {
+                uint32_t value = 0;
+                if (!mReads.empty())
+                {
+                    value = mReads.front();
+                    mReads.pop_front();
+                }
+                return value;
+            }, [](uint32_t, uint32_t, uint32_t, uint32_t) {});
+            mReads.clear();
+        }
+
+        virtual void syncState(const void*, size_t) override
+        {
+            mReads.clear();
+        }
+
+        virtual void interrupt(uint32_t) override
+        {
+            mCpu.raiseIrq();
+        }
+
+        virtual void signal(uint32_t) override
+        {
+        }
+
+        virtual void read8(uint32_t, uint32_t value, uint32_t) override
+        {
+            mReads.push_back(value);
+        }
+
+        virtual void read16(uint32_t, uint32_t value, uint32_t) override
+        {
+            mReads.push_back(value);
+        }
+
+        virtual void read32(uint32_t, uint32_t value, uint32_t) override
+        {
+            mReads.push_back(value);
+        }
+
+        virtual void write8(uint32_t, uint32_t, uint32_t) override
+        {
+        }
+
+        virtual void write16(uint32_t, uint32_t, uint32_t) override
+        {
+        }
+
+        virtual void write32(uint32_t, uint32_t, uint32_t) override
+        {
+        }
+
+        virtual void readRange(uint32_t, const void*, uint32_t, uint32_t, uint32_t) override
+        {
+        }
+
+        virtual void writeRange(uint32_t, const void*, uint32_t, uint32_t, uint32_t) override
+        {
+        }
+
+        virtual void readGather(const uint32_t*, const void*, uint32_t, uint32_t, uint32_t) override
+        {
+        }
+
+        virtual void writeScatter(const uint32_t*, const void*, uint32_t, uint32_t, uint32_t) override
+        {
+        }
+
+    private:
+        Cpu                     mCpu;
+        std::deque<uint32_t>    mReads;
+    };
+
+    // Keeps the size of the reports of an analysis
+    class Analytics : public ITraceAnalytics
+    {
+    public:
+        Analytics()
+            : mHotCodeCount(0)
+            , mPageCount(0)
+        {
+        }
+
+        virtual void hotCode(uint32_t, uint64_t) override
+        {
+            ++mHotCodeCount;
+        }
+
+        virtual void pageAccesses(uint32_t, uint32_t, uint64_t, uint64_t) override
+        {
+            ++mPageCount;
+        }
+
+        uint32_t    mHotCodeCount;
+        uint32_t    mPageCount;
+    };
+
+    double getSeconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Peak resident memory of the process, reset before each run where the system allows it
+    void resetPeakMemory()
+    {
+#if defined(__linux__)
+        if (auto file = fopen("/proc/self/clear_refs", "w"))
+        {
+            fputs("5", file);
+            fclose(file);
+        }
+#endif
+    }
+
+    uint64_t getPeakMemory()
+    {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters;
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return 0;
+        return counters.PeakWorkingSetSize;
+#else
+#if defined(__linux__)
+        if (auto file = fopen("/proc/self/status", "r"))
+        {
+            char line[256];
+            unsigned long long size = 0;
+            while (fgets(line, sizeof(line), file))
+            {
+                if (sscanf(line, "VmHWM: %llu kB", &size) == 1)
+                    break;
+            }
+            fclose(file);
+            if (size)
+                return size * 1024;
+        }
+#endif
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+        return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+    }
+
+#if defined(_WIN32)
+    typedef FileStream TraceFile;
+
+    TraceFile* openFile(const char* path, bool write)
+    {
+        return new FileStream(path, write ? "wb" : "rb");
+    }
+#else
+    typedef PosixFileStream TraceFile;
+
+    TraceFile* openFile(const char* path, bool write)
+    {
+        return new PosixFileStream(path, write ? PosixFileStream::Mode::Write : PosixFileStream::Mode::Read);
+    }
+#endif
+
+    struct Result
+    {
+        uint64_t    events;
+        uint64_t    traceBytes;
+        uint64_t    peakMemory;
+        double      captureTime;
+        double      saveTime;
+        double      loadTime;
+        double      replayTime;
+        double      analyzeTime;
+        bool        replayed;
+        bool        analyzed;
+    };
+
+    struct Config
+    {
+        Workload    workload;
+        Encoding    encoding;
+        uint32_t    compressionLevel;
+        VerifyMode  verifyMode;
+        size_t      chunkSize;
+    };
+
+    // Every workload with every encoding, then compact traces verified on events in small chunks, many of them ending
+    // on a block of instructions held back without hashes
+    std::vector<Config> getConfigs()
+    {
+        std::vector<Config> configs;
+        for (uint32_t workload = 0; workload < static_cast<uint32_t>(Workload::COUNT); ++workload)
+        {
+            for (uint32_t encoding = 0; encoding <= static_cast<uint32_t>(Encoding::Columnar); ++encoding)
+            {
+                for (uint32_t compressionLevel = 0; compressionLevel <= 1; ++compressionLevel)
+                {
+                    Config config = { static_cast<Workload>(workload), static_cast<Encoding>(encoding), compressionLevel, VerifyMode::Every, CaptureSettings::DefaultChunkSize };
+                    configs.push_back(config);
+                }
+            }
+        }
+        for (uint32_t workload = 0; workload < static_cast<uint32_t>(Workload::COUNT); ++workload)
+        {
+            Config config = { static_cast<Workload>(workload), Encoding::Compact, 0, VerifyMode::Events, 4096 };
+            configs.push_back(config);
+        }
+        return configs;
+    }
+
+    Result run(IContext& context, const Config& config, uint64_t instructionCount, const char* path)
+    {
+        Result result = {};
+        resetPeakMemory();
+
+        Cpu cpu;
+        CaptureHandler captureHandler(cpu);
+        auto& captureDevice = ARM::createCaptureDevice("arm", captureHandler);
+        auto& trace = context.createTrace();
+        CaptureSettings settings;
+        settings.encoding = config.encoding;
+        settings.compressionLevel = config.compressionLevel;
+        settings.verifyPolicy.mode = config.verifyMode;
+        settings.chunkSize = config.chunkSize;
+
+        auto start = std::chrono::steady_clock::now();
+        auto& capture = context.startCapture(captureDevice, trace, settings);
+        result.events = runWorkload(config.workload, capture, cpu, instructionCount);
+        context.stopCapture(capture);
+        result.captureTime = getSeconds(start);
+        result.peakMemory = getPeakMemory();
+        ARM::destroyCaptureDevice(captureDevice);
+
+        {
+            std::unique_ptr<TraceFile> file(openFile(path, true));
+            start = std::chrono::steady_clock::now();
+            context.saveTrace(trace, *file);
+            file->flush();
+            result.traceBytes = file->size();
+            file.reset();
+            result.saveTime = getSeconds(start);
+        }
+
+        auto& loaded = context.createTrace();
+        {
+            start = std::chrono::steady_clock::now();
+            std::unique_ptr<TraceFile> file(openFile(path, false));
+            context.loadTrace(loaded, *file);
+            result.loadTime = getSeconds(start);
+        }
+        remove(path);
+
+        ReplayHandler replayHandler;
+        auto& replayDevice = ARM::createReplayDevice("arm", replayHandler);
+        start = std::chrono::steady_clock::now();
+        auto& replayer = context.startReplay(replayDevice, replayHandler, loaded);
+        auto status = replayer.run(UINT64_MAX);
+        result.replayTime = getSeconds(start);
+        ReplayStats stats;
+        replayer.getStats(stats);
+        result.replayed = (status == ReplayStatus::Completed) && !stats.divergenceCount && (replayer.getInstruction() == instructionCount);
+        context.stopReplay(replayer);
+        ARM::destroyReplayDevice(replayDevice);
+
+        Analytics analytics;
+        AnalyticsResult analyticsResult;
+        auto analyzed = context.analyzeTrace(loaded, AnalyticsSettings(), analytics, analyticsResult);
+        result.analyzeTime = static_cast<double>(analyticsResult.time) * 1e-9;
+        result.analyzed = analyzed && (analyticsResult.instructionCount == instructionCount) && analytics.mHotCodeCount && analytics.mPageCount;
+
+        context.destroyTrace(loaded);
+        context.destroyTrace(trace);
+        return result;
+    }
+}
+
+// Captures, saves, loads, replays and analyzes synthetic workloads with every encoding, one JSON object per line
+int main(int argc, char** argv)
+{
+    if (argc > 3)
+    {
+        printf("usage: Benchmark [instructions] [trace path]\n");
+        return 2;
+    }
+    uint64_t instructionCount = argc > 1 ? strtoull(argv[1], nullptr, 0) : 2000000;
+    const char* path = argc > 2 ? argv[2] : "Benchmark.trace";
+
+    auto& context = createContext();
+    int status = 0;
+    for (const auto& config : getConfigs())
+    {
+        auto result = run(context, config, instructionCount, path);
+        auto megabytes = static_cast<double>(result.traceBytes) / (1024.0 * 1024.0);
+        printf("{\"workload\": \"%s\", \"encoding\": \"%s\", \"compressionLevel\": %u, \"verifyMode\": \"%s\", \"chunkSize\": %llu, \"instructions\": %llu, "
+            "\"events\": %llu, \"captureNsPerEvent\": %.3f, \"captureNsPerInstruction\": %.3f, \"bytesPerInstruction\": %.3f, \"traceBytes\": %llu, "
+            "\"peakMemoryBytes\": %llu, \"saveMBPerSecond\": %.1f, \"loadMBPerSecond\": %.1f, \"replayInstructionsPerSecond\": %.0f, \"replayed\": %s, "
+            "\"analyzeInstructionsPerSecond\": %.0f, \"analyzed\": %s}\n",
+            getWorkloadName(config.workload), getEncodingName(config.encoding), config.compressionLevel, getVerifyModeName(config.verifyMode),
+            static_cast<unsigned long long>(config.chunkSize), static_cast<unsigned long long>(instructionCount), static_cast<unsigned long long>(result.events),
+            result.captureTime * 1e9 / static_cast<double>(result.events), result.captureTime * 1e9 / static_cast<double>(instructionCount),
+            static_cast<double>(result.traceBytes) / static_cast<double>(instructionCount), static_cast<unsigned long long>(result.traceBytes),
+            static_cast<unsigned long long>(result.peakMemory), megabytes / result.saveTime, megabytes / result.loadTime,
+            static_cast<double>(instructionCount) / result.replayTime, result.replayed ? "true" : "false",
+            static_cast<double>(instructionCount) / result.analyzeTime, result.analyzed ? "true" : "false");
+        fflush(stdout);
+        if (!result.replayed || !result.analyzed)
+            status = 1;
+    }
+    destroyContext(context);
+    return status;
+}
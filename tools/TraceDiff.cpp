@@ -0,0 +1,88 @@
+#include "src/CpuTrace.h"
+#include <cstdio>
+#include <cstdlib>
+
+namespace
+{
+    using namespace CpuTrace;
+
+    const char* getCommandName(RecordCommand command)
+    {
+        static const char* names[] = { "End", "State", "Execute", "Interrupt", "Signal", "Sync", "Read8", "Read16", "Read32", "Write8", "Write16", "Write32" };
+        auto index = static_cast<size_t>(command);
+        return index < sizeof(names) / sizeof(names[0]) ? names[index] : "Unknown";
+    }
+
+    void printRecord(const char* side, const DiffRecord& record)
+    {
+        printf("%s: instruction %llu %s", side, static_cast<unsigned long long>(record.instruction), getCommandName(record.command));
+        switch (record.command)
+        {
+        case RecordCommand::State:
+        case RecordCommand::Execute:
+        case RecordCommand::Sync:
+            printf(" data %016llx", static_cast<unsigned long long>(record.data));
+            break;
+
+        case RecordCommand::Interrupt:
+        case RecordCommand::Signal:
+            printf(" type %u", record.value);
+            break;
+
+        case RecordCommand::End:
+            break;
+
+        default:
+            printf(" addr %08x value %08x type %u", record.addr, record.value, record.type);
+            break;
+        }
+        printf("\n");
+    }
+}
+
+// Prints the first record of a stream that differs between two trace files
+int main(int argc, char** argv)
+{
+    if ((argc < 3) || (argc > 4))
+    {
+        printf("usage: TraceDiff left right [stream]\n");
+        return 2;
+    }
+
+    auto& context = createContext();
+    auto& left = context.createTrace();
+    auto& right = context.createTrace();
+    auto stream = argc > 3 ? static_cast<uint32_t>(strtoul(argv[3], nullptr, 0)) : 0;
+
+    int status = 2;
+    DiffResult result;
+    if (!context.mapTrace(left, argv[1]) || !context.mapTrace(right, argv[2]))
+    {
+        printf("cannot read traces\n");
+    }
+    else if (!context.diffTraces(left, right, stream, result))
+    {
+        printf("cannot compare stream %u\n", stream);
+    }
+    else
+    {
+        if (result.different)
+        {
+            printf("traces differ\n");
+            printRecord("left ", result.records[0]);
+            printRecord("right", result.records[1]);
+        }
+        else
+        {
+            printf("traces are identical\n");
+        }
+        printf("%u chunks skipped, %u chunks decoded, %llu records compared in %.3f ms\n", result.skippedChunkCount, result.decodedChunkCount,
+            static_cast<unsigned long long>(result.recordCount), static_cast<double>(result.time) / 1e6);
+        status = result.different ? 1 : 0;
+    }
+
+    context.destroyTrace(left);
+    context.destroyTrace(right);
+    destroyContext(context);
+    return status;
+}